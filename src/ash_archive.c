@@ -0,0 +1,1113 @@
+/*
+ * ash_archive.c
+ *
+ * On-disk archive of the active session history.
+ *
+ * The worker regularly moves the entries of the ring buffer to append-only
+ * segment files in $PGDATA/pg_sentinel.  A segment is a file header followed
+ * by blocks of up to ASH_ARCHIVE_BLOCK_ROWS entries.  Blocks are columnar:
+ * each column is stored as an array (the strings as indexes into a per block
+ * dictionary), then compressed with pglz.  The block header carries the
+ * sequence and time range of its entries, so readers skip the blocks outside
+ * of the range they look for without decoding them.
+ *
+ * Segments are only appended to by the worker, and a new worker always
+ * starts a new segment, so a torn block can only be at the end of a segment.
+ * Readers stop at the first invalid block.  Readers map the segments, and
+ * scans decode one block at a time, so that they use a bounded amount of
+ * memory and can return the entries as they go.
+ *
+ * Copyright (c) 2018-2026, PgSentinel
+ *
+ * IDENTIFICATION:
+ * https://github.com/pgsentinel/pgsentinel
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ */
+
+#include "postgres.h"
+#include "pgsentinel.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access/hash.h"
+#include "common/pg_lzcompress.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "port/pg_crc32c.h"
+#include "storage/fd.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+/* GUC variables */
+int ash_archive_flush_interval = 0;
+int ash_archive_segment_size = 64;
+int ash_archive_max_size = 1024;
+int ash_archive_max_age = 7 * 24 * 60 * 60;
+
+#define ASH_ARCHIVE_DIR			"pg_sentinel"
+#define ASH_ARCHIVE_PREFIX		"ash_"
+#define ASH_ARCHIVE_SUFFIX		".seg"
+
+/* "ash_" + 16 hex digits + ".seg" */
+#define ASH_ARCHIVE_NAME_LEN	24
+
+/* Magic numbers identifying the segment and block formats */
+static const uint32 ASH_ARCHIVE_FILE_HEADER = 0x50534101;
+static const uint32 ASH_ARCHIVE_BLOCK_HEADER = 0x50534203;
+
+/* Maximum number of entries in a block */
+#define ASH_ARCHIVE_BLOCK_ROWS	8192
+
+typedef struct ashArchiveFileHeader
+{
+	uint32 magic;
+	uint32 block_rows;			/* ASH_ARCHIVE_BLOCK_ROWS when written */
+} ashArchiveFileHeader;
+
+typedef struct ashArchiveBlockHeader
+{
+	uint32 magic;
+	uint32 size;				/* size of the columns following the header */
+	uint32 nrows;
+	uint32 nstrings;			/* dictionary strings, not counting NULL */
+	uint64 first_seq;
+	uint64 last_seq;
+	TimestampTz min_time;
+	TimestampTz max_time;
+	pg_crc32c crc;				/* CRC-32C of the columns */
+} ashArchiveBlockHeader;
+
+/* Header of a column in a block, followed by its (compressed) data */
+typedef struct ashArchiveColumnHeader
+{
+	uint32 rawsize;
+	int32 size;					/* -1 if not compressed */
+} ashArchiveColumnHeader;
+
+/*
+ * Columns of a block, in file order.  A width of 0 means a string, stored as
+ * a uint32 index in the block dictionary (0 for NULL).  Delta columns are
+ * stored as the difference with the previous row, so that the steadily
+ * increasing ones compress well.  The dictionary itself is the last column.
+ */
+typedef struct ashArchiveColumn
+{
+	Size offset;				/* of the field in ashRow */
+	int width;
+	bool delta;
+} ashArchiveColumn;
+
+static const ashArchiveColumn ash_archive_columns[] =
+{
+	{offsetof(ashRow, seq), sizeof(uint64), true},
+	{offsetof(ashRow, ash_time), sizeof(TimestampTz), true},
+	{offsetof(ashRow, datid), sizeof(Oid), false},
+	{offsetof(ashRow, datname), 0, false},
+	{offsetof(ashRow, pid), sizeof(int), false},
+	{offsetof(ashRow, leader_pid), sizeof(int), false},
+	{offsetof(ashRow, usesysid), sizeof(Oid), false},
+	{offsetof(ashRow, usename), 0, false},
+	{offsetof(ashRow, application_name), 0, false},
+	{offsetof(ashRow, client_addr), 0, false},
+	{offsetof(ashRow, client_hostname), 0, false},
+	{offsetof(ashRow, client_port), sizeof(int), false},
+	{offsetof(ashRow, backend_start), sizeof(TimestampTz), false},
+	{offsetof(ashRow, xact_start), sizeof(TimestampTz), false},
+	{offsetof(ashRow, query_start), sizeof(TimestampTz), false},
+	{offsetof(ashRow, state_change), sizeof(TimestampTz), false},
+	{offsetof(ashRow, wait_event_info), sizeof(uint32), false},
+	{offsetof(ashRow, state), 0, false},
+	{offsetof(ashRow, backend_xid), sizeof(TransactionId), false},
+	{offsetof(ashRow, backend_xmin), sizeof(TransactionId), false},
+	{offsetof(ashRow, top_level_query), 0, false},
+	{offsetof(ashRow, query), 0, false},
+	{offsetof(ashRow, cmdtype), 0, false},
+	{offsetof(ashRow, queryid), sizeof(uint64), false},
+	{offsetof(ashRow, backend_type), 0, false},
+	{offsetof(ashRow, blockers), sizeof(int), false},
+	{offsetof(ashRow, blockerpid), sizeof(int), false},
+	{offsetof(ashRow, blocker_state), 0, false},
+	{offsetof(ashRow, root_blockerpid), sizeof(int), false},
+	{offsetof(ashRow, blocker_depth), sizeof(int), false},
+	{offsetof(ashRow, sample_weight), sizeof(double), false},
+};
+
+#define ASH_ARCHIVE_NCOLUMNS	lengthof(ash_archive_columns)
+
+/* Block dictionary under construction */
+typedef struct ashArchiveDictEntry
+{
+	uint64 hash;				/* hash key, must be first */
+	uint32 index;
+} ashArchiveDictEntry;
+
+typedef struct ashArchiveDict
+{
+	HTAB *hash;
+	StringInfoData strings;		/* NUL separated */
+	uint32 *offsets;			/* of each string in strings, from index 1 */
+	uint32 nstrings;
+} ashArchiveDict;
+
+/* Segment the worker is appending to, a new worker starts a new one */
+static char ash_archive_segment[MAXPGPATH];
+/* whether it was written since its last fsync */
+static bool ash_archive_unsynced = false;
+
+static uint64
+ash_archive_hash(const char *str)
+{
+#if PG_VERSION_NUM >= 110000
+	return DatumGetUInt64(hash_any_extended((const unsigned char *) str,
+											strlen(str), 0));
+#else
+	return DatumGetUInt32(hash_any((const unsigned char *) str, strlen(str)));
+#endif
+}
+
+/* Index of a string in the block dictionary, 0 for NULL */
+static uint32
+ash_archive_dict_index(ashArchiveDict *dict, const char *str, int nrows)
+{
+	ashArchiveDictEntry *entry;
+	uint64 hash;
+	bool found;
+
+	if (str == NULL)
+		return 0;
+
+	hash = ash_archive_hash(str);
+	entry = (ashArchiveDictEntry *) hash_search(dict->hash, &hash, HASH_ENTER,
+												&found);
+	if (found && strcmp(dict->strings.data + dict->offsets[entry->index],
+						str) == 0)
+		return entry->index;
+
+	/* New string, or a hash collision that simply gets its own index */
+	if (dict->nstrings + 1 >= (uint32) (ASH_ARCHIVE_NCOLUMNS * nrows + 1))
+		elog(ERROR, "pgsentinel archive dictionary overflow");
+	dict->nstrings++;
+	dict->offsets[dict->nstrings] = dict->strings.len;
+	appendBinaryStringInfo(&dict->strings, str, strlen(str) + 1);
+	if (!found)
+		entry->index = dict->nstrings;
+
+	return dict->nstrings;
+}
+
+/* Append a column to buf, compressed if worth it */
+static void
+ash_archive_put_column(StringInfo buf, const char *data, uint32 rawsize)
+{
+	ashArchiveColumnHeader header;
+	char *compressed;
+	int32 size;
+
+	compressed = palloc(PGLZ_MAX_OUTPUT(rawsize));
+	size = pglz_compress(data, rawsize, compressed, PGLZ_strategy_default);
+
+	header.rawsize = rawsize;
+	header.size = size;
+	appendBinaryStringInfo(buf, (char *) &header, sizeof(header));
+	if (size >= 0)
+		appendBinaryStringInfo(buf, compressed, size);
+	else
+		appendBinaryStringInfo(buf, data, rawsize);
+
+	pfree(compressed);
+}
+
+/* Encode rows as a block, header included */
+static void
+ash_archive_encode_block(StringInfo buf, const ashRow *rows, int nrows)
+{
+	ashArchiveBlockHeader header;
+	ashArchiveDict dict;
+	HASHCTL info;
+	Size col;
+	int i;
+
+	MemSet(&header, 0, sizeof(header));
+	header.magic = ASH_ARCHIVE_BLOCK_HEADER;
+	header.nrows = nrows;
+	header.first_seq = rows[0].seq;
+	header.last_seq = rows[nrows - 1].seq;
+	header.min_time = rows[0].ash_time;
+	header.max_time = rows[0].ash_time;
+	for (i = 1; i < nrows; i++)
+	{
+		header.min_time = Min(header.min_time, rows[i].ash_time);
+		header.max_time = Max(header.max_time, rows[i].ash_time);
+	}
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(uint64);
+	info.entrysize = sizeof(ashArchiveDictEntry);
+	info.hcxt = CurrentMemoryContext;
+	dict.hash = hash_create("pgsentinel archive dictionary", 1024, &info,
+							HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	initStringInfo(&dict.strings);
+	dict.offsets = palloc(sizeof(uint32) * (ASH_ARCHIVE_NCOLUMNS * nrows + 1));
+	dict.nstrings = 0;
+
+	/* the header is filled last */
+	appendBinaryStringInfo(buf, (char *) &header, sizeof(header));
+
+	for (col = 0; col < ASH_ARCHIVE_NCOLUMNS; col++)
+	{
+		const ashArchiveColumn *column = &ash_archive_columns[col];
+		int width = column->width ? column->width : (int) sizeof(uint32);
+		char *data = palloc(width * nrows);
+		uint64 prev = 0;
+
+		for (i = 0; i < nrows; i++)
+		{
+			const char *field = (const char *) &rows[i] + column->offset;
+			char *value = data + width * i;
+
+			if (column->width == 0)
+			{
+				uint32 index = ash_archive_dict_index(&dict,
+													  *(const char *const *) field,
+													  nrows);
+
+				memcpy(value, &index, sizeof(uint32));
+			}
+			else if (column->delta)
+			{
+				uint64 cur;
+
+				Assert(column->width == sizeof(uint64));
+				memcpy(&cur, field, sizeof(uint64));
+				cur -= prev;
+				memcpy(value, &cur, sizeof(uint64));
+				prev += cur;
+			}
+			else
+				memcpy(value, field, width);
+		}
+
+		ash_archive_put_column(buf, data, width * nrows);
+		pfree(data);
+	}
+
+	ash_archive_put_column(buf, dict.strings.data, dict.strings.len);
+
+	header.nstrings = dict.nstrings;
+	header.size = buf->len - sizeof(header);
+	INIT_CRC32C(header.crc);
+	COMP_CRC32C(header.crc, buf->data + sizeof(header), header.size);
+	FIN_CRC32C(header.crc);
+	memcpy(buf->data, &header, sizeof(header));
+
+	hash_destroy(dict.hash);
+}
+
+/* Read a column of a block, returns NULL if it is invalid */
+static char *
+ash_archive_get_column(const char **pos, const char *end, uint32 rawsize)
+{
+	ashArchiveColumnHeader header;
+	char *data;
+
+	if (end - *pos < (long) sizeof(header))
+		return NULL;
+	memcpy(&header, *pos, sizeof(header));
+	*pos += sizeof(header);
+
+	if (header.rawsize != rawsize)
+		return NULL;
+
+	/* one more byte so that the dictionary is always terminated */
+	data = palloc(rawsize + 1);
+	data[rawsize] = '\0';
+
+	if (header.size < 0)
+	{
+		if ((uint32) (end - *pos) < rawsize)
+			return NULL;
+		memcpy(data, *pos, rawsize);
+		*pos += rawsize;
+	}
+	else
+	{
+		if (end - *pos < header.size)
+			return NULL;
+#if PG_VERSION_NUM >= 120000
+		if (pglz_decompress(*pos, header.size, data, rawsize, true) != (int32) rawsize)
+#else
+		if (pglz_decompress(*pos, header.size, data, rawsize) != (int32) rawsize)
+#endif
+			return NULL;
+		*pos += header.size;
+	}
+
+	return data;
+}
+
+/* A scan of the archive, see ash_archive_begin_scan */
+struct ashArchiveScan
+{
+	TimestampTz from;
+	TimestampTz to;
+	uint64 seq_lo;
+	uint64 seq_hi;
+	char **names;				/* of the segments, in history order */
+	int nsegments;
+	int segment;				/* segment being read */
+	char *map;					/* of the segment, NULL if not mapped */
+	Size mapsize;
+	Size offset;				/* of the next block in the mapping */
+	MemoryContext scan_context;	/* of the scan, unmaps the segment */
+	MemoryContext block_context;	/* of the current block */
+	/* current block */
+	uint32 nrows;
+	uint32 row;					/* next row to return */
+	uint32 nstrings;
+	char *columns[ASH_ARCHIVE_NCOLUMNS];
+	const char **dict;
+	uint64 prev[ASH_ARCHIVE_NCOLUMNS];	/* previous values of delta columns */
+};
+
+/*
+ * Decode the columns of a block in the block context of scan.
+ * Returns false if the block is invalid.
+ */
+static bool
+ash_archive_decode_block(ashArchiveScan *scan,
+						 const ashArchiveBlockHeader *header, const char *pos)
+{
+	const char *end = pos + header->size;
+	ashArchiveColumnHeader dict_header;
+	char *strings;
+	char *strings_end;
+	Size col;
+	uint32 i;
+
+	for (col = 0; col < ASH_ARCHIVE_NCOLUMNS; col++)
+	{
+		const ashArchiveColumn *column = &ash_archive_columns[col];
+		int width = column->width ? column->width : (int) sizeof(uint32);
+
+		scan->columns[col] = ash_archive_get_column(&pos, end,
+													width * header->nrows);
+		if (scan->columns[col] == NULL)
+			return false;
+		scan->prev[col] = 0;
+	}
+
+	/* the dictionary, its size is only known from its column header */
+	if (end - pos < (long) sizeof(ashArchiveColumnHeader))
+		return false;
+	memcpy(&dict_header, pos, sizeof(dict_header));
+	strings = ash_archive_get_column(&pos, end, dict_header.rawsize);
+	if (strings == NULL)
+		return false;
+	strings_end = strings + dict_header.rawsize;
+
+	scan->dict = palloc(sizeof(char *) * (header->nstrings + 1));
+	scan->dict[0] = NULL;
+	for (i = 1; i <= header->nstrings; i++)
+	{
+		if (strings >= strings_end)
+			return false;
+		scan->dict[i] = strings;
+		strings += strlen(strings) + 1;
+	}
+
+	scan->nrows = header->nrows;
+	scan->nstrings = header->nstrings;
+	scan->row = 0;
+
+	return true;
+}
+
+/*
+ * Next row of the current block of scan.  Rows are decoded in order, as the
+ * delta columns depend on the previous row.  Returns false if it is invalid.
+ */
+static bool
+ash_archive_block_row(ashArchiveScan *scan, ashRow *row)
+{
+	uint32 i = scan->row++;
+	Size col;
+
+	for (col = 0; col < ASH_ARCHIVE_NCOLUMNS; col++)
+	{
+		const ashArchiveColumn *column = &ash_archive_columns[col];
+		char *field = (char *) row + column->offset;
+		int width = column->width ? column->width : (int) sizeof(uint32);
+		const char *value = scan->columns[col] + width * i;
+
+		if (column->width == 0)
+		{
+			uint32 index;
+
+			memcpy(&index, value, sizeof(uint32));
+			if (index > scan->nstrings)
+				return false;
+			*(const char **) field = scan->dict[index];
+		}
+		else if (column->delta)
+		{
+			uint64 delta;
+
+			memcpy(&delta, value, sizeof(uint64));
+			scan->prev[col] += delta;
+			memcpy(field, &scan->prev[col], sizeof(uint64));
+		}
+		else
+			memcpy(field, value, width);
+	}
+
+	return true;
+}
+
+/* qsort comparator for segment names, which sort in history order */
+static int
+ash_archive_name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Sequence number of the first entry of a segment, from its name */
+static uint64
+ash_archive_first_seq(const char *path)
+{
+	uint32 hi;
+	uint32 lo;
+
+	if (sscanf(path, ASH_ARCHIVE_DIR "/" ASH_ARCHIVE_PREFIX "%08X%08X",
+			   &hi, &lo) != 2)
+		return 0;
+	return ((uint64) hi << 32) | lo;
+}
+
+/* Sorted list of the segment file names, NULL terminated */
+static char **
+ash_archive_list(int *nsegments)
+{
+	DIR *dir;
+	struct dirent *de;
+	char **names;
+	int n = 0;
+	int size = 16;
+
+	names = palloc(sizeof(char *) * size);
+
+	dir = AllocateDir(ASH_ARCHIVE_DIR);
+	if (dir == NULL && errno == ENOENT)
+	{
+		*nsegments = 0;
+		names[0] = NULL;
+		return names;
+	}
+
+	while ((de = ReadDir(dir, ASH_ARCHIVE_DIR)) != NULL)
+	{
+		if (strlen(de->d_name) != ASH_ARCHIVE_NAME_LEN ||
+			strncmp(de->d_name, ASH_ARCHIVE_PREFIX,
+					strlen(ASH_ARCHIVE_PREFIX)) != 0)
+			continue;
+
+		if (n + 1 >= size)
+		{
+			size *= 2;
+			names = repalloc(names, sizeof(char *) * size);
+		}
+		names[n++] = psprintf("%s/%s", ASH_ARCHIVE_DIR, de->d_name);
+	}
+	FreeDir(dir);
+
+	qsort(names, n, sizeof(char *), ash_archive_name_cmp);
+	names[n] = NULL;
+	*nsegments = n;
+
+	return names;
+}
+
+/*
+ * Map a whole segment, its size is returned in *size.  Returns NULL if it
+ * has been removed (by the retention since it was listed) or is smaller
+ * than min_size.  The mapping stays valid once the file is removed.
+ */
+static char *
+ash_archive_map(const char *path, Size min_size, Size *size)
+{
+	struct stat st;
+	char *map;
+	int fd;
+
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return NULL;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", path)));
+	}
+
+	if (fstat(fd, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+
+	if ((Size) st.st_size < min_size || st.st_size == 0)
+	{
+		CloseTransientFile(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	CloseTransientFile(fd);
+	if (map == MAP_FAILED)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not map file \"%s\": %m", path)));
+
+	*size = st.st_size;
+	return map;
+}
+
+/*
+ * Call callback for each block header of a segment, with the block columns,
+ * until it returns false.  Returns false if the segment could not be read.
+ */
+typedef bool (*ash_archive_block_callback) (const ashArchiveBlockHeader *header,
+											const char *columns, void *arg);
+
+static bool
+ash_archive_walk(const char *path, ash_archive_block_callback callback,
+				 void *arg)
+{
+	ashArchiveFileHeader fheader;
+	char *map;
+	Size size;
+	const char *pos;
+	const char *end;
+
+	map = ash_archive_map(path, sizeof(ashArchiveFileHeader), &size);
+	if (map == NULL)
+		return false;
+
+	memcpy(&fheader, map, sizeof(fheader));
+	pos = map + sizeof(fheader);
+	end = map + size;
+
+	if (fheader.magic == ASH_ARCHIVE_FILE_HEADER)
+	{
+		while (end - pos >= (long) sizeof(ashArchiveBlockHeader))
+		{
+			ashArchiveBlockHeader header;
+
+			memcpy(&header, pos, sizeof(header));
+			pos += sizeof(header);
+
+			/* a torn block can only be the last one */
+			if (header.magic != ASH_ARCHIVE_BLOCK_HEADER ||
+				header.nrows == 0 ||
+				(uint32) (end - pos) < header.size)
+				break;
+
+			if (!callback(&header, pos, arg))
+				break;
+
+			pos += header.size;
+		}
+	}
+
+	munmap(map, size);
+
+	return true;
+}
+
+/* Check the checksum of a block */
+static bool
+ash_archive_block_valid(const ashArchiveBlockHeader *header,
+						const char *columns)
+{
+	pg_crc32c crc;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, columns, header->size);
+	FIN_CRC32C(crc);
+
+	return EQ_CRC32C(crc, header->crc);
+}
+
+/* Unmap the segment of a scan, also called when its memory is released */
+static void
+ash_archive_unmap(void *arg)
+{
+	ashArchiveScan *scan = (ashArchiveScan *) arg;
+
+	if (scan->map != NULL)
+		munmap(scan->map, scan->mapsize);
+	scan->map = NULL;
+	scan->mapsize = 0;
+}
+
+/*
+ * Map the segment being read by scan, at least min_size bytes of it, in
+ * place of its current mapping.  Returns false, keeping the mapping, if it
+ * is not that large.
+ */
+static bool
+ash_archive_map_segment(ashArchiveScan *scan, Size min_size)
+{
+	char *map;
+	Size size;
+
+	map = ash_archive_map(scan->names[scan->segment], min_size, &size);
+	if (map == NULL)
+		return false;
+
+	ash_archive_unmap(scan);
+	scan->map = map;
+	scan->mapsize = size;
+	return true;
+}
+
+/*
+ * Decode the next block of scan holding entries in its ranges, in its block
+ * context.  Returns false at the end of the scan.
+ *
+ * The segment stays mapped between the rows returned by the scan, and is
+ * mapped again when blocks were appended to it past its mapping.
+ */
+static bool
+ash_archive_next_block(ashArchiveScan *scan)
+{
+	while (scan->segment < scan->nsegments)
+	{
+		const char *path = scan->names[scan->segment];
+		bool past_range = false;
+
+		if (scan->map == NULL)
+		{
+			ashArchiveFileHeader fheader;
+
+			/*
+			 * A segment only holds entries older than the first one of the
+			 * next segment, whose name is its first sequence number.
+			 */
+			if (scan->segment + 1 < scan->nsegments &&
+				ash_archive_first_seq(scan->names[scan->segment + 1]) <= scan->seq_lo)
+			{
+				scan->segment++;
+				continue;
+			}
+
+			if (!ash_archive_map_segment(scan, sizeof(fheader)))
+			{
+				scan->segment++;
+				continue;
+			}
+
+			memcpy(&fheader, scan->map, sizeof(fheader));
+			if (fheader.magic != ASH_ARCHIVE_FILE_HEADER)
+			{
+				ash_archive_unmap(scan);
+				scan->segment++;
+				continue;
+			}
+			scan->offset = sizeof(fheader);
+		}
+
+		for (;;)
+		{
+			ashArchiveBlockHeader header;
+			const char *columns;
+
+			/* the end of the mapping, or a block appended since */
+			if (scan->mapsize - scan->offset < sizeof(header))
+			{
+				if (ash_archive_map_segment(scan, scan->mapsize + 1))
+					continue;
+				break;
+			}
+
+			/* a torn block can only be the last one */
+			memcpy(&header, scan->map + scan->offset, sizeof(header));
+			if (header.magic != ASH_ARCHIVE_BLOCK_HEADER ||
+				header.nrows == 0)
+				break;
+
+			if (scan->mapsize - scan->offset - sizeof(header) < header.size)
+			{
+				if (ash_archive_map_segment(scan, scan->mapsize + 1))
+					continue;
+				break;
+			}
+
+			if (header.first_seq > scan->seq_hi)
+			{
+				past_range = true;
+				break;
+			}
+
+			columns = scan->map + scan->offset + sizeof(header);
+			scan->offset += sizeof(header) + header.size;
+
+			if (header.last_seq < scan->seq_lo ||
+				header.max_time < scan->from || header.min_time > scan->to)
+				continue;
+
+			MemoryContextReset(scan->block_context);
+			if (ash_archive_block_valid(&header, columns))
+			{
+				MemoryContext oldcontext;
+				bool valid;
+
+				oldcontext = MemoryContextSwitchTo(scan->block_context);
+				valid = ash_archive_decode_block(scan, &header, columns);
+				MemoryContextSwitchTo(oldcontext);
+
+				if (valid)
+					return true;
+			}
+
+			ereport(WARNING,
+					(errmsg("invalid block in pgsentinel archive segment \"%s\"",
+							path)));
+			break;
+		}
+
+		ash_archive_unmap(scan);
+
+		/*
+		 * Entries are in sequence order, so there is nothing more to find
+		 * in the next segments once a block starts after the range.
+		 */
+		if (past_range)
+			scan->segment = scan->nsegments;
+		else
+			scan->segment++;
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	return false;
+}
+
+/*
+ * Begin a scan of the archived entries having their ash_time in [from, to]
+ * and their sequence number in [seq_lo, seq_hi].  Returns NULL if there is
+ * nothing to scan.
+ */
+ashArchiveScan *
+ash_archive_begin_scan(TimestampTz from, TimestampTz to, uint64 seq_lo,
+					   uint64 seq_hi)
+{
+	ashArchiveScan *scan;
+	MemoryContext scan_context;
+	MemoryContextCallback *callback;
+
+	if (seq_lo > seq_hi || from > to)
+		return NULL;
+
+	scan_context = AllocSetContextCreate(CurrentMemoryContext,
+										 "pgsentinel archive scan",
+										 ALLOCSET_DEFAULT_SIZES);
+	scan = MemoryContextAllocZero(scan_context, sizeof(ashArchiveScan));
+	scan->scan_context = scan_context;
+	scan->from = from;
+	scan->to = to;
+	scan->seq_lo = seq_lo;
+	scan->seq_hi = seq_hi;
+	scan->names = ash_archive_list(&scan->nsegments);
+	scan->block_context = AllocSetContextCreate(scan_context,
+												"pgsentinel archive block",
+												ALLOCSET_DEFAULT_SIZES);
+
+	/* unmap the segment even if the scan is not ended, on error */
+	callback = MemoryContextAlloc(scan_context, sizeof(MemoryContextCallback));
+	callback->func = ash_archive_unmap;
+	callback->arg = scan;
+	MemoryContextRegisterResetCallback(scan_context, callback);
+
+	return scan;
+}
+
+/*
+ * Next entry of a scan, in history order.  Its strings stay valid until the
+ * next call.  Returns false at the end of the scan.
+ */
+bool
+ash_archive_scan_next(ashArchiveScan *scan, ashRow *row)
+{
+	for (;;)
+	{
+		if (scan->row >= scan->nrows)
+		{
+			if (!ash_archive_next_block(scan))
+			{
+				scan->nrows = 0;
+				return false;
+			}
+		}
+
+		if (!ash_archive_block_row(scan, row))
+		{
+			ereport(WARNING,
+					(errmsg("invalid block in pgsentinel archive segment \"%s\"",
+							scan->names[scan->segment])));
+			scan->nrows = 0;
+			continue;
+		}
+
+		if (row->ash_time < scan->from || row->ash_time > scan->to ||
+			row->seq < scan->seq_lo || row->seq > scan->seq_hi)
+			continue;
+
+		return true;
+	}
+}
+
+/* End a scan, releasing its memory and its mapping */
+void
+ash_archive_end_scan(ashArchiveScan *scan)
+{
+	MemoryContextDelete(scan->scan_context);
+}
+
+static bool
+ash_archive_last_seq_block(const ashArchiveBlockHeader *header,
+						   const char *columns, void *arg)
+{
+	if (!ash_archive_block_valid(header, columns))
+		return false;
+
+	*(uint64 *) arg = header->last_seq;
+	return true;
+}
+
+/* Sequence number of the last archived entry, 0 if none */
+uint64
+ash_archive_last_seq(void)
+{
+	char **names;
+	int nsegments;
+	int i;
+	uint64 last_seq = 0;
+
+	names = ash_archive_list(&nsegments);
+
+	for (i = nsegments - 1; i >= 0 && last_seq == 0; i--)
+		ash_archive_walk(names[i], ash_archive_last_seq_block, &last_seq);
+
+	return last_seq;
+}
+
+/* Create a new segment, named after the first entry it will hold */
+static bool
+ash_archive_new_segment(uint64 first_seq)
+{
+	ashArchiveFileHeader header;
+	int fd;
+
+#if PG_VERSION_NUM >= 110000
+	if (MakePGDirectory(ASH_ARCHIVE_DIR) < 0 && errno != EEXIST)
+#else
+	if (mkdir(ASH_ARCHIVE_DIR, S_IRWXU) < 0 && errno != EEXIST)
+#endif
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m",
+						ASH_ARCHIVE_DIR)));
+		return false;
+	}
+
+	snprintf(ash_archive_segment, MAXPGPATH, "%s/%s%08X%08X%s",
+			 ASH_ARCHIVE_DIR, ASH_ARCHIVE_PREFIX,
+			 (uint32) (first_seq >> 32), (uint32) first_seq,
+			 ASH_ARCHIVE_SUFFIX);
+
+#if PG_VERSION_NUM >= 110000
+	fd = OpenTransientFile(ash_archive_segment,
+						   O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+#else
+	fd = OpenTransientFile(ash_archive_segment,
+						   O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+						   S_IRUSR | S_IWUSR);
+#endif
+	if (fd < 0)
+		goto error;
+
+	header.magic = ASH_ARCHIVE_FILE_HEADER;
+	header.block_rows = ASH_ARCHIVE_BLOCK_ROWS;
+	if (write(fd, &header, sizeof(header)) != sizeof(header))
+	{
+		CloseTransientFile(fd);
+		goto error;
+	}
+
+	if (CloseTransientFile(fd) != 0)
+		goto error;
+
+	return true;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not create file \"%s\": %m", ash_archive_segment)));
+	unlink(ash_archive_segment);
+	ash_archive_segment[0] = '\0';
+	return false;
+}
+
+/*
+ * Append rows, in history order, to the archive.  Only called by the
+ * worker.  Returns false (after logging why) if they could not be written.
+ */
+bool
+ash_archive_write(const ashRow *rows, int nrows)
+{
+	StringInfoData buf;
+	struct stat st;
+	int fd;
+	int i;
+
+	if (nrows == 0)
+		return true;
+
+	/*
+	 * Roll to a new segment once the current one is large enough, and only
+	 * then sync the previous one and look for the segments to remove.
+	 */
+	if (ash_archive_segment[0] == '\0' ||
+		stat(ash_archive_segment, &st) != 0 ||
+		st.st_size >= (off_t) ash_archive_segment_size * 1024 * 1024)
+	{
+		ash_archive_sync();
+		if (!ash_archive_new_segment(rows[0].seq))
+			return false;
+		ash_archive_retention();
+	}
+
+	initStringInfo(&buf);
+	for (i = 0; i < nrows; i += ASH_ARCHIVE_BLOCK_ROWS)
+		ash_archive_encode_block(&buf, rows + i,
+								 Min(nrows - i, ASH_ARCHIVE_BLOCK_ROWS));
+
+#if PG_VERSION_NUM >= 110000
+	fd = OpenTransientFile(ash_archive_segment, O_WRONLY | O_APPEND | PG_BINARY);
+#else
+	fd = OpenTransientFile(ash_archive_segment, O_WRONLY | O_APPEND | PG_BINARY,
+						   0);
+#endif
+	if (fd < 0)
+		goto error;
+
+	errno = 0;
+	if (write(fd, buf.data, buf.len) != buf.len)
+	{
+		/* if write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		CloseTransientFile(fd);
+		goto error;
+	}
+
+	if (CloseTransientFile(fd) != 0)
+		goto error;
+
+	ash_archive_unsynced = true;
+	pfree(buf.data);
+	return true;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m", ash_archive_segment)));
+	pfree(buf.data);
+
+	/* do not append after a partially written block */
+	ash_archive_segment[0] = '\0';
+	return false;
+}
+
+/*
+ * fsync the segment being written, if written since the last time.  This
+ * is done when it is complete and when the worker exits, not at every flush:
+ * the history does not survive a crash anyway.
+ */
+void
+ash_archive_sync(void)
+{
+	int fd;
+
+	if (!ash_archive_unsynced || ash_archive_segment[0] == '\0')
+		return;
+	ash_archive_unsynced = false;
+
+#if PG_VERSION_NUM >= 110000
+	fd = OpenTransientFile(ash_archive_segment, O_RDWR | PG_BINARY);
+#else
+	fd = OpenTransientFile(ash_archive_segment, O_RDWR | PG_BINARY, 0);
+#endif
+	if (fd < 0 || pg_fsync(fd) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", ash_archive_segment)));
+	if (fd >= 0)
+		CloseTransientFile(fd);
+}
+
+/*
+ * Remove the oldest segments, beyond pgsentinel_ash.archive_max_size or
+ * older than pgsentinel_ash.archive_max_age.  The segment being written is
+ * always kept.  Run when the worker starts and when a segment is started.
+ */
+void
+ash_archive_retention(void)
+{
+	char **names;
+	int nsegments;
+	off_t *sizes;
+	time_t *mtimes;
+	off_t total = 0;
+	time_t now = time(NULL);
+	int i;
+
+	names = ash_archive_list(&nsegments);
+	sizes = palloc0(sizeof(off_t) * (nsegments + 1));
+	mtimes = palloc0(sizeof(time_t) * (nsegments + 1));
+
+	for (i = 0; i < nsegments; i++)
+	{
+		struct stat st;
+
+		if (stat(names[i], &st) == 0)
+		{
+			sizes[i] = st.st_size;
+			mtimes[i] = st.st_mtime;
+			total += st.st_size;
+		}
+	}
+
+	for (i = 0; i < nsegments; i++)
+	{
+		bool too_large = total > (off_t) ash_archive_max_size * 1024 * 1024;
+		bool too_old = ash_archive_max_age > 0 &&
+			mtimes[i] < now - ash_archive_max_age;
+
+		if (strcmp(names[i], ash_archive_segment) == 0)
+			break;
+		if (!too_large && !too_old)
+			break;
+
+		if (unlink(names[i]) != 0 && errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not remove file \"%s\": %m", names[i])));
+		total -= sizes[i];
+	}
+}
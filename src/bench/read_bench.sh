@@ -0,0 +1,181 @@
+#!/usr/bin/env bash
+#
+# Read path benchmark: fills the history of a temporary instance with
+# synthetic entries (pgsentinel_bench_fill()) and times full, time range and
+# filtered scans and aggregations of pg_active_session_history, reporting
+# the rows per second and the peak memory of the backend, then restarts the
+# instance to time the reload of the history dumped at shutdown.  See
+# "Benchmarks" in the README.
+#
+# Run it with "make bench-read" once pgsentinel is installed.  The settings
+# come from the environment:
+#
+#   BENCH_ENTRIES       entries in the history, one run each  (100000 1000000)
+#   BENCH_SESSIONS      sessions of the synthetic entries     (100)
+#   BENCH_REPEAT        runs of each query, the fastest wins  (3)
+#   BENCH_PORT          port of the temporary instance        (55432)
+#   BENCH_DIR           data directory and results            (./tmp_bench)
+#
+# The results are printed and appended to $BENCH_DIR/read_results.csv.
+
+set -e
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+BINDIR=$("$PG_CONFIG" --bindir)
+PKGLIBDIR=$("$PG_CONFIG" --pkglibdir)
+
+BENCH_ENTRIES=${BENCH_ENTRIES:-"100000 1000000"}
+BENCH_SESSIONS=${BENCH_SESSIONS:-100}
+BENCH_REPEAT=${BENCH_REPEAT:-3}
+BENCH_PORT=${BENCH_PORT:-55432}
+BENCH_DIR=${BENCH_DIR:-./tmp_bench}
+
+if [ ! -f "$PKGLIBDIR/pgsentinel.so" ]
+then
+    echo "pgsentinel is not installed in $PKGLIBDIR, run make install first" >&2
+    exit 1
+fi
+
+mkdir -p "$BENCH_DIR"
+BENCH_DIR=$(cd "$BENCH_DIR" && pwd)
+
+DATADIR="$BENCH_DIR/data"
+LOGFILE="$BENCH_DIR/postgres.log"
+RESULTS="$BENCH_DIR/read_results.csv"
+
+psql_bench() {
+    "$BINDIR/psql" -X -q -At -v ON_ERROR_STOP=1 -h "$BENCH_DIR" -p "$BENCH_PORT" -d postgres "$@" </dev/null
+}
+
+stop_instance() {
+    "$BINDIR/pg_ctl" -D "$DATADIR" -m fast -w stop >/dev/null 2>&1 || true
+}
+
+# start_instance max_entries
+start_instance() {
+    # the worker only samples once an hour, the history is all synthetic,
+    # and dumped at shutdown for the reload
+    cat > "$DATADIR/postgresql.auto.conf" <<EOF
+shared_preload_libraries = 'pgsentinel'
+listen_addresses = ''
+unix_socket_directories = '$BENCH_DIR'
+port = $BENCH_PORT
+pgsentinel_ash.max_entries = $1
+pgsentinel_ash.sampling_period = 3600
+pgsentinel_ash.save = on
+pgsentinel_ash.bench = on
+EOF
+
+    "$BINDIR/pg_ctl" -D "$DATADIR" -l "$LOGFILE" -w start >/dev/null
+}
+
+# anonymous memory of a process, in kB, or nothing without /proc
+rss_anon_kb() {
+    [ -r "/proc/$1/status" ] || return 0
+    sed -n 's/^RssAnon: *\([0-9]*\) kB/\1/p' "/proc/$1/status" 2>/dev/null || true
+}
+
+# run_query sql: sets time_ms, rows (returned by the function) and
+# peak_kb (growth of the anonymous memory of the backend while it ran)
+run_query() {
+    local explain="$BENCH_DIR/explain.out"
+    local psql_pid backend base rss
+
+    PGAPPNAME=read_bench psql_bench \
+        -c "explain (analyze, costs off, timing off) $1" > "$explain" &
+    psql_pid=$!
+
+    backend=
+    base=
+    peak_kb=0
+    while kill -0 "$psql_pid" 2>/dev/null
+    do
+        if [ -z "$backend" ]
+        then
+            backend=$(psql_bench -c "select pid from pg_stat_activity where application_name = 'read_bench'")
+        else
+            rss=$(rss_anon_kb "$backend")
+            if [ -n "$rss" ]
+            then
+                [ -z "$base" ] && base=$rss
+                [ $((rss - base)) -gt "$peak_kb" ] && peak_kb=$((rss - base))
+            fi
+        fi
+        sleep 0.01
+    done
+    wait "$psql_pid"
+
+    time_ms=$(sed -n 's/^ *Execution [Tt]ime: \([0-9.]*\) ms/\1/p' "$explain")
+    rows=$(sed -n 's/.*\(Function Scan on\|ProjectSet\) .*rows=\([0-9.]*\).*/\2/p' "$explain" | head -1)
+}
+
+trap stop_instance EXIT
+
+[ -d "$DATADIR" ] || "$BINDIR/initdb" -D "$DATADIR" -A trust >/dev/null
+
+[ -f "$RESULTS" ] || echo "entries,query,time_ms,rows,rows_per_sec,entries_per_sec,peak_kb" > "$RESULTS"
+
+printf "%-10s %-16s %10s %10s %12s %15s %10s\n" \
+    entries query time_ms rows rows/s entries/s peak_kb
+
+for entries in $BENCH_ENTRIES
+do
+    # start from an empty history, not the one of the previous run
+    rm -f "$DATADIR/pg_stat/pgsentinel.stat"
+    start_instance "$entries"
+
+    psql_bench -c "CREATE EXTENSION IF NOT EXISTS pgsentinel"
+    psql_bench -c "CREATE OR REPLACE FUNCTION pgsentinel_bench_fill(entries bigint, sessions integer)
+                   RETURNS void AS 'pgsentinel', 'pgsentinel_bench_fill' LANGUAGE C STRICT"
+    psql_bench -c "select pgsentinel_bench_fill($entries, $BENCH_SESSIONS)"
+
+    # the last tenth of the history for the range scans
+    range_secs=$((entries / BENCH_SESSIONS / 10 + 1))
+
+    while IFS='|' read -r name sql
+    do
+        best=
+        peak=0
+        for run in $(seq "$BENCH_REPEAT")
+        do
+            run_query "$sql"
+            if [ -z "$best" ] || awk "BEGIN { exit !($time_ms < $best) }"
+            then
+                best=$time_ms
+                best_rows=$rows
+            fi
+            [ "$peak_kb" -gt "$peak" ] && peak=$peak_kb
+        done
+
+        rate=$(echo "$best_rows $entries $best" | awk '{ printf "%.0f %.0f", $1 * 1000 / $3, $2 * 1000 / $3 }')
+        printf "%-10s %-16s %10s %10s %12s %15s %10s\n" \
+            "$entries" "$name" "$best" "$best_rows" ${rate} "$peak"
+        echo "$entries,$name,$best,$best_rows,${rate/ /,},$peak" >> "$RESULTS"
+    done <<EOF
+full|select count(*) from pg_active_session_history
+range|select count(*) from pg_active_session_history(now() - interval '$range_secs seconds', null)
+filter_pid|select count(*) from pg_active_session_history(null, null, filter_pid => 1000000)
+filter_wait|select count(*) from pg_active_session_history(null, null, filter_wait_event_type => 'Lock')
+where_pid|select count(*) from pg_active_session_history where pid = 1000000
+group_waits|select wait_event_type, wait_event, count(*) from pg_active_session_history group by 1, 2
+group_queries|select queryid, sum(sample_weight) from pg_active_session_history group by 1 order by 2 desc limit 10
+ash_top_queries|select * from ash_top_queries(null, null, 10)
+limit_view|select * from pg_active_session_history limit 100
+limit_from|select * from pg_active_session_history() limit 100
+EOF
+
+    # dump at shutdown, reload at startup: the time is logged by pgsentinel
+    log_lines=$(wc -l < "$LOGFILE")
+    stop_instance
+    start_instance "$entries"
+    set -- $(tail -n +$((log_lines + 1)) "$LOGFILE" |
+             sed -n 's/.*pgsentinel loaded \([0-9]*\) history entries .* in \([0-9.]*\) ms.*/\1 \2/p')
+    best_rows=${1:-0}
+    best=${2:-0}
+    rate=$(echo "$best_rows $entries $best" | awk '{ if ($3 > 0) printf "%.0f %.0f", $1 * 1000 / $3, $2 * 1000 / $3; else print "0 0" }')
+    printf "%-10s %-16s %10s %10s %12s %15s %10s\n" \
+        "$entries" reload "$best" "$best_rows" ${rate} 0
+    echo "$entries,reload,$best,$best_rows,${rate/ /,},0" >> "$RESULTS"
+
+    stop_instance
+done
@@ -0,0 +1,189 @@
+#!/usr/bin/env bash
+#
+# Sampling overhead benchmark: runs pgbench against a temporary instance
+# without pgsentinel, with pgsentinel loaded but (almost) not sampling, and
+# with pgsentinel sampling, for each number of clients and setting, and
+# reports the TPS and latency deltas, the cost of a sample and the shared
+# memory used.  See "Benchmarks" in the README.
+#
+# Run it with "make bench" once pgsentinel is installed.  The settings come
+# from the environment:
+#
+#   BENCH_CLIENTS       pgbench clients, one run each       (100 1000 5000)
+#   BENCH_MAX_ENTRIES   pgsentinel_ash.max_entries values   (1000 100000)
+#   BENCH_QUERY_SIZES   track_activity_query_size values    (1024 4096)
+#   BENCH_DURATION      seconds of each pgbench run         (30)
+#   BENCH_SCALE         pgbench scale factor                (10)
+#   BENCH_MODES         off, hook and/or on                 (off hook on)
+#   BENCH_PGBENCH_OPTS  extra pgbench options               (-S)
+#   BENCH_PORT          port of the temporary instance      (55432)
+#   BENCH_DIR           data directory and results          (./tmp_bench)
+#
+# The results are printed and appended to $BENCH_DIR/results.csv.
+
+set -e
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+BINDIR=$("$PG_CONFIG" --bindir)
+PKGLIBDIR=$("$PG_CONFIG" --pkglibdir)
+
+BENCH_CLIENTS=${BENCH_CLIENTS:-"100 1000 5000"}
+BENCH_MAX_ENTRIES=${BENCH_MAX_ENTRIES:-"1000 100000"}
+BENCH_QUERY_SIZES=${BENCH_QUERY_SIZES:-"1024 4096"}
+BENCH_DURATION=${BENCH_DURATION:-30}
+BENCH_SCALE=${BENCH_SCALE:-10}
+BENCH_MODES=${BENCH_MODES:-"off hook on"}
+BENCH_PGBENCH_OPTS=${BENCH_PGBENCH_OPTS:-"-S"}
+BENCH_PORT=${BENCH_PORT:-55432}
+BENCH_DIR=${BENCH_DIR:-./tmp_bench}
+
+if [ ! -f "$PKGLIBDIR/pgsentinel.so" ]
+then
+    echo "pgsentinel is not installed in $PKGLIBDIR, run make install first" >&2
+    exit 1
+fi
+
+mkdir -p "$BENCH_DIR"
+BENCH_DIR=$(cd "$BENCH_DIR" && pwd)
+
+max_clients=0
+for clients in $BENCH_CLIENTS
+do
+    [ "$clients" -gt "$max_clients" ] && max_clients=$clients
+done
+
+# pgbench and the server need a descriptor per connection
+if [ "$(ulimit -n)" != unlimited ] && [ "$(ulimit -n)" -lt $((max_clients + 100)) ]
+then
+    ulimit -n $((max_clients + 100)) 2>/dev/null || \
+        echo "warning: ulimit -n is $(ulimit -n), runs with more clients may fail" >&2
+fi
+
+psql_bench() {
+    "$BINDIR/psql" -X -q -At -h "$BENCH_DIR" -p "$BENCH_PORT" -d postgres "$@"
+}
+
+stop_instance() {
+    "$BINDIR/pg_ctl" -D "$DATADIR" -m fast -w stop >/dev/null 2>&1 || true
+}
+
+# start_instance mode max_entries query_size
+start_instance() {
+    local libraries="pg_stat_statements"
+
+    [ "$1" != off ] && libraries="pg_stat_statements,pgsentinel"
+
+    cat > "$DATADIR/postgresql.auto.conf" <<EOF
+shared_preload_libraries = '$libraries'
+max_connections = $((max_clients + 20))
+shared_buffers = '1GB'
+listen_addresses = ''
+unix_socket_directories = '$BENCH_DIR'
+port = $BENCH_PORT
+track_activity_query_size = $3
+pgsentinel_ash.max_entries = $2
+EOF
+    # loaded, so the post_parse_analyze hook runs, but sampling once an hour
+    [ "$1" = hook ] && echo "pgsentinel_ash.sampling_period = 3600" >> "$DATADIR/postgresql.auto.conf"
+
+    "$BINDIR/pg_ctl" -D "$DATADIR" -l "$LOGFILE" -w start >/dev/null
+}
+
+# user + system CPU time of a process, in ms, or nothing without /proc
+cpu_ms() {
+    local ticks
+
+    [ -r "/proc/$1/stat" ] || return 0
+    ticks=$(sed 's/^.*) //' "/proc/$1/stat" | awk '{ print $12 + $13 }')
+    echo $((ticks * 1000 / $(getconf CLK_TCK)))
+}
+
+DATADIR="$BENCH_DIR/data"
+LOGFILE="$BENCH_DIR/postgres.log"
+RESULTS="$BENCH_DIR/results.csv"
+
+trap stop_instance EXIT
+
+if [ ! -d "$DATADIR" ]
+then
+    "$BINDIR/initdb" -D "$DATADIR" -A trust >/dev/null
+    start_instance off 1000 1024
+    psql_bench -c "CREATE EXTENSION pg_stat_statements"
+    "$BINDIR/pgbench" -i -q -s "$BENCH_SCALE" -h "$BENCH_DIR" -p "$BENCH_PORT" postgres
+    stop_instance
+fi
+
+[ -f "$RESULTS" ] || echo "mode,clients,max_entries,query_size,tps,latency_ms,tps_delta_pct,latency_delta_ms,sample_ms,worker_cpu_ms_per_sample,shmem_bytes" > "$RESULTS"
+
+printf "%-5s %7s %11s %10s %10s %10s %8s %10s %10s %10s %12s\n" \
+    mode clients max_entries query_size tps lat_ms dtps_% dlat_ms sample_ms cpu_ms shmem_bytes
+
+for query_size in $BENCH_QUERY_SIZES
+do
+    for max_entries in $BENCH_MAX_ENTRIES
+    do
+        for clients in $BENCH_CLIENTS
+        do
+            base_tps=
+            base_latency=
+            for mode in $BENCH_MODES
+            do
+                start_instance "$mode" "$max_entries" "$query_size"
+
+                sample_ms=
+                cpu=
+                shmem=
+                worker=
+                cpu_before=
+                if [ "$mode" != off ]
+                then
+                    psql_bench -c "CREATE EXTENSION IF NOT EXISTS pgsentinel"
+                    worker=$(psql_bench -c "select pid from pg_stat_activity where backend_type = 'pgsentinel'")
+                    samples_before=$(psql_bench -c "select samples from pgsentinel_stats")
+                    time_before=$(psql_bench -c "select capture_time + store_time + pgssh_time from pgsentinel_stats")
+                    [ -n "$worker" ] && cpu_before=$(cpu_ms "$worker")
+                fi
+
+                output=$("$BINDIR/pgbench" -n $BENCH_PGBENCH_OPTS -c "$clients" \
+                            -j "$(( clients < 32 ? clients : 32 ))" -T "$BENCH_DURATION" \
+                            -h "$BENCH_DIR" -p "$BENCH_PORT" postgres 2>&1) || {
+                    echo "$output" >&2
+                    exit 1
+                }
+                tps=$(echo "$output" | sed -n 's/^tps = \([0-9.]*\).*/\1/p' | tail -1)
+                latency=$(echo "$output" | sed -n 's/^latency average = \([0-9.]*\) ms/\1/p')
+
+                if [ "$mode" != off ]
+                then
+                    samples=$(psql_bench -c "select samples - $samples_before from pgsentinel_stats")
+                    if [ "$samples" -gt 0 ]
+                    then
+                        sample_ms=$(psql_bench -c "select round(((capture_time + store_time + pgssh_time - $time_before) / $samples)::numeric, 3) from pgsentinel_stats")
+                        if [ -n "$worker" ] && [ -n "$cpu_before" ]
+                        then
+                            cpu_after=$(cpu_ms "$worker")
+                            cpu=$(echo "$cpu_after $cpu_before $samples" | awk '{ printf "%.3f", ($1 - $2) / $3 }')
+                        fi
+                    fi
+                    shmem=$(psql_bench -c "select ash_bytes + pgssh_bytes + summary_bytes + dictionary_bytes + query_text_bytes from pgsentinel_stats")
+                fi
+
+                # deltas against the first mode of the list, off by default
+                if [ -z "$base_tps" ]
+                then
+                    base_tps=$tps
+                    base_latency=$latency
+                fi
+                tps_delta=$(echo "$tps $base_tps" | awk '{ printf "%.2f", ($1 - $2) * 100 / $2 }')
+                latency_delta=$(echo "$latency $base_latency" | awk '{ printf "%.3f", $1 - $2 }')
+
+                printf "%-5s %7s %11s %10s %10s %10s %8s %10s %10s %10s %12s\n" \
+                    "$mode" "$clients" "$max_entries" "$query_size" "$tps" "$latency" \
+                    "$tps_delta" "$latency_delta" "${sample_ms:--}" "${cpu:--}" "${shmem:--}"
+                echo "$mode,$clients,$max_entries,$query_size,$tps,$latency,$tps_delta,$latency_delta,$sample_ms,$cpu,$shmem" >> "$RESULTS"
+
+                stop_instance
+            done
+        done
+    done
+done
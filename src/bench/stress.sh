@@ -0,0 +1,214 @@
+#!/usr/bin/env bash
+#
+# Concurrency stress test: the worker samples every millisecond and keeps
+# appending synthetic entries (pgsentinel_bench_fill()) to a small ring,
+# while many sessions scan pg_active_session_history and
+# pg_stat_statements_history.  Every scan counts the rows that cannot be
+# right:
+#
+#   torn         a synthetic entry (of the bench database) whose
+#                backend_xmin is not the checksum of its backend_xid, pid and
+#                queryid, or a pgssh row with negative counters
+#   duplicated   the same synthetic backend_xid, sampled (ash_time, pid) or
+#                pgssh (ash_time, userid, dbid, queryid) twice in a scan
+#   regressions  pgssh calls going down from one ash_time to the next
+#
+# and the test fails if any scan found one.  It also reports the rows read
+# and written per second.  See "Benchmarks" in the README.
+#
+# Run it with "make stress" once pgsentinel is installed.  The settings
+# come from the environment:
+#
+#   STRESS_DURATION       seconds of each run                     (60)
+#   STRESS_READERS        sessions scanning each view             (8)
+#   STRESS_LOAD_CLIENTS   sessions running queries to sample      (8)
+#   STRESS_MAX_ENTRIES    pgsentinel_ash.max_entries              (10000)
+#   STRESS_FILL_ENTRIES   synthetic entries of each fill          (1000)
+#   STRESS_COMPRESS       pgsentinel_pgssh.compress, one run each (off on)
+#   STRESS_ARCHIVE        pgsentinel_ash.archive_flush_interval   (1)
+#   BENCH_PORT            port of the temporary instance          (55432)
+#   BENCH_DIR             data directory and results              (./tmp_bench)
+
+set -e
+
+PG_CONFIG=${PG_CONFIG:-pg_config}
+BINDIR=$("$PG_CONFIG" --bindir)
+PKGLIBDIR=$("$PG_CONFIG" --pkglibdir)
+
+STRESS_DURATION=${STRESS_DURATION:-60}
+STRESS_READERS=${STRESS_READERS:-8}
+STRESS_LOAD_CLIENTS=${STRESS_LOAD_CLIENTS:-8}
+STRESS_MAX_ENTRIES=${STRESS_MAX_ENTRIES:-10000}
+STRESS_FILL_ENTRIES=${STRESS_FILL_ENTRIES:-1000}
+STRESS_COMPRESS=${STRESS_COMPRESS:-"off on"}
+STRESS_ARCHIVE=${STRESS_ARCHIVE:-1}
+BENCH_PORT=${BENCH_PORT:-55432}
+BENCH_DIR=${BENCH_DIR:-./tmp_bench}
+
+if [ ! -f "$PKGLIBDIR/pgsentinel.so" ]
+then
+    echo "pgsentinel is not installed in $PKGLIBDIR, run make install first" >&2
+    exit 1
+fi
+
+mkdir -p "$BENCH_DIR"
+BENCH_DIR=$(cd "$BENCH_DIR" && pwd)
+
+DATADIR="$BENCH_DIR/data"
+LOGFILE="$BENCH_DIR/postgres.log"
+SCRIPTS="$BENCH_DIR/stress"
+
+psql_bench() {
+    "$BINDIR/psql" -X -q -At -v ON_ERROR_STOP=1 -h "$BENCH_DIR" -p "$BENCH_PORT" -d postgres "$@" </dev/null
+}
+
+pgbench_bench() {
+    "$BINDIR/pgbench" -n -T "$STRESS_DURATION" -h "$BENCH_DIR" -p "$BENCH_PORT" "$@" postgres
+}
+
+stop_instance() {
+    "$BINDIR/pg_ctl" -D "$DATADIR" -m fast -w stop >/dev/null 2>&1 || true
+}
+
+# start_instance compress
+start_instance() {
+    cat > "$DATADIR/postgresql.auto.conf" <<EOF
+shared_preload_libraries = 'pg_stat_statements,pgsentinel'
+max_connections = $((2 * STRESS_READERS + STRESS_LOAD_CLIENTS + 20))
+listen_addresses = ''
+unix_socket_directories = '$BENCH_DIR'
+port = $BENCH_PORT
+pg_stat_statements.track = all
+pgsentinel_ash.sampling_interval = 1
+pgsentinel_ash.max_entries = $STRESS_MAX_ENTRIES
+pgsentinel_ash.archive_flush_interval = $STRESS_ARCHIVE
+pgsentinel_ash.save = off
+pgsentinel_ash.bench = on
+pgsentinel_pgssh.enable = on
+pgsentinel_pgssh.compress = $1
+EOF
+
+    rm -rf "$DATADIR/pg_sentinel"
+    "$BINDIR/pg_ctl" -D "$DATADIR" -l "$LOGFILE" -w start >/dev/null
+}
+
+# tps of a pgbench output file
+tps() {
+    sed -n 's/^tps = \([0-9.]*\).*/\1/p' "$1" | head -1
+}
+
+trap stop_instance EXIT
+
+[ -d "$DATADIR" ] || "$BINDIR/initdb" -D "$DATADIR" -A trust >/dev/null
+
+mkdir -p "$SCRIPTS"
+
+# the synthetic entries are the ones of the bench database, which does not
+# exist
+cat > "$SCRIPTS/setup.sql" <<'EOF'
+CREATE EXTENSION IF NOT EXISTS pg_stat_statements;
+CREATE EXTENSION IF NOT EXISTS pgsentinel;
+CREATE OR REPLACE FUNCTION pgsentinel_bench_fill(entries bigint, sessions integer)
+  RETURNS void AS 'pgsentinel', 'pgsentinel_bench_fill' LANGUAGE C STRICT;
+
+DROP TABLE IF EXISTS stress_results;
+CREATE UNLOGGED TABLE stress_results (kind text, rows bigint, torn bigint,
+                                      duplicated bigint, regressions bigint);
+
+CREATE OR REPLACE FUNCTION stress_check_ash() RETURNS void LANGUAGE sql AS $$
+  INSERT INTO stress_results
+  SELECT 'ash', count(*),
+         count(*) FILTER (WHERE synthetic AND
+                          backend_xmin::text::bigint IS DISTINCT FROM
+                          (backend_xid::text::bigint * 65599 + pid::bigint * 257 +
+                           queryid * 31) % 4294967295 + 1),
+         count(*) FILTER (WHERE synthetic) -
+         count(DISTINCT backend_xid) FILTER (WHERE synthetic) +
+         count(*) FILTER (WHERE NOT synthetic) -
+         count(DISTINCT (ash_time, pid)) FILTER (WHERE NOT synthetic),
+         0
+    FROM (SELECT *, coalesce(datname = 'bench', false) AS synthetic
+            FROM pg_active_session_history) h
+$$;
+
+CREATE OR REPLACE FUNCTION stress_check_pgssh() RETURNS void LANGUAGE sql AS $$
+  INSERT INTO stress_results
+  SELECT 'pgssh', count(*),
+         count(*) FILTER (WHERE calls < 0 OR rows < 0 OR total_exec_time < 0 OR
+                          shared_blks_hit < 0 OR shared_blks_read < 0),
+         count(*) - count(DISTINCT (ash_time, userid, dbid, queryid)),
+         count(*) FILTER (WHERE calls < prev_calls)
+    FROM (SELECT *, lag(calls) OVER (PARTITION BY userid, dbid, queryid
+                                     ORDER BY ash_time) AS prev_calls
+            FROM pg_stat_statements_history) h
+$$;
+EOF
+
+cat > "$SCRIPTS/load.sql" <<'EOF'
+select count(*) from generate_series(1, 10000);
+select pg_sleep(0.001);
+select sum(g) from generate_series(1, 1000) g where g % 7 = 0;
+EOF
+echo "select pgsentinel_bench_fill($STRESS_FILL_ENTRIES, 100);" > "$SCRIPTS/fill.sql"
+echo "select stress_check_ash();" > "$SCRIPTS/check_ash.sql"
+echo "select stress_check_pgssh();" > "$SCRIPTS/check_pgssh.sql"
+
+failed=0
+
+for compress in $STRESS_COMPRESS
+do
+    start_instance "$compress"
+    psql_bench -f "$SCRIPTS/setup.sql"
+
+    samples_before=$(psql_bench -c "select samples from pgsentinel_stats")
+
+    pids=
+    pgbench_bench -f "$SCRIPTS/load.sql" -c "$STRESS_LOAD_CLIENTS" -j "$STRESS_LOAD_CLIENTS" \
+        > "$SCRIPTS/load.out" 2>&1 & pids="$pids $!"
+    pgbench_bench -f "$SCRIPTS/fill.sql" -c 1 > "$SCRIPTS/fill.out" 2>&1 & pids="$pids $!"
+    pgbench_bench -f "$SCRIPTS/check_ash.sql" -c "$STRESS_READERS" -j "$STRESS_READERS" \
+        > "$SCRIPTS/check_ash.out" 2>&1 & pids="$pids $!"
+    pgbench_bench -f "$SCRIPTS/check_pgssh.sql" -c "$STRESS_READERS" -j "$STRESS_READERS" \
+        > "$SCRIPTS/check_pgssh.out" 2>&1 & pids="$pids $!"
+
+    for pid in $pids
+    do
+        wait "$pid" || failed=1
+    done
+    if [ "$failed" -ne 0 ]
+    then
+        cat "$SCRIPTS"/*.out >&2
+        echo "a pgbench run failed, see $LOGFILE" >&2
+        exit 1
+    fi
+
+    read -r samples missed lost <<EOF
+$(psql_bench -F ' ' -c "select samples - $samples_before, missed_ticks, archive_lost from pgsentinel_stats")
+EOF
+    fill_tps=$(tps "$SCRIPTS/fill.out")
+
+    echo "pgsentinel_pgssh.compress = $compress, $STRESS_DURATION s"
+    echo "  writer: $((samples / STRESS_DURATION)) samples/s ($missed missed ticks)," \
+         "$(echo "$fill_tps $STRESS_FILL_ENTRIES" | awk '{ printf "%.0f", $1 * $2 }') synthetic entries/s," \
+         "$lost entries overwritten before they were archived"
+    printf "  %-6s %8s %12s %10s %10s %12s\n" view scans rows/s torn duplicated regressions
+
+    while IFS='|' read -r kind scans rows torn duplicated regressions
+    do
+        printf "  %-6s %8s %12s %10s %10s %12s\n" "$kind" "$scans" \
+            "$((rows / STRESS_DURATION))" "$torn" "$duplicated" "$regressions"
+        [ $((torn + duplicated + regressions)) -gt 0 ] && failed=1
+    done <<EOF
+$(psql_bench -c "select kind, count(*), sum(rows), sum(torn), sum(duplicated), sum(regressions)
+                   from stress_results group by kind order by kind")
+EOF
+
+    stop_instance
+done
+
+if [ "$failed" -ne 0 ]
+then
+    echo "FAILED: some scans returned torn or duplicated rows" >&2
+    exit 1
+fi
+echo "ok"
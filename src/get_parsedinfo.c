@@ -14,12 +14,15 @@
 #include "pgsentinel.h"
 #include "storage/ipc.h"
 #include "storage/proc.h"
+#include "storage/procarray.h"
 #include "miscadmin.h"
 #include "access/twophase.h"
 #include "parser/scansup.h"
 #include "parser/analyze.h"
 #include "access/hash.h"
 #include "funcapi.h"
+#include "mb/pg_wchar.h"
+#include "tcop/tcopprot.h"
 #include "utils/builtins.h"
 #include "commands/extension.h"
 #include "pgstat.h"
@@ -29,6 +32,9 @@
 Datum get_parsedinfo(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(get_parsedinfo);
 
+/* GUC variable */
+bool ash_lazy_capture = false;
+
 /* to create queryid in case of utility statements*/
 #if PG_VERSION_NUM >= 110000
 static uint64 getparsedinfo_hash64_string(const char *str, int len);
@@ -36,19 +42,30 @@ static uint64 getparsedinfo_hash64_string(const char *str, int len);
 static uint32 getparsedinfo_hash32_string(const char *str, int len);
 #endif
 
+/*
+ * Room for the query text of each proc entry, whole cache lines so that the
+ * backends copying their statements do not share any.
+ */
+Size
+proc_entry_query_size(void)
+{
+	return CACHELINEALIGN(pgstat_track_activity_query_size);
+}
+
 /* Estimate amount of shared memory needed for proc entry*/
 Size
 proc_entry_memsize(void)
 {
 	Size            size;
 
+	StaticAssertStmt(sizeof(procEntry) <= PG_CACHE_LINE_SIZE,
+					 "procEntry does not fit in a cache line");
+
 	/* ProcEntryArray */
-	size = mul_size(sizeof(procEntry), get_max_procs_count());
+	size = mul_size(sizeof(procEntryPadded), get_max_procs_count());
 	/* ProEntryQueryBuffer */
-	size = add_size(size, mul_size(pgstat_track_activity_query_size,
+	size = add_size(size, mul_size(proc_entry_query_size(),
 													get_max_procs_count()));
-	/* ProEntryCmdTypeBuffer */
-	size = add_size(size, mul_size(NAMEDATALEN, get_max_procs_count()));
 	return size;
 }
 
@@ -84,6 +101,173 @@ get_max_procs_count(void)
 	return count;
 }
 
+/* cmdtype column of each procCmdType */
+const char *const procCmdTypeNames[PROC_CMD_NTYPES] = {
+	[PROC_CMD_NONE] = "",
+	[PROC_CMD_SELECT] = "SELECT",
+	[PROC_CMD_INSERT] = "INSERT",
+	[PROC_CMD_UPDATE] = "UPDATE",
+	[PROC_CMD_DELETE] = "DELETE",
+	[PROC_CMD_MERGE] = "MERGE",
+	[PROC_CMD_UTILITY] = "UTILITY",
+	[PROC_CMD_UNKNOWN] = "UNKNOWN",
+	[PROC_CMD_NOTHING] = "NOTHING"
+};
+
+static uint8
+getparsedinfo_cmdtype(CmdType commandType)
+{
+	switch (commandType)
+	{
+		case CMD_SELECT:
+			return PROC_CMD_SELECT;
+		case CMD_INSERT:
+			return PROC_CMD_INSERT;
+#if PG_VERSION_NUM >= 150000
+		case CMD_MERGE:
+			return PROC_CMD_MERGE;
+#endif
+		case CMD_UPDATE:
+			return PROC_CMD_UPDATE;
+		case CMD_DELETE:
+			return PROC_CMD_DELETE;
+		case CMD_UTILITY:
+			return PROC_CMD_UTILITY;
+		case CMD_UNKNOWN:
+			return PROC_CMD_UNKNOWN;
+		case CMD_NOTHING:
+			return PROC_CMD_NOTHING;
+	}
+	return PROC_CMD_UNKNOWN;
+}
+
+/*
+ * Only locate a statement in its source text, the top level query, with what
+ * tells whether the backend still reports that query in pg_stat_activity:
+ * the sampler cuts the statement from there when it samples the backend, see
+ * getparsedinfo_lazy_query().
+ */
+static void
+getparsedinfo_capture_lazy(procEntry *entry, const char *source, Query *query)
+{
+	int source_len = (int) strlen(source);
+	int location = 0;
+	int length = source_len;
+	int n;
+
+#if PG_VERSION_NUM >= 100000
+	if (query->stmt_location >= 0 && query->stmt_location <= source_len)
+	{
+		location = query->stmt_location;
+		/* Length of 0 (or -1) means "rest of string" */
+		if (query->stmt_len > 0 && query->stmt_len <= source_len - location)
+			length = query->stmt_len;
+		else
+			length = source_len - location;
+	}
+#endif
+	n = Min(length, PROC_ENTRY_FINGERPRINT);
+
+	ASH_BEGIN_WRITE(entry);
+	entry->lazy = true;
+	entry->location = location;
+	entry->length = length;
+	entry->source_len = source_len;
+	if (n < PROC_ENTRY_FINGERPRINT)
+	{
+		memset(entry->head, 0, PROC_ENTRY_FINGERPRINT);
+		memset(entry->tail, 0, PROC_ENTRY_FINGERPRINT);
+	}
+	memcpy(entry->head, source + location, n);
+	memcpy(entry->tail, source + location + length - n, n);
+	entry->cmdtype = getparsedinfo_cmdtype(query->commandType);
+	entry->queryid = query->queryId;
+	ASH_END_WRITE(entry);
+}
+
+/*
+ * Copy the proc entry of the i-th PGPROC and its statement text into text, of
+ * pgstat_track_activity_query_size bytes, so that they belong together: the
+ * text is copied under the changecount of the entry too.  copy->query points
+ * to text afterwards, empty for a statement captured lazily.
+ */
+void
+getparsedinfo_read_entry(int i, procEntry *copy, char *text)
+{
+	volatile procEntry *slot = &ProcEntryArray[i].entry;
+
+	for (;;)
+	{
+		uint32 before_changecount = slot->changecount;
+		uint32 after_changecount;
+
+		pg_read_barrier();
+		memcpy(copy, (const void *) slot, sizeof(procEntry));
+		/* the last byte of the text buffer is always a terminator */
+		if (copy->lazy || copy->query == NULL)
+			text[0] = '\0';
+		else
+			strlcpy(text, copy->query, pgstat_track_activity_query_size);
+		pg_read_barrier();
+		after_changecount = slot->changecount;
+		if (before_changecount == after_changecount &&
+			(before_changecount & 1) == 0)
+			break;
+		CHECK_FOR_INTERRUPTS();
+	}
+	copy->query = text;
+}
+
+/*
+ * Text of a statement captured lazily into buf, of
+ * pgstat_track_activity_query_size bytes, cut from source, the top level
+ * query its backend reports in pg_stat_activity.  NULL if the backend has
+ * moved on to another query meanwhile.
+ */
+const char *
+getparsedinfo_lazy_query(const procEntry *entry, const char *source, char *buf)
+{
+	int source_len;
+	int location = entry->location;
+	int length = entry->length;
+	int n = Min(length, PROC_ENTRY_FINGERPRINT);
+
+	if (source == NULL)
+		return NULL;
+
+	/*
+	 * pg_stat_activity only keeps the first track_activity_query_size - 1
+	 * bytes of the query, cut on a character boundary.
+	 */
+	source_len = (int) strlen(source);
+	if (source_len != entry->source_len &&
+		(source_len > entry->source_len ||
+		 source_len < pgstat_track_activity_query_size - MAX_MULTIBYTE_CHAR_LEN))
+		return NULL;
+	if (location >= source_len)
+		return NULL;
+
+	if (memcmp(source + location, entry->head,
+			   Min(n, source_len - location)) != 0)
+		return NULL;
+	if (location + length <= source_len &&
+		memcmp(source + location + length - n, entry->tail, n) != 0)
+		return NULL;
+
+	source += location;
+	length = Min(length, source_len - location);
+
+	/* Discard leading and trailing whitespace, as when copying it */
+	while (length > 0 && scanner_isspace(source[0]))
+		source++, length--;
+	while (length > 0 && scanner_isspace(source[length - 1]))
+		length--;
+
+	memcpy(buf, source, length);
+	buf[length] = '\0';
+	return buf;
+}
+
 void
 #if PG_VERSION_NUM < 140000
 getparsedinfo_post_parse_analyze(ParseState *pstate, Query *query)
@@ -106,6 +290,21 @@ getparsedinfo_post_parse_analyze(ParseState *pstate, Query *query, JumbleState *
 		int query_len;
 #if PG_VERSION_NUM >= 100000
 		int query_location = query->stmt_location;
+#endif
+
+		/*
+		 * Statements of the top level query with a queryid do not need to be
+		 * copied, nor hashed.  The SPI sampler does not read pg_stat_activity
+		 * from shared memory, it needs their text.
+		 */
+		if (ash_lazy_capture && ash_native_sampler &&
+			query->queryId != 0 && querytext == debug_query_string)
+		{
+			getparsedinfo_capture_lazy(&ProcEntryArray[i].entry, querytext, query);
+			return;
+		}
+
+#if PG_VERSION_NUM >= 100000
 		query_len = query->stmt_len;
 
 		if (query_location >= 0)
@@ -137,68 +336,78 @@ getparsedinfo_post_parse_analyze(ParseState *pstate, Query *query, JumbleState *
 		query_len = (int) strlen(querytext);
 #endif
 
+		ASH_BEGIN_WRITE(&ProcEntryArray[i].entry);
+		ProcEntryArray[i].entry.lazy = false;
 		minlen = Min(query_len,pgstat_track_activity_query_size-1);
-		memcpy(ProcEntryArray[i].query,querytext,minlen);
-		ProcEntryArray[i].query[minlen]='\0';
-		switch (query->commandType)
-		{
-			case CMD_SELECT:
-				ProcEntryArray[i].cmdtype="SELECT";
-				break;
-			case CMD_INSERT:
-				ProcEntryArray[i].cmdtype="INSERT";
-				break;
-#if PG_VERSION_NUM >= 150000
-			case CMD_MERGE:
-				ProcEntryArray[i].cmdtype="MERGE";
-				break;
-#endif
-			case CMD_UPDATE:
-				ProcEntryArray[i].cmdtype="UPDATE";
-				break;
-			case CMD_DELETE:
-				ProcEntryArray[i].cmdtype="DELETE";
-				break;
-			case CMD_UTILITY:
-				ProcEntryArray[i].cmdtype="UTILITY";
-				break;
-			case CMD_UNKNOWN:
-				ProcEntryArray[i].cmdtype="UNKNOWN";
-				break;
-			case CMD_NOTHING:
-				ProcEntryArray[i].cmdtype="NOTHING";
-				break;
-		}
+		memcpy(ProcEntryArray[i].entry.query,querytext,minlen);
+		ProcEntryArray[i].entry.query[minlen]='\0';
+		ProcEntryArray[i].entry.cmdtype = getparsedinfo_cmdtype(query->commandType);
 		/*
 		 * For utility statements, we just hash the query string to get an ID.
 		 */
 #if PG_VERSION_NUM >= 110000
 		if (query->queryId == UINT64CONST(0)) 	{
-			ProcEntryArray[i].queryid = getparsedinfo_hash64_string(querytext,
+			ProcEntryArray[i].entry.queryid = getparsedinfo_hash64_string(querytext,
 																	query_len);
 #else
 			if (query->queryId == 0) {
-				ProcEntryArray[i].queryid = getparsedinfo_hash32_string(querytext,
+				ProcEntryArray[i].entry.queryid = getparsedinfo_hash32_string(querytext,
 																	query_len);
 #endif
 			} else {
-				ProcEntryArray[i].queryid = query->queryId;
+				ProcEntryArray[i].entry.queryid = query->queryId;
 			}
+		ASH_END_WRITE(&ProcEntryArray[i].entry);
 	}
 }
 
+/*
+ * Add the parsed info of the i-th PGPROC to the result, text being a buffer
+ * for its statement
+ */
+static void
+getparsedinfo_putproc(Tuplestorestate *tupstore, TupleDesc tupdesc, int i,
+					  char *text)
+{
+	Datum           values[4];
+	bool            nulls[4] = {0};
+	procEntry       entry;
+
+	getparsedinfo_read_entry(i, &entry, text);
+
+	values[0] = Int32GetDatum(ProcGlobal->allProcs[i].pid);
+	if (entry.queryid)
+		values[1] = Int64GetDatum(entry.queryid);
+	else
+		nulls[1] = true;
+	/* the text of the statements captured lazily is not at hand */
+	if (!entry.lazy)
+		values[2] = CStringGetTextDatum(entry.query);
+	else
+		nulls[2] = true;
+	if (entry.cmdtype < PROC_CMD_NTYPES)
+		values[3] = CStringGetTextDatum(procCmdTypeNames[entry.cmdtype]);
+	else
+		nulls[3] = true;
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+/*
+ * Parsed info of the process having this pid, or of all the live processes
+ * for -1: the sampling query joins the latter on pg_stat_activity, so that a
+ * sample reads the PGPROC array once instead of once per active session.
+ */
 Datum
 get_parsedinfo(PG_FUNCTION_ARGS)
 {
-	uint32 i;
-	/*procEntry *result;*/
+	int pid = PG_GETARG_INT32(0);
 	ReturnSetInfo   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	TupleDesc	    tupdesc;
 	Tuplestorestate *tupstore;
 	MemoryContext   per_query_ctx;
 	MemoryContext   oldcontext;
-	Datum           values[4];
-	bool            nulls[4] = {0};
+	char           *text;
 
 	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
 	oldcontext = MemoryContextSwitchTo(per_query_ctx);
@@ -211,28 +420,28 @@ get_parsedinfo(PG_FUNCTION_ARGS)
 	rsinfo->setDesc = tupdesc;
 	MemoryContextSwitchTo(oldcontext);
 
-	for (i = 0; i < ProcGlobal->allProcCount; i++)
+	text = palloc(pgstat_track_activity_query_size);
+	if (pid == -1)
 	{
-		PGPROC  *proc = &ProcGlobal->allProcs[i];
-		if (proc != NULL && proc->pid != 0 && (proc->pid == PG_GETARG_INT32(0)
-												 || PG_GETARG_INT32(0) == -1))
+		uint32 i;
+
+		for (i = 0; i < ProcGlobal->allProcCount; i++)
 		{
-			values[0] = proc->pid;
-			if (Int64GetDatum(ProcEntryArray[i].queryid))
-				values[1] = Int64GetDatum(ProcEntryArray[i].queryid);
-			else
-				nulls[1] = true;
-			if (CStringGetTextDatum(ProcEntryArray[i].query))
-        			values[2] = CStringGetTextDatum(ProcEntryArray[i].query);
-			else
-				nulls[2] = true;
-			if (CStringGetTextDatum(ProcEntryArray[i].cmdtype))
-        			values[3] = CStringGetTextDatum(ProcEntryArray[i].cmdtype);
-			else
-				nulls[3] = true;
-    
-        	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+			if (ProcGlobal->allProcs[i].pid != 0)
+				getparsedinfo_putproc(tupstore, tupdesc, i, text);
 		}
 	}
+	else if (pid != 0)
+	{
+		/* Only walks the procs in use, not the whole PGPROC array */
+		PGPROC *proc = BackendPidGetProc(pid);
+
+		if (proc == NULL)
+			proc = AuxiliaryPidGetProc(pid);
+		if (proc != NULL)
+			getparsedinfo_putproc(tupstore, tupdesc,
+								  proc - ProcGlobal->allProcs, text);
+	}
+	pfree(text);
 	return (Datum) 0;
 }
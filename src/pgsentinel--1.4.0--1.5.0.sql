@@ -0,0 +1,285 @@
+/* pgsentinel--1.4.0--1.5.0.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pgsentinel UPDATE TO '1.5.0'" to load this file. \quit
+
+-- New root_blockerpid, blocker_depth and sample_weight columns
+DROP VIEW pg_active_session_history;
+DROP FUNCTION pg_active_session_history();
+
+CREATE FUNCTION pg_active_session_history(
+    OUT ash_time timestamptz,
+    OUT datid Oid,
+    OUT datname text,
+    OUT pid integer,
+    OUT leader_pid integer,
+    OUT usesysid Oid,
+    OUT usename text,
+    OUT application_name text,
+    OUT client_addr text,
+    OUT client_hostname text,
+    OUT client_port integer,
+    OUT backend_start timestamptz,
+    OUT xact_start timestamptz,
+    OUT query_start timestamptz,
+    OUT state_change timestamptz,
+    OUT wait_event_type text,
+    OUT wait_event text,
+    OUT state text,
+    OUT backend_xid xid,
+    OUT backend_xmin xid,
+    OUT top_level_query text,
+    OUT query text,
+    OUT cmdtype text,
+    OUT queryid bigint,
+    OUT backend_type text,
+    OUT blockers integer,
+    OUT blockerpid integer,
+    OUT blocker_state text,
+    OUT root_blockerpid integer,
+    OUT blocker_depth integer,
+    OUT sample_weight double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_active_session_history'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Register a view on the function for ease of use.  The function is called
+-- in the select list, so that its rows are returned as they are read instead
+-- of being stored first, and a LIMIT stops the scan early.
+CREATE VIEW pg_active_session_history AS
+  SELECT (h).* FROM (SELECT pg_active_session_history() AS h OFFSET 0) s;
+
+GRANT SELECT ON pg_active_session_history TO PUBLIC;
+
+-- Same for the view on pg_stat_statements_history
+CREATE OR REPLACE VIEW pg_stat_statements_history AS
+  SELECT (h).* FROM (SELECT pg_stat_statements_history() AS h OFFSET 0) s;
+
+-- Entries sampled between from_time and to_time (NULL for no bound),
+-- only the ones matching the filter_ arguments that are not NULL
+CREATE FUNCTION pg_active_session_history(
+    IN from_time timestamptz,
+    IN to_time timestamptz,
+    IN filter_pid integer DEFAULT NULL,
+    IN filter_queryid bigint DEFAULT NULL,
+    IN filter_datid Oid DEFAULT NULL,
+    IN filter_usesysid Oid DEFAULT NULL,
+    IN filter_wait_event_type text DEFAULT NULL,
+    IN filter_backend_type text DEFAULT NULL,
+    OUT ash_time timestamptz,
+    OUT datid Oid,
+    OUT datname text,
+    OUT pid integer,
+    OUT leader_pid integer,
+    OUT usesysid Oid,
+    OUT usename text,
+    OUT application_name text,
+    OUT client_addr text,
+    OUT client_hostname text,
+    OUT client_port integer,
+    OUT backend_start timestamptz,
+    OUT xact_start timestamptz,
+    OUT query_start timestamptz,
+    OUT state_change timestamptz,
+    OUT wait_event_type text,
+    OUT wait_event text,
+    OUT state text,
+    OUT backend_xid xid,
+    OUT backend_xmin xid,
+    OUT top_level_query text,
+    OUT query text,
+    OUT cmdtype text,
+    OUT queryid bigint,
+    OUT backend_type text,
+    OUT blockers integer,
+    OUT blockerpid integer,
+    OUT blocker_state text,
+    OUT root_blockerpid integer,
+    OUT blocker_depth integer,
+    OUT sample_weight double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_active_session_history'
+LANGUAGE C CALLED ON NULL INPUT VOLATILE PARALLEL SAFE;
+
+-- Same for pg_stat_statements_history
+CREATE FUNCTION pg_stat_statements_history(
+    IN from_time timestamptz,
+    IN to_time timestamptz,
+    IN filter_queryid bigint DEFAULT NULL,
+    IN filter_userid Oid DEFAULT NULL,
+    IN filter_dbid Oid DEFAULT NULL,
+    OUT ash_time timestamptz,
+    OUT userid Oid,
+    OUT dbid Oid,
+    OUT queryid bigint,
+    OUT calls bigint,
+    OUT total_exec_time double precision,
+    OUT rows bigint,
+    OUT shared_blks_hit bigint,
+    OUT shared_blks_read bigint,
+    OUT shared_blks_dirtied bigint,
+    OUT shared_blks_written bigint,
+    OUT local_blks_hit bigint,
+    OUT local_blks_read bigint,
+    OUT local_blks_dirtied bigint,
+    OUT local_blks_written bigint,
+    OUT temp_blks_read bigint,
+    OUT temp_blks_written bigint,
+    OUT blk_read_time double precision,
+    OUT blk_write_time double precision,
+    OUT plans bigint,
+    OUT total_plan_time double precision,
+    OUT wal_records bigint,
+    OUT wal_fpi bigint,
+    OUT wal_bytes numeric
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_statements_history'
+LANGUAGE C CALLED ON NULL INPUT VOLATILE PARALLEL SAFE;
+
+-- Same, with the difference of each counter with the previous entry of the
+-- query instead of its cumulative value
+CREATE FUNCTION pg_stat_statements_history_deltas(
+    IN from_time timestamptz DEFAULT NULL,
+    IN to_time timestamptz DEFAULT NULL,
+    IN filter_queryid bigint DEFAULT NULL,
+    IN filter_userid Oid DEFAULT NULL,
+    IN filter_dbid Oid DEFAULT NULL,
+    OUT ash_time timestamptz,
+    OUT userid Oid,
+    OUT dbid Oid,
+    OUT queryid bigint,
+    OUT calls bigint,
+    OUT total_exec_time double precision,
+    OUT rows bigint,
+    OUT shared_blks_hit bigint,
+    OUT shared_blks_read bigint,
+    OUT shared_blks_dirtied bigint,
+    OUT shared_blks_written bigint,
+    OUT local_blks_hit bigint,
+    OUT local_blks_read bigint,
+    OUT local_blks_dirtied bigint,
+    OUT local_blks_written bigint,
+    OUT temp_blks_read bigint,
+    OUT temp_blks_written bigint,
+    OUT blk_read_time double precision,
+    OUT blk_write_time double precision,
+    OUT plans bigint,
+    OUT total_plan_time double precision,
+    OUT wal_records bigint,
+    OUT wal_fpi bigint,
+    OUT wal_bytes numeric
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_statements_history_deltas'
+LANGUAGE C CALLED ON NULL INPUT VOLATILE PARALLEL SAFE;
+
+-- Number and weight of the samples per time bucket, database, query, wait
+-- event and backend type, maintained by the worker as it samples
+CREATE FUNCTION pg_active_session_history_summary(
+    IN from_time timestamptz DEFAULT NULL,
+    IN to_time timestamptz DEFAULT NULL,
+    OUT bucket_start timestamptz,
+    OUT datid Oid,
+    OUT queryid bigint,
+    OUT wait_event_type text,
+    OUT wait_event text,
+    OUT backend_type text,
+    OUT samples bigint,
+    OUT sample_weight double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_active_session_history_summary'
+LANGUAGE C CALLED ON NULL INPUT VOLATILE PARALLEL SAFE;
+
+-- The n groups of entries sampled between from_time and to_time with the
+-- most samples (NULL for no bound or no limit)
+CREATE FUNCTION ash_top_queries(
+    IN from_time timestamptz DEFAULT NULL,
+    IN to_time timestamptz DEFAULT NULL,
+    IN n integer DEFAULT 10,
+    OUT queryid bigint,
+    OUT samples bigint,
+    OUT pct double precision,
+    OUT query text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'ash_top_queries'
+LANGUAGE C CALLED ON NULL INPUT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION ash_top_waits(
+    IN from_time timestamptz DEFAULT NULL,
+    IN to_time timestamptz DEFAULT NULL,
+    IN n integer DEFAULT 10,
+    OUT wait_event_type text,
+    OUT wait_event text,
+    OUT samples bigint,
+    OUT pct double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'ash_top_waits'
+LANGUAGE C CALLED ON NULL INPUT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION ash_top_sessions(
+    IN from_time timestamptz DEFAULT NULL,
+    IN to_time timestamptz DEFAULT NULL,
+    IN n integer DEFAULT 10,
+    OUT pid integer,
+    OUT backend_start timestamptz,
+    OUT usename text,
+    OUT backend_type text,
+    OUT samples bigint,
+    OUT pct double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'ash_top_sessions'
+LANGUAGE C CALLED ON NULL INPUT VOLATILE PARALLEL SAFE;
+
+-- Counters of the worker: sampling schedule, cost of the samples, last error
+-- and memory used by the buffers
+CREATE FUNCTION pgsentinel_stats(
+    OUT samples bigint,
+    OUT missed_ticks bigint,
+    OUT last_tick timestamptz,
+    OUT last_tick_lag double precision,
+    OUT max_tick_lag double precision,
+    OUT avg_tick_lag double precision,
+    OUT sampling_period double precision,
+    OUT sample_fraction double precision,
+    OUT ash_rows bigint,
+    OUT ash_wraps bigint,
+    OUT pgssh_rows bigint,
+    OUT summary_rows bigint,
+    OUT archived_rows bigint,
+    OUT archive_lost bigint,
+    OUT capture_time double precision,
+    OUT capture_time_histogram bigint[],
+    OUT store_time double precision,
+    OUT store_time_histogram bigint[],
+    OUT pgssh_time double precision,
+    OUT pgssh_time_histogram bigint[],
+    OUT dictionary_full boolean,
+    OUT query_text_evictions bigint,
+    OUT last_error text,
+    OUT last_error_time timestamptz,
+    OUT ash_bytes bigint,
+    OUT ash_used_bytes bigint,
+    OUT pgssh_bytes bigint,
+    OUT pgssh_used_bytes bigint,
+    OUT summary_bytes bigint,
+    OUT summary_used_bytes bigint,
+    OUT dictionary_bytes bigint,
+    OUT dictionary_used_bytes bigint,
+    OUT query_text_bytes bigint,
+    OUT query_text_used_bytes bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pgsentinel_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW pgsentinel_stats AS
+  SELECT * FROM pgsentinel_stats();
+
+GRANT SELECT ON pgsentinel_stats TO PUBLIC;
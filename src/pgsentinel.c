@@ -13,6 +13,7 @@
 
 #include "pgsentinel.h"
 #include "postgres.h"
+#include <math.h>
 #include "fmgr.h"
 #include "access/xact.h"
 #include "lib/stringinfo.h"
@@ -21,12 +22,19 @@
 #include "postmaster/bgworker.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
+#include "storage/lock.h"
 #include "storage/proc.h"
+#include "storage/procarray.h"
 #include "utils/guc.h"
 #include "utils/snapmgr.h"
 #include "miscadmin.h"
 #include "storage/spin.h"
+#include "port/atomics.h"
+#include "port/pg_crc32c.h"
+#include "portability/instr_time.h"
+#include "storage/fd.h"
 #include "utils/date.h"
+#include "utils/timestamp.h"
 #include "utils/builtins.h"
 #include "utils/memutils.h"
 #include "funcapi.h"
@@ -39,7 +47,15 @@
 #include "commands/extension.h"
 #include "catalog/namespace.h"
 #include "catalog/pg_authid.h"
+#include "catalog/pg_type.h"
 #include "utils/acl.h"
+#include "utils/array.h"
+#include "commands/dbcommands.h"
+#if PG_VERSION_NUM >= 100000
+#include "common/ip.h"
+#else
+#include "libpq/ip.h"
+#endif
 
 /* Handle privilege checking across PostgreSQL versions */
 #if PG_VERSION_NUM >= 150000
@@ -50,12 +66,34 @@
 	#define IS_ALLOWED_ROLE(userid) is_member_of_role(userid, DEFAULT_ROLE_READ_ALL_STATS)
 #endif
 
+/* Wait event classes have been renamed in 10 */
+#if PG_VERSION_NUM < 100000
+	#define PG_WAIT_LOCK WAIT_LOCK
+#endif
+
 PG_MODULE_MAGIC;
 PG_FUNCTION_INFO_V1(pg_active_session_history);
 PG_FUNCTION_INFO_V1(pg_stat_statements_history);
+PG_FUNCTION_INFO_V1(pg_stat_statements_history_deltas);
+PG_FUNCTION_INFO_V1(pg_active_session_history_summary);
+PG_FUNCTION_INFO_V1(ash_top_queries);
+PG_FUNCTION_INFO_V1(ash_top_waits);
+PG_FUNCTION_INFO_V1(ash_top_sessions);
+PG_FUNCTION_INFO_V1(pgsentinel_stats);
+PG_FUNCTION_INFO_V1(pgsentinel_bench_fill);
+
+/* String keyed hash tables need to say so since 14 */
+#if PG_VERSION_NUM >= 140000
+	#define ASH_HASH_STRINGS HASH_STRINGS
+#else
+	#define ASH_HASH_STRINGS 0
+#endif
 
-#define PG_ACTIVE_SESSION_HISTORY_COLS        28
+#define PG_ACTIVE_SESSION_HISTORY_COLS        31
 #define PG_STAT_STATEMENTS_HISTORY_COLS       24
+#define PG_ACTIVE_SESSION_HISTORY_SUMMARY_COLS 8
+#define ASH_TOP_MAX_COLS                      6
+#define PGSENTINEL_STATS_COLS                 34
 #define EXTENSION_NAME "pgsentinel"
 
 /* Entry point of library loading */
@@ -78,15 +116,38 @@ static void ash_shmem_startup(void);
 static void ash_shmem_shutdown(int code, Datum arg);
 static void ash_shmem_request(void);
 
+/* history dump, see ash_dump_history() */
+static void ash_dump_history(void);
+static void ash_load_history(void);
+
 /* GUC variables */
 static int ash_sampling_period = 1;
+static int ash_sampling_interval = 0;
+static int ash_adaptive_min_interval = 0;
+static int ash_adaptive_max_interval = 10000;
+static int ash_sample_budget = 0;
 static int ash_max_entries = 1000;
 static int pgssh_max_entries = 10000;
 static bool pgssh_enable = false;
+static bool pgssh_compress = false;
 static bool ash_track_idle_trans = false;
+bool ash_native_sampler = true;
+static bool ash_save = true;
+static bool ash_bench = false;
+static int ash_dict_max_entries = 8192;
+static int ash_max_query_texts = 1000;
+static int ash_summary_max_entries = 100000;
+static int ash_summary_bucket_width = 60;
+static int ash_summary_retention = 24 * 60 * 60;
 static int ash_restart_wait_time = 2;
 static char *pgsentinelDbName = "postgres";
 
+/*
+ * Maximum number of entries given at once to the archive, and written by a
+ * tick: two blocks, see ASH_ARCHIVE_BLOCK_ROWS
+ */
+#define ASH_ARCHIVE_FLUSH_ROWS	16384
+
 /* Worker name */
 static char *worker_name = "pgsentinel";
 
@@ -99,10 +160,8 @@ static const char * const pgsa_query_no_track_idle=
  act.state_change, case when act.wait_event_type is null then 'CPU'  \
  else act.wait_event_type end as wait_event_type,case when act.wait_event is null \
  then 'CPU' else act.wait_event end as wait_event, act.state, act.backend_xid, \
- act.backend_xmin, act.query,(pg_blocking_pids(act.pid))[1], \
- cardinality(pg_blocking_pids(act.pid)),blk.state,gpi.* \
- from pg_stat_activity act left join pg_stat_activity blk  \
- on (pg_blocking_pids(act.pid))[1] = blk.pid,get_parsedinfo(act.pid) gpi \
+ act.backend_xmin, act.query,gpi.* \
+ from pg_stat_activity act join get_parsedinfo(-1) gpi on gpi.pid = act.pid \
  where act.state ='active' and act.pid != pg_backend_pid()";
 #elif PG_VERSION_NUM < 130000
 "select act.datid, act.datname, act.pid, act.usesysid, act.usename, \
@@ -111,10 +170,8 @@ static const char * const pgsa_query_no_track_idle=
  act.state_change, case when act.wait_event_type is null then 'CPU' \
  else act.wait_event_type end as wait_event_type,case when act.wait_event is null \
  then 'CPU' else act.wait_event end as wait_event, act.state, act.backend_xid, \
- act.backend_xmin, act.query, act.backend_type,(pg_blocking_pids(act.pid))[1], \
- cardinality(pg_blocking_pids(act.pid)),blk.state,gpi.* \
- from pg_stat_activity act left join pg_stat_activity blk  \
- on (pg_blocking_pids(act.pid))[1] = blk.pid,get_parsedinfo(act.pid) gpi \
+ act.backend_xmin, act.query, act.backend_type,gpi.* \
+ from pg_stat_activity act join get_parsedinfo(-1) gpi on gpi.pid = act.pid \
  where act.state ='active' and act.pid != pg_backend_pid()";
 #elif PG_VERSION_NUM < 160000
 "select act.datid, act.datname, act.pid, act.usesysid, act.usename, \
@@ -123,10 +180,8 @@ static const char * const pgsa_query_no_track_idle=
  act.state_change, case when act.wait_event_type is null then 'CPU' \
  else act.wait_event_type end as wait_event_type,case when act.wait_event is null \
  then 'CPU' else act.wait_event end as wait_event, act.state, act.backend_xid, \
- act.backend_xmin, act.query, act.backend_type,(pg_blocking_pids(act.pid))[1], \
- cardinality(pg_blocking_pids(act.pid)),blk.state,gpi.*, act.leader_pid \
- from pg_stat_activity act left join pg_stat_activity blk  \
- on (pg_blocking_pids(act.pid))[1] = blk.pid,get_parsedinfo(act.pid) gpi \
+ act.backend_xmin, act.query, act.backend_type,gpi.*, act.leader_pid \
+ from pg_stat_activity act join get_parsedinfo(-1) gpi on gpi.pid = act.pid \
  where act.state ='active' and act.pid != pg_backend_pid()";
 #else
 "select act.datid, act.datname, act.pid, act.usesysid, act.usename, \
@@ -135,11 +190,9 @@ static const char * const pgsa_query_no_track_idle=
  act.state_change, case when act.wait_event_type is null then 'CPU' \
  else act.wait_event_type end as wait_event_type,case when act.wait_event is null \
  then 'CPU' else act.wait_event end as wait_event, act.state, act.backend_xid, \
- act.backend_xmin, act.query, act.backend_type,(pg_blocking_pids(act.pid))[1], \
- cardinality(pg_blocking_pids(act.pid)),blk.state,gpi.pid,act.query_id, \
+ act.backend_xmin, act.query, act.backend_type,gpi.pid,act.query_id, \
  gpi.query, gpi.cmdtype, act.leader_pid \
- from pg_stat_activity act left join pg_stat_activity blk  \
- on (pg_blocking_pids(act.pid))[1] = blk.pid,get_parsedinfo(act.pid) gpi \
+ from pg_stat_activity act join get_parsedinfo(-1) gpi on gpi.pid = act.pid \
  where act.state ='active' and act.pid != pg_backend_pid()";
 #endif
 
@@ -151,10 +204,8 @@ static const char * const pgsa_query_track_idle=
  act.state_change, case when act.wait_event_type is null then 'CPU'  \
  else act.wait_event_type end as wait_event_type,case when act.wait_event is null \
  then 'CPU' else act.wait_event end as wait_event, act.state, act.backend_xid, \
- act.backend_xmin, act.query,(pg_blocking_pids(act.pid))[1], \
- cardinality(pg_blocking_pids(act.pid)),blk.state,gpi.* \
- from pg_stat_activity act left join pg_stat_activity blk  \
- on (pg_blocking_pids(act.pid))[1] = blk.pid,get_parsedinfo(act.pid) gpi \
+ act.backend_xmin, act.query,gpi.* \
+ from pg_stat_activity act join get_parsedinfo(-1) gpi on gpi.pid = act.pid \
  where act.state in ('active', 'idle in transaction') and act.pid != pg_backend_pid()";
 #elif PG_VERSION_NUM < 130000
 "select act.datid, act.datname, act.pid, act.usesysid, act.usename, \
@@ -163,10 +214,8 @@ static const char * const pgsa_query_track_idle=
  act.state_change, case when act.wait_event_type is null then 'CPU' \
  else act.wait_event_type end as wait_event_type,case when act.wait_event is null \
  then 'CPU' else act.wait_event end as wait_event, act.state, act.backend_xid, \
- act.backend_xmin, act.query, act.backend_type,(pg_blocking_pids(act.pid))[1], \
- cardinality(pg_blocking_pids(act.pid)),blk.state,gpi.* \
- from pg_stat_activity act left join pg_stat_activity blk  \
- on (pg_blocking_pids(act.pid))[1] = blk.pid,get_parsedinfo(act.pid) gpi \
+ act.backend_xmin, act.query, act.backend_type,gpi.* \
+ from pg_stat_activity act join get_parsedinfo(-1) gpi on gpi.pid = act.pid \
  where act.state in ('active', 'idle in transaction') and act.pid != pg_backend_pid()";
 #elif PG_VERSION_NUM < 160000
 "select act.datid, act.datname, act.pid, act.usesysid, act.usename, \
@@ -175,10 +224,8 @@ static const char * const pgsa_query_track_idle=
  act.state_change, case when act.wait_event_type is null then 'CPU' \
  else act.wait_event_type end as wait_event_type,case when act.wait_event is null \
  then 'CPU' else act.wait_event end as wait_event, act.state, act.backend_xid, \
- act.backend_xmin, act.query, act.backend_type,(pg_blocking_pids(act.pid))[1], \
- cardinality(pg_blocking_pids(act.pid)),blk.state,gpi.*, act.leader_pid \
- from pg_stat_activity act left join pg_stat_activity blk  \
- on (pg_blocking_pids(act.pid))[1] = blk.pid,get_parsedinfo(act.pid) gpi \
+ act.backend_xmin, act.query, act.backend_type,gpi.*, act.leader_pid \
+ from pg_stat_activity act join get_parsedinfo(-1) gpi on gpi.pid = act.pid \
  where act.state in ('active', 'idle in transaction') and act.pid != pg_backend_pid()";
 #else
 "select act.datid, act.datname, act.pid, act.usesysid, act.usename, \
@@ -187,44 +234,119 @@ static const char * const pgsa_query_track_idle=
  act.state_change, case when act.wait_event_type is null then 'CPU' \
  else act.wait_event_type end as wait_event_type,case when act.wait_event is null \
  then 'CPU' else act.wait_event end as wait_event, act.state, act.backend_xid, \
- act.backend_xmin, act.query, act.backend_type,(pg_blocking_pids(act.pid))[1], \
- cardinality(pg_blocking_pids(act.pid)),blk.state,gpi.pid,act.query_id, \
+ act.backend_xmin, act.query, act.backend_type,gpi.pid,act.query_id, \
  gpi.query, gpi.cmdtype, act.leader_pid \
- from pg_stat_activity act left join pg_stat_activity blk  \
- on (pg_blocking_pids(act.pid))[1] = blk.pid,get_parsedinfo(act.pid) gpi \
+ from pg_stat_activity act join get_parsedinfo(-1) gpi on gpi.pid = act.pid \
  where act.state in ('active', 'idle in transaction') and act.pid != pg_backend_pid()";
 #endif
 
+/*
+ * pg_stat_statements query, followed by the list of the queryids of the
+ * sample.  The query texts are not needed, so pg_stat_statements(false)
+ * does not read the external query text file.  From pg_stat_statements 1.9
+ * (PG 14), a statement run both at top level and nested has two entries,
+ * summed into one so that each (userid, dbid, queryid) has a single series
+ * of counters.
+ */
 static const char * const pg_stat_statements_query=
 #if PG_VERSION_NUM < 130000
 "select userid, dbid, queryid, calls, total_time, rows, shared_blks_hit, \
  shared_blks_read, shared_blks_dirtied, shared_blks_written, local_blks_hit, \
  local_blks_read, local_blks_dirtied, local_blks_written, temp_blks_read, \
- temp_blks_written, blk_read_time, blk_write_time from pg_stat_statements \
- where queryid in  (select queryid from pg_active_session_history  \
- where ash_time in (select ash_time from pg_active_session_history  \
- order by ash_time desc limit 1))";
-#else
+ temp_blks_written, blk_read_time, blk_write_time \
+ from pg_stat_statements(false) where queryid in ";
+#elif PG_VERSION_NUM < 140000
 "select userid, dbid, queryid, calls, total_exec_time, rows, shared_blks_hit, \
  shared_blks_read, shared_blks_dirtied, shared_blks_written, local_blks_hit, \
  local_blks_read, local_blks_dirtied, local_blks_written, temp_blks_read, \
  temp_blks_written, blk_read_time, blk_write_time, \
  plans, total_plan_time, wal_records, wal_fpi, wal_bytes \
- from pg_stat_statements \
- where queryid in  (select queryid from pg_active_session_history  \
- where ash_time in (select ash_time from pg_active_session_history  \
- order by ash_time desc limit 1))";
+ from pg_stat_statements(false) where queryid in ";
+#else
+"select userid, dbid, queryid, sum(calls)::int8, sum(total_exec_time), \
+ sum(rows)::int8, sum(shared_blks_hit)::int8, sum(shared_blks_read)::int8, \
+ sum(shared_blks_dirtied)::int8, sum(shared_blks_written)::int8, \
+ sum(local_blks_hit)::int8, sum(local_blks_read)::int8, \
+ sum(local_blks_dirtied)::int8, sum(local_blks_written)::int8, \
+ sum(temp_blks_read)::int8, sum(temp_blks_written)::int8, \
+ sum(blk_read_time), sum(blk_write_time), sum(plans)::int8, \
+ sum(total_plan_time), sum(wal_records)::int8, sum(wal_fpi)::int8, \
+ sum(wal_bytes) \
+ from pg_stat_statements(false) group by userid, dbid, queryid \
+ having queryid in ";
 #endif
 
-static void pg_active_session_history_internal(FunctionCallInfo fcinfo);
-static void pg_stat_statements_history_internal(FunctionCallInfo fcinfo);
-
-procEntry *ProcEntryArray = NULL;
+/*
+ * Filters given to the SRFs, checked before any datum of a row is built.
+ * A filter is not set when its argument is NULL.
+ */
+typedef struct ashFilter
+{
+	bool has_pid;
+	int pid;
+	bool has_queryid;
+	uint64 queryid;
+	bool has_datid;
+	Oid datid;
+	bool has_usesysid;
+	Oid usesysid;
+	char *wait_event_type;
+	char *backend_type;
+} ashFilter;
+
+static void pg_active_session_history_begin(FunctionCallInfo fcinfo,
+											TimestampTz from, TimestampTz to,
+											const ashFilter *filter);
+static Datum pg_active_session_history_internal(FunctionCallInfo fcinfo);
+static void pg_stat_statements_history_begin(FunctionCallInfo fcinfo,
+											 TimestampTz from, TimestampTz to,
+											 const ashFilter *filter,
+											 bool deltas);
+static Datum pg_stat_statements_history_internal(FunctionCallInfo fcinfo);
+static void pg_active_session_history_summary_begin(FunctionCallInfo fcinfo,
+													TimestampTz from,
+													TimestampTz to);
+static Datum pg_active_session_history_summary_internal(FunctionCallInfo fcinfo);
+
+procEntryPadded *ProcEntryArray = NULL;
 post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
 
-/* ash entry */
+/* kinds of query text keys */
+#define ASH_QTEXT_NONE		0
+#define ASH_QTEXT_QUERYID	1	/* parsed query text, keyed by queryid */
+#define ASH_QTEXT_TEXTHASH	2	/* any other text, keyed by its hash */
+
+/* query text store key */
+typedef struct ashQueryTextKey
+{
+	uint64 id;					/* queryid or hash of the text */
+	uint32 kind;				/* ASH_QTEXT_* */
+	uint32 pad;					/* always 0, the key is hashed as a blob */
+} ashQueryTextKey;
+
+/*
+ * Reference from an ash entry to a query text.  The slot may have been
+ * reused for another text since, readers must check the key.
+ */
+typedef struct ashQueryTextRef
+{
+	ashQueryTextKey key;
+	int slot;					/* -1 for no text */
+} ashQueryTextRef;
+
+/*
+ * ash entry
+ *
+ * Ash and pgssh entries are written in place by the worker only.  changecount
+ * is odd while a slot is being written, so readers copy a slot and retry if
+ * it changed meanwhile (like st_changecount in PgBackendStatus).  seq is the
+ * position of the entry in the history, the entry is visible once the worker
+ * has advanced the published head up to it.
+ */
 typedef struct ashEntry
 {
+	uint32 changecount;
+	uint64 seq;					/* 0 for a never used slot */
 	int pid;
 #if PG_VERSION_NUM >= 130000
 	int leader_pid;
@@ -234,36 +356,35 @@ typedef struct ashEntry
 	TimestampTz ash_time;
 	Oid datid;
 	Oid usesysid;
-	char *usename;
-	char *datname;
-	char *application_name;
-	char *wait_event_type;
-	char *wait_event;
-	char *state;
-	char *blocker_state;
-	char *client_hostname;
+	uint32 wait_event_info;		/* decoded when read */
+	/* ids in the string dictionary */
+	uint16 usename_id;
+	uint16 datname_id;
+	uint16 application_name_id;
+	uint16 state_id;
+	uint16 blocker_state_id;
+	uint16 client_hostname_id;
+	uint16 cmdtype_id;
+	uint16 backend_type_id;
+	uint16 client_addr_id;
 	int blockers;
 	int blockerpid;
-	char *top_level_query;
-	char *query;
-	char *cmdtype;
-	char *backend_type;
-	char *client_addr;
+	int root_blockerpid;		/* end of the chain of first blockers */
+	int blocker_depth;			/* length of that chain */
+	ashQueryTextRef top_level_query;
+	ashQueryTextRef query;
 	TransactionId backend_xmin;
 	TransactionId backend_xid;
 	TimestampTz backend_start;
 	TimestampTz xact_start;
 	TimestampTz query_start;
 	TimestampTz state_change;
+	double sample_weight;		/* seconds of activity the entry stands for */
 } ashEntry;
 
-/* pg_stat_statement_history entry */
-typedef struct pgsshEntry
+/* pg_stat_statements counters of a pgssh entry */
+typedef struct pgsshCounters
 {
-	TimestampTz ash_time;
-	Oid userid;
-	Oid dbid;
-	uint64 queryid;
 	int64 calls;
 	double total_time;
 	int64 rows;
@@ -286,34 +407,224 @@ typedef struct pgsshEntry
 	int64 wal_fpi;
 	uint64 wal_bytes;
 #endif
+} pgsshCounters;
+
+/*
+ * pg_stat_statement_history entry
+ *
+ * The counters are the difference with the previous entry of the same
+ * (userid, dbid, queryid), and an entry is only stored when they changed.
+ * Baseline entries hold the cumulative counters instead: the first entry of
+ * a query seen by the worker and the one following a reset of its
+ * statistics.
+ *
+ * Checkpoint entries, not returned by the views, hold the cumulative
+ * counters of the query as of its previous entry.  The worker writes one
+ * before the baseline or checkpoint its last deltas build on reaches the
+ * older half of the ring, and before the baseline of a reset, so that
+ * readers can rebuild the cumulative counters of every entry still in the
+ * ring, back from the first checkpoint of the query if need be.
+ */
+typedef struct pgsshEntry
+{
+	uint32 changecount;
+	bool baseline;
+	bool checkpoint;
+	uint64 seq;					/* 0 for a never used slot */
+	TimestampTz ash_time;
+	Oid userid;
+	Oid dbid;
+	uint64 queryid;
+	pgsshCounters counters;
 } pgsshEntry;
 
+/*
+ * Compressed pgssh history (pgsentinel_pgssh.compress)
+ *
+ * The entries are appended to blocks, each one encoded against the previous
+ * entry of its block: delta-of-delta for ash_time, zigzag varints for the
+ * integer counters, which are mostly small deltas already, and a varint of
+ * the XOR with the previous value for the floating point ones.  The seq of
+ * an entry is implicit, the entries of the blocks follow each other.
+ *
+ * Only the worker appends, updating the block header under its changecount
+ * after the data, which is never rewritten until the block is reused.
+ * Readers copy and decode a whole block at once.
+ */
+#define PGSSH_BLOCK_SIZE			8192
+/* Upper bound of the size of an encoded entry */
+#define PGSSH_ENCODED_MAX			256
+/* and of the number of entries of a block, an entry taking 32 bytes at least */
+#define PGSSH_BLOCK_MAX_ENTRIES		(PGSSH_BLOCK_SIZE / 32)
+
+typedef struct pgsshBlock
+{
+	uint32 changecount;
+	uint32 nentries;
+	uint64 no;					/* 0 for a never used block */
+	uint64 first_seq;			/* seq of the first entry */
+	uint32 used;				/* bytes of data */
+	char data[PGSSH_BLOCK_SIZE];
+} pgsshBlock;
+
+/* Previous entry of a block, the reference of the next one */
+typedef struct pgsshCodec
+{
+	TimestampTz ash_time;
+	int64 time_delta;
+	pgsshCounters counters;
+} pgsshCodec;
+
+static int pgssh_block_decode(const pgsshBlock *block, pgsshEntry *entries);
+static void pgssh_block_append(const pgsshEntry *entry);
+static void pgssh_load_last(void);
+
 /* counters */
+/* Phases of a sample timed in pgsentinel_stats */
+typedef enum ashStatsPhase
+{
+	ASH_STATS_CAPTURE,			/* reading the sessions */
+	ASH_STATS_STORE,			/* writing their entries */
+	ASH_STATS_PGSSH,			/* reading and storing pg_stat_statements */
+	ASH_STATS_NPHASES
+} ashStatsPhase;
+
+/*
+ * Histogram bucket b > 0 counts the durations in [2^(b-1), 2^b) us, bucket
+ * 0 the ones under 1 us and the last one all the longer ones.
+ */
+#define ASH_STATS_HIST_BUCKETS	24
+
+/* Last error of the worker, written under its changecount */
+typedef struct ashStatsError
+{
+	uint32 changecount;
+	TimestampTz time;			/* 0 if none */
+	char message[256];
+} ashStatsError;
+
 typedef struct intEntry
 {
-	int inserted;
-	int pgsshinserted;
+	/*
+	 * Number of entries ever written (ash_written, pgssh_written, private to
+	 * the worker) and published to readers (ash_head, pgssh_head).  The worker
+	 * publishes a whole sample at once.
+	 */
+	uint64 ash_written;
+	uint64 pgssh_written;
+	uint64 summary_written;
+	pg_atomic_uint64 ash_head;
+	pg_atomic_uint64 pgssh_head;
+	pg_atomic_uint64 summary_head;
+	/* same for the compressed pgssh blocks, numbered from 1 */
+	uint64 pgssh_blocks_written;
+	pg_atomic_uint64 pgssh_block_head;
+	/* archive, only changed by the worker */
+	uint64 archived_seq;		/* last ash entry moved to the archive */
+	uint64 archive_lost;		/* overwritten before they were archived */
+	/* sampling schedule, maintained by the worker */
+	TimestampTz last_tick;		/* scheduled time of the last sample */
+	int64 last_tick_lag;		/* how late the last sample started, in us */
+	int64 max_tick_lag;
+	int64 total_tick_lag;
+	uint64 ticks;
+	uint64 missed_ticks;		/* deadlines skipped because we were late */
+	/* current sampling rate, maintained by the worker */
+	int64 sample_period;		/* in us */
+	double sample_fraction;		/* of the active sessions that are sampled */
+	/* cost of the samples, in us */
+	int64 phase_time[ASH_STATS_NPHASES];
+	uint64 phase_hist[ASH_STATS_NPHASES][ASH_STATS_HIST_BUCKETS];
+	ashStatsError last_error;
+	/* string dictionary, only changed by the worker */
+	int dictentries;			/* number of strings, including the empty one */
+	bool dictfull;
+	/* query text store, only changed by the worker */
+	int qtexthand;				/* clock sweep position */
+	int qtextentries;
+	uint64 qtextevictions;
+	/* latch of the worker, to wake it up */
+	Latch *worker_latch;
+	/* pending pgsentinel_bench_fill() request, 0 if none */
+	pg_atomic_uint64 bench_fill;
 } intEntry;
 
+/* query text store hash entry */
+typedef struct ashQueryTextEntry
+{
+	ashQueryTextKey key;		/* hash key, must be first */
+	int slot;
+} ashQueryTextEntry;
+
+/*
+ * query text store slot, the text itself is in AshQueryTextBuffer.
+ * changecount is odd while the worker rewrites the slot, like
+ * st_changecount in PgBackendStatus.
+ */
+typedef struct ashQueryTextSlot
+{
+	uint32 changecount;
+	int usage;					/* clock sweep counter */
+	ashQueryTextKey key;
+} ashQueryTextSlot;
+
+#define ASH_QTEXT_MAX_USAGE	5
+
+/* string dictionary hash entry */
+typedef struct ashDictEntry
+{
+	char str[NAMEDATALEN];		/* hash key, must be first */
+	uint16 id;
+} ashDictEntry;
+
+/* summary row key, hashed as a blob so always zeroed first */
+typedef struct ashSummaryKey
+{
+	TimestampTz bucket;			/* start of the time bucket */
+	uint64 queryid;
+	Oid datid;
+	uint32 wait_event_info;
+	uint16 backend_type_id;
+} ashSummaryKey;
+
+/*
+ * Summary of the ash entries: the number of samples per time bucket and
+ * key.  The worker appends a row the first time it samples a key in the
+ * current bucket and increments it afterwards, so the ring of rows is in
+ * bucket order, and published like the ash entries.
+ */
+typedef struct ashSummaryEntry
+{
+	uint32 changecount;			/* see ashEntry */
+	uint64 seq;
+	ashSummaryKey key;
+	int64 samples;
+	double sample_weight;		/* sum of the weights of the samples */
+} ashSummaryEntry;
+
+/* rows of the current bucket, private to the worker */
+typedef struct ashSummaryLocalEntry
+{
+	ashSummaryKey key;			/* hash key, must be first */
+	uint64 seq;
+} ashSummaryLocalEntry;
+
 /* For shared memory */
-static char *AshEntryUsenameBuffer = NULL;
-static char *AshEntryDatnameBuffer = NULL;
-static char *AshEntryAppnameBuffer = NULL;
-static char *AshEntryWaitEventTypeBuffer = NULL;
-static char *AshEntryWaitEventBuffer = NULL;
-static char *AshEntryClientHostnameBuffer = NULL;
-static char *AshEntryTopLevelQueryBuffer = NULL;
-static char *AshEntryQueryBuffer = NULL;
-static char *AshEntryCmdTypeBuffer = NULL;
-static char *AshEntryBackendTypeBuffer = NULL;
-static char *AshEntryStateBuffer = NULL;
-static char *AshEntryBlockerStateBuffer = NULL;
-static char *AshEntryClientaddrBuffer = NULL;
 static ashEntry *AshEntryArray = NULL;
 static intEntry *IntEntryArray = NULL;
 static pgsshEntry *PgsshEntryArray = NULL;
+static pgsshBlock *PgsshBlocks = NULL;	/* instead of PgsshEntryArray */
+static char *AshDictBuffer = NULL;
+static HTAB *AshDictHash = NULL;
+static ashQueryTextSlot *AshQueryTextSlots = NULL;
+static char *AshQueryTextBuffer = NULL;
+static HTAB *AshQueryTextHash = NULL;
+static ashSummaryEntry *AshSummaryArray = NULL;
 static char *ProcQueryBuffer = NULL;
-static char *ProcCmdTypeBuffer = NULL;
+
+/* Worker's index of the summary rows of the current bucket */
+static HTAB *AshSummaryLocalHash = NULL;
+static TimestampTz AshSummaryLocalBucket = 0;
 
 /* Estimate amount of shared memory needed */
 static Size ash_entry_memsize(void);
@@ -321,6 +632,9 @@ static Size ash_entry_memsize(void);
 /* check extension is loaded/present */
 static bool PgSentinelHasBeenLoaded(void);
 
+/* decode an ash entry */
+static void ash_entry_to_row(const ashEntry *entry, ashRow *row);
+
 /* store ash entry */
 static void ash_entry_store(TimestampTz ash_time,const int pid,
 #if PG_VERSION_NUM >= 130000
@@ -331,11 +645,12 @@ static void ash_entry_store(TimestampTz ash_time,const int pid,
 							const char *client_addr, TransactionId backend_xmin,
 							TimestampTz backend_start, TimestampTz xact_start,
 							TimestampTz query_start, TimestampTz state_change,
-							const char *wait_event_type, const char *wait_event,
+							uint32 wait_event_info,
 							const char *state, const char *client_hostname,
 							const char *query, const char *backend_type,
 							Oid usesysid, TransactionId backend_xid,
 							int blockers, int blockerpid,
+							int root_blockerpid, int blocker_depth,
 							const char *blocker_state, uint64 queryid,
 							const char *gpi_query, const char *cmdtype);
 
@@ -352,12 +667,12 @@ static void ash_prepare_store(TimestampTz ash_time,const int pid,
 								TimestampTz backend_start,
 								TimestampTz xact_start, TimestampTz query_start,
 								TimestampTz state_change,
-								const char *wait_event_type,
-								const char *wait_event, const char *state,
+								uint32 wait_event_info, const char *state,
 								const char *client_hostname, const char *query,
 								const char *backend_type, Oid usesysid,
 								TransactionId backend_xid, int blockers,
-								int blockerpid, const char *blocker_state,
+								int blockerpid, int root_blockerpid,
+								int blocker_depth, const char *blocker_state,
 								uint64 queryid, const char *gpi_query,
 								const char *cmdtype);
 
@@ -369,35 +684,49 @@ ash_entry_memsize(void)
 
 	/* AshEntryArray */
 	size = mul_size(sizeof(ashEntry), ash_max_entries);
-	/* AshEntryUsenameBuffer */
-	size = add_size(size, mul_size(NAMEDATALEN, ash_max_entries));
-	/* AshEntryDatnameBuffer */
-	size = add_size(size, mul_size(NAMEDATALEN, ash_max_entries));
-	/* AshEntryAppnameBuffer */
-	size = add_size(size, mul_size(NAMEDATALEN, ash_max_entries));
-	/* AshEntryClientaddrBuffer */
-	size = add_size(size, mul_size(NAMEDATALEN, ash_max_entries));
-	/* AshEntryWaitEventTypeBuffer */
-	size = add_size(size, mul_size(NAMEDATALEN, ash_max_entries));
-	/* AshEntryWaitEventBuffer */
-	size = add_size(size, mul_size(NAMEDATALEN, ash_max_entries));
-	/* AshEntryStateBuffer */
-	size = add_size(size, mul_size(NAMEDATALEN, ash_max_entries));
-	/* AshEntryClientHostnameBuffer */
-	size = add_size(size, mul_size(NAMEDATALEN, ash_max_entries));
-	/* AshEntryQueryBuffer */
-	size = add_size(size, mul_size(pgstat_track_activity_query_size,
-															ash_max_entries));
-	/* AshEntryCmdTypeBuffer */
-	size = add_size(size, mul_size(NAMEDATALEN, ash_max_entries));
-	/* AshEntryTopLevelQueryBuffer */
+
+	return size;
+}
+
+/* Estimate amount of shared memory needed for the query text store */
+static Size
+ash_qtext_memsize(void)
+{
+	Size            size;
+
+	/* AshQueryTextSlots */
+	size = mul_size(sizeof(ashQueryTextSlot), ash_max_query_texts);
+	/* AshQueryTextBuffer */
 	size = add_size(size, mul_size(pgstat_track_activity_query_size,
-															ash_max_entries));
-	/* AshEntryBackendTypeBuffer */
-	size = add_size(size, mul_size(NAMEDATALEN, ash_max_entries));
-	/* AshEntryBlockerStateBuffer */
-	size = add_size(size, mul_size(NAMEDATALEN, ash_max_entries));
+															ash_max_query_texts));
+	/* AshQueryTextHash */
+	size = add_size(size, hash_estimate_size(ash_max_query_texts,
+											 sizeof(ashQueryTextEntry)));
+	return size;
+}
+
+/* Estimate amount of shared memory needed for the string dictionary */
+static Size
+ash_dict_memsize(void)
+{
+	Size            size;
+
+	/* AshDictBuffer */
+	size = mul_size(NAMEDATALEN, ash_dict_max_entries);
+	/* AshDictHash */
+	size = add_size(size, hash_estimate_size(ash_dict_max_entries,
+											 sizeof(ashDictEntry)));
+	return size;
+}
+
+/* Estimate amount of shared memory needed for the summary */
+static Size
+ash_summary_memsize(void)
+{
+	Size            size;
 
+	/* AshSummaryArray */
+	size = mul_size(sizeof(ashSummaryEntry), ash_summary_max_entries);
 	return size;
 }
 
@@ -411,24 +740,56 @@ int_entry_memsize(void)
 	return size;
 }
 
+/*
+ * Number of compressed pgssh blocks, taking the memory of pgssh_max_entries
+ * uncompressed entries.
+ */
+static int
+pgssh_nblocks(void)
+{
+	return Max(2, (int) ((double) pgssh_max_entries * sizeof(pgsshEntry) /
+						 sizeof(pgsshBlock)));
+}
+
 /* Estimate amount of shared memory needed for pgssh entry*/
 static Size
 pgssh_entry_memsize(void)
 {
 	Size            size;
-	/* PgsshEntryArray */
-	size = mul_size(sizeof(pgsshEntry), pgssh_max_entries);
+	/* PgsshEntryArray or PgsshBlocks */
+	if (pgssh_compress)
+		size = mul_size(sizeof(pgsshBlock), pgssh_nblocks());
+	else
+		size = mul_size(sizeof(pgsshEntry), pgssh_max_entries);
 	return size;
 }
 
+/* Oldest compressed pgssh block still in memory, given the last one */
+static uint64
+pgssh_first_block(uint64 last)
+{
+	return last > (uint64) pgssh_nblocks() ? last - pgssh_nblocks() + 1 : 1;
+}
+
+/* Number of the entries of block no published as of head */
+static uint64
+pgssh_block_entries(const pgsshBlock *block, uint64 no, uint64 head)
+{
+	if (block->no != no || block->first_seq > head)
+		return 0;
+	return Min((uint64) block->nentries, head - block->first_seq + 1);
+}
+
 static void
 ash_shmem_startup(void)
 {
 
 	Size size;
 	bool   found;
+	bool   fresh;
 	char   *buffer;
 	int    i;
+	HASHCTL info;
 
 	if (ash_prev_shmem_startup_hook)
 		ash_prev_shmem_startup_hook();
@@ -447,11 +808,69 @@ ash_shmem_startup(void)
 	if (!found)
 	{
 		MemSet(IntEntryArray, 0, size);
-		IntEntryArray[0].inserted=0;
-		IntEntryArray[0].pgsshinserted=0;
+		pg_atomic_init_u64(&IntEntryArray[0].ash_head, 0);
+		pg_atomic_init_u64(&IntEntryArray[0].pgssh_head, 0);
+		pg_atomic_init_u64(&IntEntryArray[0].summary_head, 0);
+		pg_atomic_init_u64(&IntEntryArray[0].pgssh_block_head, 0);
+		pg_atomic_init_u64(&IntEntryArray[0].bench_fill, 0);
+		/* id 0 is the empty string */
+		IntEntryArray[0].dictentries=1;
 	}
+	fresh = !found;
 
-	if (pgssh_enable)
+	size = mul_size(NAMEDATALEN, ash_dict_max_entries);
+	AshDictBuffer = (char *) ShmemInitStruct("Ash Dictionary Buffer", size,
+																	&found);
+
+	if (!found)
+		MemSet(AshDictBuffer, 0, size);
+
+	info.keysize = NAMEDATALEN;
+	info.entrysize = sizeof(ashDictEntry);
+	AshDictHash = ShmemInitHash("Ash Dictionary Hash",
+								ash_dict_max_entries, ash_dict_max_entries,
+								&info, HASH_ELEM | ASH_HASH_STRINGS);
+
+	size = mul_size(sizeof(ashQueryTextSlot), ash_max_query_texts);
+	AshQueryTextSlots = (ashQueryTextSlot *)
+		ShmemInitStruct("Ash Query Text Slots", size, &found);
+
+	if (!found)
+		MemSet(AshQueryTextSlots, 0, size);
+
+	size = mul_size(pgstat_track_activity_query_size, ash_max_query_texts);
+	AshQueryTextBuffer = (char *)
+		ShmemInitStruct("Ash Query Text Buffer", size, &found);
+
+	if (!found)
+		MemSet(AshQueryTextBuffer, 0, size);
+
+	info.keysize = sizeof(ashQueryTextKey);
+	info.entrysize = sizeof(ashQueryTextEntry);
+	AshQueryTextHash = ShmemInitHash("Ash Query Text Hash",
+									 ash_max_query_texts, ash_max_query_texts,
+									 &info, HASH_ELEM | HASH_BLOBS);
+
+	if (ash_summary_max_entries > 0)
+	{
+		size = mul_size(sizeof(ashSummaryEntry), ash_summary_max_entries);
+		AshSummaryArray = (ashSummaryEntry *)
+			ShmemInitStruct("Ash Summary Array", size, &found);
+
+		if (!found)
+			MemSet(AshSummaryArray, 0, size);
+	}
+
+	if (pgssh_enable && pgssh_compress)
+	{
+		size = mul_size(sizeof(pgsshBlock), pgssh_nblocks());
+		PgsshBlocks = (pgsshBlock *) ShmemInitStruct("pgssh Blocks",
+													 size, &found);
+
+		if (!found)
+			MemSet(PgsshBlocks, 0, size);
+	}
+	else if (pgssh_enable)
 	{
 		size = mul_size(sizeof(pgsshEntry), pgssh_max_entries);
 		PgsshEntryArray = (pgsshEntry *) ShmemInitStruct("pgssh Entry Array",
@@ -461,8 +880,8 @@ ash_shmem_startup(void)
 			MemSet(PgsshEntryArray, 0, size);
 	}
 
-	size = mul_size(sizeof(procEntry), get_max_procs_count());
-	ProcEntryArray = (procEntry *) ShmemInitStruct("Get_parsedinfo Proc Entry",
+	size = mul_size(sizeof(procEntryPadded), get_max_procs_count());
+	ProcEntryArray = (procEntryPadded *) ShmemInitStruct("Get_parsedinfo Proc Entry",
 																size, &found);
 
 	if (!found)
@@ -470,7 +889,7 @@ ash_shmem_startup(void)
 		MemSet(ProcEntryArray, 0, size);
 	}
 
-	size = mul_size(pgstat_track_activity_query_size, get_max_procs_count());
+	size = mul_size(proc_entry_query_size(), get_max_procs_count());
 	ProcQueryBuffer = (char *) ShmemInitStruct("Proc Query Buffer", size,
 																	&found);
 
@@ -482,277 +901,612 @@ ash_shmem_startup(void)
 		buffer = ProcQueryBuffer;
 		for (i = 0; i < get_max_procs_count(); i++)
 		{
-			ProcEntryArray[i].query= buffer;
-			buffer += pgstat_track_activity_query_size;
+			ProcEntryArray[i].entry.query= buffer;
+			buffer += proc_entry_query_size();
 		}
 	}
 
-	size = mul_size(NAMEDATALEN, get_max_procs_count());
-	ProcCmdTypeBuffer = (char *) ShmemInitStruct("Proc CmdType Buffer", size,
-																		&found);
+	/*
+	 * set up a shmem exit hook to dump the history at shutdown, and reload
+	 * the one dumped at the previous shutdown.
+	 */
+	if (!IsUnderPostmaster)
+		on_shmem_exit(ash_shmem_shutdown, (Datum) 0);
 
-	if (!found)
-	{
-		MemSet(ProcCmdTypeBuffer, 0, size);
+	if (!IsUnderPostmaster && fresh)
+		ash_load_history();
 
-		/* Initialize pointers. */
-		buffer = ProcCmdTypeBuffer;
-		for (i = 0; i < get_max_procs_count(); i++)
-		{
-			ProcEntryArray[i].cmdtype= buffer;
-			buffer += NAMEDATALEN;
-		}
-	}
+	if (found)
+		return;
+}
 
-	size = mul_size(NAMEDATALEN, ash_max_entries);
-	AshEntryUsenameBuffer = (char *)
-		ShmemInitStruct("Ash Entry useName Buffer", size, &found);
+static void
+ash_shmem_shutdown(int code, Datum arg)
+{
+	/* Don't try to dump during a crash. */
+	if (code)
+		return;
 
-	if (!found)
-	{
-		MemSet(AshEntryUsenameBuffer, 0, size);
+	/* Safety check ... shouldn't get here unless shmem is set up. */
+	if (!AshEntryArray)
+		return;
 
-		/* Initialize usename pointers. */
-		buffer = AshEntryUsenameBuffer;
-		for (i = 0; i < ash_max_entries; i++)
-		{
-			AshEntryArray[i].usename = buffer;
-			buffer += NAMEDATALEN;
-		}
-	}
+	/* Don't dump if told not to. */
+	if (!ash_save)
+		return;
 
+	ash_dump_history();
+}
 
-	size = mul_size(NAMEDATALEN, ash_max_entries);
-	AshEntryDatnameBuffer = (char *)
-		ShmemInitStruct("Ash Entry DatName Buffer", size, &found);
+/*
+ * History dump file.
+ *
+ * Written at clean shutdown and read back (then removed) at startup, like
+ * pg_stat_statements does.  Layout:
+ *
+ *	ashDumpHeader
+ *	dictionary strings 1 .. dict_entries - 1, NAMEDATALEN bytes each
+ *	query texts: ashQueryTextKey, slot, length, text
+ *	ash entries, oldest first
+ *	pgssh entries, oldest first
+ *	summary rows, oldest first
+ *	CRC-32C of all the above
+ *
+ * Entries are dumped as is, so the header records the server version and the
+ * entry sizes and a dump from another build is ignored.
+ */
+#define ASH_DUMP_FILE	PGSTAT_STAT_PERMANENT_DIRECTORY "/pgsentinel.stat"
 
-	if (!found)
-	{
-		MemSet(AshEntryDatnameBuffer, 0, size);
+/* Magic number identifying the dump file format */
+static const uint32 ASH_DUMP_FILE_HEADER = 0x50475303;
 
-		/* Initialize Datname pointers. */
-		buffer = AshEntryDatnameBuffer;
-		for (i = 0; i < ash_max_entries; i++)
-		{
-			AshEntryArray[i].datname = buffer;
-			buffer += NAMEDATALEN;
-		}
-	}
+typedef struct ashDumpHeader
+{
+	uint32 magic;
+	uint32 pg_version;
+	uint32 ash_entry_size;
+	uint32 pgssh_entry_size;
+	uint32 summary_entry_size;
+	uint32 summary_bucket_width;
+	uint32 dict_entries;		/* including the empty string */
+	uint32 qtexts;
+	uint64 ash_entries;
+	uint64 pgssh_entries;
+	uint64 summary_entries;
+	uint64 ash_head;			/* sequence number of the last entries */
+	uint64 pgssh_head;
+	uint64 summary_head;
+	uint64 archived_seq;
+} ashDumpHeader;
+
+/* fwrite() that maintains the file checksum */
+static bool
+ash_dump_write(FILE *file, const void *data, Size len, pg_crc32c *crc)
+{
+	COMP_CRC32C(*crc, data, len);
+	return fwrite(data, 1, len, file) == len;
+}
 
+/* fread() that maintains the file checksum */
+static bool
+ash_dump_read(FILE *file, void *data, Size len, pg_crc32c *crc)
+{
+	if (fread(data, 1, len, file) != len)
+		return false;
+	COMP_CRC32C(*crc, data, len);
+	return true;
+}
 
-	size = mul_size(NAMEDATALEN, ash_max_entries);
-	AshEntryAppnameBuffer = (char *)
-		ShmemInitStruct("Ash Entry AppName Buffer", size, &found);
+/* Dump the history into ASH_DUMP_FILE, the worker must be gone */
+static void
+ash_dump_history(void)
+{
+	FILE *file;
+	ashDumpHeader header;
+	pg_crc32c crc;
+	uint64 head;
+	uint64 seq;
+	uint64 no;
+	uint64 last;
+	int i;
 
-	if (!found)
+	file = AllocateFile(ASH_DUMP_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	MemSet(&header, 0, sizeof(ashDumpHeader));
+	header.magic = ASH_DUMP_FILE_HEADER;
+	header.pg_version = PG_VERSION_NUM;
+	header.ash_entry_size = sizeof(ashEntry);
+	header.pgssh_entry_size = sizeof(pgsshEntry);
+	header.summary_entry_size = sizeof(ashSummaryEntry);
+	header.summary_bucket_width = ash_summary_bucket_width;
+	header.dict_entries = IntEntryArray[0].dictentries;
+	header.qtexts = IntEntryArray[0].qtextentries;
+	head = pg_atomic_read_u64(&IntEntryArray[0].ash_head);
+	header.ash_entries = Min(head, (uint64) ash_max_entries);
+	header.ash_head = head;
+	header.archived_seq = IntEntryArray[0].archived_seq;
+	if (PgsshEntryArray)
 	{
-		MemSet(AshEntryAppnameBuffer, 0, size);
-
-		/* Initialize Appname pointers. */
-		buffer = AshEntryAppnameBuffer;
-		for (i = 0; i < ash_max_entries; i++)
-		{
-			AshEntryArray[i].application_name = buffer;
-			buffer += NAMEDATALEN;
-		}
+		head = pg_atomic_read_u64(&IntEntryArray[0].pgssh_head);
+		header.pgssh_entries = Min(head, (uint64) pgssh_max_entries);
+		header.pgssh_head = head;
 	}
-
-	size = mul_size(NAMEDATALEN, ash_max_entries);
-	AshEntryClientaddrBuffer = (char *)
-		ShmemInitStruct("Ash Entry Client Addr Buffer", size, &found);
-
-	if (!found)
+	else if (PgsshBlocks)
 	{
-		MemSet(AshEntryClientaddrBuffer, 0, size);
-
-		/* Initialize Client Addr pointers. */
-		buffer = AshEntryClientaddrBuffer;
-		for (i = 0; i < ash_max_entries; i++)
-		{
-			AshEntryArray[i].client_addr = buffer;
-			buffer += NAMEDATALEN;
-		}
+		/* the blocks are dumped decoded, as uncompressed entries */
+		head = pg_atomic_read_u64(&IntEntryArray[0].pgssh_head);
+		last = pg_atomic_read_u64(&IntEntryArray[0].pgssh_block_head);
+		for (no = pgssh_first_block(last); no <= last; no++)
+			header.pgssh_entries +=
+				pgssh_block_entries(&PgsshBlocks[(no - 1) % pgssh_nblocks()],
+									no, head);
+		header.pgssh_head = head;
 	}
-
-	size = mul_size(NAMEDATALEN, ash_max_entries);
-	AshEntryWaitEventTypeBuffer = (char *)
-		ShmemInitStruct("Ash Entry Wait event type Buffer", size, &found);
-
-	if (!found)
+	if (AshSummaryArray)
 	{
-		MemSet(AshEntryWaitEventTypeBuffer, 0, size);
-
-		/* Initialize wait event type pointers. */
-		buffer = AshEntryWaitEventTypeBuffer;
-		for (i = 0; i < ash_max_entries; i++)
-		{
-			AshEntryArray[i].wait_event_type = buffer;
-			buffer += NAMEDATALEN;
-		}
+		head = pg_atomic_read_u64(&IntEntryArray[0].summary_head);
+		header.summary_entries = Min(head, (uint64) ash_summary_max_entries);
+		header.summary_head = head;
 	}
 
-	size = mul_size(NAMEDATALEN, ash_max_entries);
-	AshEntryWaitEventBuffer = (char *)
-		ShmemInitStruct("Ash Entry Wait Event Buffer", size, &found);
-
-	if (!found)
-	{
-		MemSet(AshEntryWaitEventBuffer, 0, size);
-
-		/* Initialize wait event pointers. */
-		buffer = AshEntryWaitEventBuffer;
-		for (i = 0; i < ash_max_entries; i++)
-		{
-			AshEntryArray[i].wait_event = buffer;
-			buffer += NAMEDATALEN;
-		}
-	}
+	INIT_CRC32C(crc);
 
+	if (!ash_dump_write(file, &header, sizeof(ashDumpHeader), &crc))
+		goto error;
 
-	size = mul_size(NAMEDATALEN, ash_max_entries);
-	AshEntryStateBuffer = (char *)
-		ShmemInitStruct("Ash Entry State Buffer", size, &found);
+	if (header.dict_entries > 1 &&
+		!ash_dump_write(file, AshDictBuffer + NAMEDATALEN,
+						(Size) (header.dict_entries - 1) * NAMEDATALEN, &crc))
+		goto error;
 
-	if (!found)
+	for (i = 0; i < ash_max_query_texts; i++)
 	{
-		MemSet(AshEntryStateBuffer, 0, size);
-
-		/* Initialize state pointers. */
-		buffer = AshEntryStateBuffer;
-		for (i = 0; i < ash_max_entries; i++)
-		{
-			AshEntryArray[i].state = buffer;
-			buffer += NAMEDATALEN;
-		}
+		ashQueryTextSlot *slot = &AshQueryTextSlots[i];
+		char *text = AshQueryTextBuffer +
+			(Size) i * pgstat_track_activity_query_size;
+		int32 len;
+
+		if (slot->key.kind == ASH_QTEXT_NONE)
+			continue;
+
+		len = strlen(text);
+		if (!ash_dump_write(file, &slot->key, sizeof(ashQueryTextKey), &crc) ||
+			!ash_dump_write(file, &i, sizeof(int), &crc) ||
+			!ash_dump_write(file, &len, sizeof(int32), &crc) ||
+			!ash_dump_write(file, text, len, &crc))
+			goto error;
 	}
 
-	size = mul_size(NAMEDATALEN, ash_max_entries);
-	AshEntryClientHostnameBuffer = (char *)
-		ShmemInitStruct("Ash Entry Client Hostname Buffer", size, &found);
-
-	if (!found)
+	head = pg_atomic_read_u64(&IntEntryArray[0].ash_head);
+	for (seq = head - header.ash_entries + 1; seq <= head; seq++)
 	{
-		MemSet(AshEntryClientHostnameBuffer, 0, size);
+		if (!ash_dump_write(file, &AshEntryArray[(seq - 1) % ash_max_entries],
+							sizeof(ashEntry), &crc))
+			goto error;
+	}
 
-		/* Initialize client hostname pointers. */
-		buffer = AshEntryClientHostnameBuffer;
-		for (i = 0; i < ash_max_entries; i++)
+	if (PgsshEntryArray)
+	{
+		head = pg_atomic_read_u64(&IntEntryArray[0].pgssh_head);
+		for (seq = head - header.pgssh_entries + 1; seq <= head; seq++)
 		{
-			AshEntryArray[i].client_hostname = buffer;
-			buffer += NAMEDATALEN;
+			if (!ash_dump_write(file,
+								&PgsshEntryArray[(seq - 1) % pgssh_max_entries],
+								sizeof(pgsshEntry), &crc))
+				goto error;
 		}
 	}
-
-	size = mul_size(pgstat_track_activity_query_size, ash_max_entries);
-	AshEntryTopLevelQueryBuffer = (char *)
-		ShmemInitStruct("Ash Entry Top Level Query Buffer", size, &found);
-
-	if (!found)
+	else if (PgsshBlocks)
 	{
-		MemSet(AshEntryTopLevelQueryBuffer, 0, size);
+		pgsshEntry *entries = palloc(sizeof(pgsshEntry) *
+									 PGSSH_BLOCK_MAX_ENTRIES);
 
-		/* Initialize top level query pointers. */
-		buffer = AshEntryTopLevelQueryBuffer;
-		for (i = 0; i < ash_max_entries; i++)
+		last = pg_atomic_read_u64(&IntEntryArray[0].pgssh_block_head);
+		for (no = pgssh_first_block(last); no <= last; no++)
 		{
-			AshEntryArray[i].top_level_query = buffer;
-			buffer += pgstat_track_activity_query_size;
+			pgsshBlock *block = &PgsshBlocks[(no - 1) % pgssh_nblocks()];
+			uint64 n = pgssh_block_entries(block, no, header.pgssh_head);
+
+			if (n > 0 &&
+				(pgssh_block_decode(block, entries) < (int) n ||
+				 !ash_dump_write(file, entries, n * sizeof(pgsshEntry), &crc)))
+				goto error;
 		}
+		pfree(entries);
 	}
 
-	size = mul_size(pgstat_track_activity_query_size, ash_max_entries);
-	AshEntryQueryBuffer = (char *)
-		ShmemInitStruct("Ash Entry Query Buffer", size, &found);
-
-	if (!found)
+	if (AshSummaryArray)
 	{
-		MemSet(AshEntryQueryBuffer, 0, size);
-
-		/* Initialize query pointers. */
-		buffer = AshEntryQueryBuffer;
-		for (i = 0; i < ash_max_entries; i++)
+		head = pg_atomic_read_u64(&IntEntryArray[0].summary_head);
+		for (seq = head - header.summary_entries + 1; seq <= head; seq++)
 		{
-			AshEntryArray[i].query = buffer;
-			buffer += pgstat_track_activity_query_size;
+			if (!ash_dump_write(file,
+								&AshSummaryArray[(seq - 1) % ash_summary_max_entries],
+								sizeof(ashSummaryEntry), &crc))
+				goto error;
 		}
 	}
 
-	size = mul_size(NAMEDATALEN, ash_max_entries);
-	AshEntryCmdTypeBuffer = (char *)
-		ShmemInitStruct("Ash Entry CmdType Buffer", size, &found);
+	FIN_CRC32C(crc);
+	if (fwrite(&crc, sizeof(pg_crc32c), 1, file) != 1)
+		goto error;
 
-	if (!found)
+	if (FreeFile(file))
 	{
-		MemSet(AshEntryCmdTypeBuffer, 0, size);
-
-		/* Initialize cmdtype pointers. */
-		buffer = AshEntryCmdTypeBuffer;
-		for (i = 0; i < ash_max_entries; i++)
-		{
-			AshEntryArray[i].cmdtype = buffer;
-			buffer += NAMEDATALEN;
-		}
+		file = NULL;
+		goto error;
 	}
 
+	/*
+	 * Rename file into place, so we atomically replace any old one.
+	 */
+	(void) durable_rename(ASH_DUMP_FILE ".tmp", ASH_DUMP_FILE, LOG);
+
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m",
+					ASH_DUMP_FILE ".tmp")));
+	if (file)
+		FreeFile(file);
+	unlink(ASH_DUMP_FILE ".tmp");
+}
 
-	size = mul_size(NAMEDATALEN, ash_max_entries);
-	AshEntryBackendTypeBuffer = (char *)
-		ShmemInitStruct("Ash Entry Backend Type Buffer", size, &found);
+/* Read len bytes of the dump that are not kept, for the checksum only */
+static bool
+ash_load_skip(FILE *file, uint64 len, pg_crc32c *crc)
+{
+	char buf[65536];
 
-	if (!found)
+	while (len > 0)
 	{
-		MemSet(AshEntryBackendTypeBuffer, 0, size);
+		Size chunk = (Size) Min(len, (uint64) sizeof(buf));
 
-		/* Initialize backend type pointers. */
-		buffer = AshEntryBackendTypeBuffer;
-		for (i = 0; i < ash_max_entries; i++)
-		{
-			AshEntryArray[i].backend_type = buffer;
-			buffer += NAMEDATALEN;
-		}
+		if (!ash_dump_read(file, buf, chunk, crc))
+			return false;
+		len -= chunk;
 	}
+	return true;
+}
 
-	size = mul_size(NAMEDATALEN, ash_max_entries);
-	AshEntryBlockerStateBuffer = (char *)
-		ShmemInitStruct("Ash Entry Blocker State Buffer", size, &found);
-
-	if (!found)
+/*
+ * Read the entries of a ring dumped up to head straight into its slots, in
+ * at most two reads.  The oldest entries that do not fit are skipped.
+ */
+static bool
+ash_load_ring(FILE *file, char *ring, Size entry_size, uint64 nslots,
+			  uint64 entries, uint64 head, pg_crc32c *crc)
+{
+	uint64 kept = Min(entries, nslots);
+	uint64 first = (head - kept) % nslots;
+	uint64 run = Min(kept, nslots - first);
+
+	if (!ash_load_skip(file, (entries - kept) * entry_size, crc))
+		return false;
+	if (run > 0 &&
+		!ash_dump_read(file, ring + first * entry_size, run * entry_size, crc))
+		return false;
+	if (kept > run &&
+		!ash_dump_read(file, ring, (kept - run) * entry_size, crc))
+		return false;
+	return true;
+}
+
+/* Forget a history that was not completely loaded */
+static void
+ash_load_discard(void)
+{
+	HASH_SEQ_STATUS status;
+	ashDictEntry *dict;
+	ashQueryTextEntry *qtext;
+	int i;
+
+	pg_atomic_write_u64(&IntEntryArray[0].ash_head, 0);
+	pg_atomic_write_u64(&IntEntryArray[0].pgssh_head, 0);
+	pg_atomic_write_u64(&IntEntryArray[0].summary_head, 0);
+	pg_atomic_write_u64(&IntEntryArray[0].pgssh_block_head, 0);
+	IntEntryArray[0].ash_written = 0;
+	IntEntryArray[0].pgssh_written = 0;
+	IntEntryArray[0].summary_written = 0;
+	IntEntryArray[0].pgssh_blocks_written = 0;
+	IntEntryArray[0].archived_seq = 0;
+
+	hash_seq_init(&status, AshDictHash);
+	while ((dict = (ashDictEntry *) hash_seq_search(&status)) != NULL)
+		hash_search(AshDictHash, dict->str, HASH_REMOVE, NULL);
+	MemSet(AshDictBuffer, 0, mul_size(NAMEDATALEN, ash_dict_max_entries));
+	IntEntryArray[0].dictentries = 1;
+
+	hash_seq_init(&status, AshQueryTextHash);
+	while ((qtext = (ashQueryTextEntry *) hash_seq_search(&status)) != NULL)
+		hash_search(AshQueryTextHash, &qtext->key, HASH_REMOVE, NULL);
+	for (i = 0; i < ash_max_query_texts; i++)
+	{
+		AshQueryTextSlots[i].key.kind = ASH_QTEXT_NONE;
+		AshQueryTextSlots[i].usage = 0;
+	}
+	IntEntryArray[0].qtextentries = 0;
+}
+
+/*
+ * Load the history dumped at the last shutdown into the (new) shared memory.
+ * The file is removed afterwards, so a crash restarts with an empty history.
+ * The entries that do not fit anymore (smaller max_entries...) are dropped,
+ * keeping the most recent ones.
+ *
+ * The file is read once, straight into the rings, while its checksum is
+ * computed: nobody reads the shared memory yet, and the heads are only set
+ * once the checksum matches, everything is forgotten otherwise.
+ */
+static void
+ash_load_history(void)
+{
+	FILE *file;
+	ashDumpHeader header;
+	pg_crc32c crc;
+	pg_crc32c file_crc;
+	instr_time start;
+	instr_time end;
+	uint64 n;
+	uint64 seq;
+	uint64 kept;
+	int id;
+	int last_id;
+	char *text;
+
+	file = AllocateFile(ASH_DUMP_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			goto read_error;
+		/* No existing persisted history file, so we're done */
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(start);
+	INIT_CRC32C(crc);
+
+	if (!ash_dump_read(file, &header, sizeof(ashDumpHeader), &crc))
+		goto read_error;
+
+	if (header.magic != ASH_DUMP_FILE_HEADER ||
+		header.pg_version != PG_VERSION_NUM ||
+		header.ash_entry_size != sizeof(ashEntry) ||
+		header.pgssh_entry_size != sizeof(pgsshEntry) ||
+		header.summary_entry_size != sizeof(ashSummaryEntry))
 	{
-		MemSet(AshEntryBlockerStateBuffer, 0, size);
+		ereport(LOG,
+				(errmsg("ignoring pgsentinel history file \"%s\" written by another version",
+						ASH_DUMP_FILE)));
+		goto done;
+	}
 
-		/* Initialize state pointers. */
-		buffer = AshEntryBlockerStateBuffer;
-		for (i = 0; i < ash_max_entries; i++)
+	/* dictionary, ids are kept so the entries need no change */
+	n = Min(header.dict_entries, (uint64) ash_dict_max_entries);
+	if (n > 1 &&
+		!ash_dump_read(file, AshDictBuffer + NAMEDATALEN,
+					   (Size) (n - 1) * NAMEDATALEN, &crc))
+		goto read_error;
+	if (header.dict_entries > n &&
+		!ash_load_skip(file, (header.dict_entries - n) * NAMEDATALEN, &crc))
+		goto read_error;
+
+	last_id = 0;
+	for (id = 1; id < (int) n; id++)
+	{
+		char *str = AshDictBuffer + (Size) id * NAMEDATALEN;
+		ashDictEntry *entry;
+		bool found;
+
+		str[NAMEDATALEN - 1] = '\0';
+		/* freed by ash_dict_reclaim() */
+		if (str[0] == '\0')
+			continue;
+		entry = (ashDictEntry *) hash_search(AshDictHash, str, HASH_ENTER_NULL,
+											 &found);
+		if (!entry || found)
 		{
-			AshEntryArray[i].blocker_state = buffer;
-			buffer += NAMEDATALEN;
+			MemSet(str, 0, NAMEDATALEN);
+			continue;
 		}
+		entry->id = id;
+		last_id = id;
 	}
+	IntEntryArray[0].dictentries = last_id + 1;
 
-	/*
-	 * set up a shmem exit hook to do whatever useful (dump to disk later on?).
-	 */
-	if (!IsUnderPostmaster)
-		on_shmem_exit(ash_shmem_shutdown, (Datum) 0);
+	/* query texts, each one goes back to its slot if it still exists */
+	text = palloc(pgstat_track_activity_query_size);
+	for (n = 0; n < header.qtexts; n++)
+	{
+		ashQueryTextKey key;
+		ashQueryTextEntry *entry;
+		int slot;
+		int32 len;
+		bool found;
+
+		if (!ash_dump_read(file, &key, sizeof(ashQueryTextKey), &crc) ||
+			!ash_dump_read(file, &slot, sizeof(int), &crc) ||
+			!ash_dump_read(file, &len, sizeof(int32), &crc))
+			goto read_error;
+		if (len < 0)
+			goto read_error;
+		if (len >= pgstat_track_activity_query_size)
+		{
+			/* written with a larger track_activity_query_size */
+			if (!ash_load_skip(file, len, &crc))
+				goto read_error;
+			continue;
+		}
+		if (!ash_dump_read(file, text, len, &crc))
+			goto read_error;
+		text[len] = '\0';
+
+		if (slot < 0 || slot >= ash_max_query_texts)
+			continue;
+
+		entry = (ashQueryTextEntry *) hash_search(AshQueryTextHash, &key,
+												  HASH_ENTER_NULL, &found);
+		if (!entry || found)
+			continue;
+		entry->slot = slot;
+		AshQueryTextSlots[slot].key = key;
+		AshQueryTextSlots[slot].usage = 1;
+		memcpy(AshQueryTextBuffer + (Size) slot * pgstat_track_activity_query_size,
+			   text, len + 1);
+		IntEntryArray[0].qtextentries++;
+	}
+	pfree(text);
+
+	/* ash entries, keeping their sequence numbers */
+	if (!ash_load_ring(file, (char *) AshEntryArray, sizeof(ashEntry),
+					   ash_max_entries, header.ash_entries, header.ash_head,
+					   &crc))
+		goto read_error;
+	kept = Min(header.ash_entries, (uint64) ash_max_entries);
+	for (seq = header.ash_head - kept + 1; seq <= header.ash_head; seq++)
+	{
+		ashEntry *entry = &AshEntryArray[(seq - 1) % ash_max_entries];
 
+		entry->changecount = 0;
+		entry->seq = seq;
+	}
 
-	if (found)
-		return;
-}
+	/* pgssh entries, if pgssh is still enabled */
+	if (PgsshEntryArray)
+	{
+		if (!ash_load_ring(file, (char *) PgsshEntryArray, sizeof(pgsshEntry),
+						   pgssh_max_entries, header.pgssh_entries,
+						   header.pgssh_head, &crc))
+			goto read_error;
+		kept = Min(header.pgssh_entries, (uint64) pgssh_max_entries);
+		for (seq = header.pgssh_head - kept + 1; seq <= header.pgssh_head; seq++)
+		{
+			pgsshEntry *entry = &PgsshEntryArray[(seq - 1) % pgssh_max_entries];
 
-static void
-ash_shmem_shutdown(int code, Datum arg)
-{
-	/* Don't try to dump during a crash. */
-	if (code)
-		return;
+			entry->changecount = 0;
+			entry->seq = seq;
+		}
+	}
+	else if (PgsshBlocks)
+	{
+		/* compressed again, the oldest blocks are reused if they don't fit */
+		pgsshEntry *entries = palloc(sizeof(pgsshEntry) *
+									 PGSSH_BLOCK_MAX_ENTRIES);
 
-	/* Safety check ... shouldn't get here unless shmem is set up. */
-	if (!AshEntryArray)
-		return;
+		seq = header.pgssh_head - header.pgssh_entries;
+		for (n = 0; n < header.pgssh_entries; n += kept)
+		{
+			uint64 i;
+
+			kept = Min(header.pgssh_entries - n,
+					   (uint64) PGSSH_BLOCK_MAX_ENTRIES);
+			if (!ash_dump_read(file, entries, kept * sizeof(pgsshEntry), &crc))
+				goto read_error;
+			for (i = 0; i < kept; i++)
+			{
+				entries[i].seq = ++seq;
+				pgssh_block_append(&entries[i]);
+			}
+		}
+		pfree(entries);
+	}
+	else if (!ash_load_skip(file, header.pgssh_entries * sizeof(pgsshEntry),
+							&crc))
+		goto read_error;
+
+	/* summary rows, if their buckets are still the same */
+	if (AshSummaryArray &&
+		header.summary_bucket_width == (uint32) ash_summary_bucket_width)
+	{
+		if (!ash_load_ring(file, (char *) AshSummaryArray,
+						   sizeof(ashSummaryEntry), ash_summary_max_entries,
+						   header.summary_entries, header.summary_head, &crc))
+			goto read_error;
+		kept = Min(header.summary_entries, (uint64) ash_summary_max_entries);
+		for (seq = header.summary_head - kept + 1; seq <= header.summary_head;
+			 seq++)
+		{
+			ashSummaryEntry *entry =
+				&AshSummaryArray[(seq - 1) % ash_summary_max_entries];
+
+			entry->changecount = 0;
+			entry->seq = seq;
+		}
+	}
+	else
+	{
+		if (!ash_load_skip(file,
+						   header.summary_entries * sizeof(ashSummaryEntry),
+						   &crc))
+			goto read_error;
+		header.summary_head = 0;
+	}
+
+	FIN_CRC32C(crc);
+	if (fread(&file_crc, sizeof(pg_crc32c), 1, file) != 1 ||
+		!EQ_CRC32C(crc, file_crc))
+	{
+		ereport(LOG,
+				(errmsg("ignoring invalid pgsentinel history file \"%s\"",
+						ASH_DUMP_FILE)));
+		ash_load_discard();
+		goto done;
+	}
+
+	/* the whole file is valid, publish what was loaded */
+	IntEntryArray[0].ash_written = header.ash_head;
+	IntEntryArray[0].archived_seq = header.archived_seq;
+	pg_atomic_write_u64(&IntEntryArray[0].ash_head,
+						IntEntryArray[0].ash_written);
+	if (PgsshEntryArray || PgsshBlocks)
+	{
+		IntEntryArray[0].pgssh_written = header.pgssh_head;
+		if (PgsshBlocks)
+			pg_atomic_write_u64(&IntEntryArray[0].pgssh_block_head,
+								IntEntryArray[0].pgssh_blocks_written);
+		pg_atomic_write_u64(&IntEntryArray[0].pgssh_head,
+							IntEntryArray[0].pgssh_written);
+	}
+	if (AshSummaryArray)
+	{
+		IntEntryArray[0].summary_written = header.summary_head;
+		pg_atomic_write_u64(&IntEntryArray[0].summary_head,
+							IntEntryArray[0].summary_written);
+	}
 
-	/* dump to disk ?*/
-	/* This is the place */
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_SUBTRACT(end, start);
+	ereport(LOG,
+			(errmsg("pgsentinel loaded " UINT64_FORMAT " history entries from \"%s\" in %.3f ms",
+					Min(header.ash_entries, (uint64) ash_max_entries),
+					ASH_DUMP_FILE,
+					INSTR_TIME_GET_MILLISEC(end))));
+
+	goto done;
+
+read_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not read file \"%s\": %m",
+					ASH_DUMP_FILE)));
+	/* do not expose a partially loaded history */
+	if (file)
+		ash_load_discard();
+
+done:
+	if (file)
+		FreeFile(file);
+
+	/*
+	 * Remove the persisted history file so it's not included in
+	 * backups/replication standbys, etc.  A new file will be written on next
+	 * shutdown.
+	 */
+	unlink(ASH_DUMP_FILE);
 }
 
 
@@ -784,1165 +1538,5282 @@ pgsentinel_sighup(SIGNAL_ARGS)
 	errno = save_errno;
 }
 
-static void
-ash_entry_store(TimestampTz ash_time, const int pid,
-#if PG_VERSION_NUM >= 130000
-				int leader_pid,
-#endif
-				const char *usename,
-				const int client_port, Oid datid, const char *datname,
-				const char *application_name, const char *client_addr,
-				TransactionId backend_xmin, TimestampTz backend_start,
-				TimestampTz xact_start, TimestampTz query_start,
-				TimestampTz state_change, const char *wait_event_type,
-				const char *wait_event, const char *state,
-				const char *client_hostname, const char *query,
-				const char *backend_type, Oid usesysid,
-				TransactionId backend_xid, int blockers, int blockerpid,
-				const char *blocker_state, uint64 queryid,
-				const char *gpi_query, const char *cmdtype)
+/* Append an unsigned varint to an encoded pgssh entry */
+static char *
+pgssh_put_varint(char *p, uint64 value)
 {
-	int inserted;
-	inserted=IntEntryArray[0].inserted-1;
-	memcpy(AshEntryArray[inserted].usename,usename,Min(strlen(usename)+1,
-																NAMEDATALEN-1));
-	memcpy(AshEntryArray[inserted].datname,datname,Min(strlen(datname)+1,
-																NAMEDATALEN-1));
-	memcpy(AshEntryArray[inserted].application_name,application_name,
-								Min(strlen(application_name)+1,NAMEDATALEN-1));
-	memcpy(AshEntryArray[inserted].wait_event_type,wait_event_type,
-								Min(strlen(wait_event_type)+1,NAMEDATALEN-1));
-	memcpy(AshEntryArray[inserted].wait_event,wait_event,
-								Min(strlen(wait_event)+1,NAMEDATALEN-1));
-	memcpy(AshEntryArray[inserted].state,state,Min(strlen(state)+1,
-																NAMEDATALEN-1));
-	memcpy(AshEntryArray[inserted].blocker_state,blocker_state,
-								Min(strlen(blocker_state)+1,NAMEDATALEN-1));
-	memcpy(AshEntryArray[inserted].client_hostname,client_hostname,
-								Min(strlen(client_hostname)+1,NAMEDATALEN-1));
-	memcpy(AshEntryArray[inserted].top_level_query,query,
-					Min((int) strlen(query)+1,pgstat_track_activity_query_size-1));
-	memcpy(AshEntryArray[inserted].backend_type,backend_type,
-									Min(strlen(backend_type)+1,NAMEDATALEN-1));
-	memcpy(AshEntryArray[inserted].client_addr,client_addr,
-									Min(strlen(client_addr)+1,NAMEDATALEN-1));
-	memcpy(AshEntryArray[inserted].query,gpi_query,Min((int) strlen(gpi_query)+1,
-										pgstat_track_activity_query_size-1));
-	memcpy(AshEntryArray[inserted].cmdtype,cmdtype,Min((int) strlen(cmdtype)+1,
-																NAMEDATALEN-1));
-	AshEntryArray[inserted].client_port=client_port;
-	AshEntryArray[inserted].datid=datid;
-	AshEntryArray[inserted].usesysid=usesysid;
-	AshEntryArray[inserted].pid=pid;
-#if PG_VERSION_NUM >= 130000
-	AshEntryArray[inserted].leader_pid=leader_pid;
-#endif
-	AshEntryArray[inserted].backend_xmin=backend_xmin;
-	AshEntryArray[inserted].backend_xid=backend_xid;
-	AshEntryArray[inserted].backend_start=backend_start;
-	AshEntryArray[inserted].xact_start=xact_start;
-	AshEntryArray[inserted].query_start=query_start;
-	AshEntryArray[inserted].state_change=state_change;
-	AshEntryArray[inserted].ash_time=ash_time;
-	AshEntryArray[inserted].blockers=blockers;
-	AshEntryArray[inserted].blockerpid=blockerpid;
-	AshEntryArray[inserted].queryid=queryid;
+	while (value >= 0x80)
+	{
+		*p++ = (char) (value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (char) value;
+	return p;
 }
 
-static void
-ash_prepare_store(TimestampTz ash_time, const int pid,
-#if PG_VERSION_NUM >= 130000
-					int leader_pid,
-#endif
-					const char* usename,
-					const int client_port, Oid datid, const char *datname,
-					const char *application_name, const char *client_addr,
-					TransactionId backend_xmin, TimestampTz backend_start,
-					TimestampTz xact_start, TimestampTz query_start,
-					TimestampTz state_change, const char *wait_event_type,
-					const char *wait_event, const char *state,
-					const char *client_hostname, const char *query,
-					const char *backend_type, Oid usesysid,
-					TransactionId backend_xid, int blockers, int blockerpid,
-					const char *blocker_state, uint64 queryid,
-					const char *gpi_query, const char *cmdtype)
+/* Same for a signed integer, zigzag encoded so that small ones stay short */
+static char *
+pgssh_put_int(char *p, int64 value)
 {
-	/* Safety check... */
-	if (!AshEntryArray) { return; }
+	uint64 u = (uint64) value;
 
-	IntEntryArray[0].inserted=(IntEntryArray[0].inserted % ash_max_entries) + 1;
-	ash_entry_store(ash_time, pid,
-#if PG_VERSION_NUM >= 130000
-					leader_pid,
-#endif
-					usename, client_port, datid, datname,
-					application_name, client_addr,backend_xmin, backend_start,
-					xact_start, query_start, state_change, wait_event_type,
-					wait_event, state, client_hostname, query, backend_type,
-					usesysid, backend_xid, blockers, blockerpid, blocker_state,
-					queryid, gpi_query, cmdtype);
+	return pgssh_put_varint(p, (u << 1) ^ (0 - (u >> 63)));
 }
 
-void
-pgsentinel_main(Datum main_arg)
+/* Same for a double, as the XOR with the previous value */
+static char *
+pgssh_put_double(char *p, double value, double prev)
 {
-	MemoryContext pgsentinel_loop_context;
-	MemoryContext saved_context;
+	uint64 bits;
+	uint64 prev_bits;
 
-	ereport(LOG, (errmsg("starting bgworker pgsentinel")));
+	memcpy(&bits, &value, sizeof(uint64));
+	memcpy(&prev_bits, &prev, sizeof(uint64));
+	return pgssh_put_varint(p, bits ^ prev_bits);
+}
 
-	/* Register functions for SIGTERM/SIGHUP management */
-	pqsignal(SIGHUP, pgsentinel_sighup);
-	pqsignal(SIGINT, SIG_IGN);
-	pqsignal(SIGTERM, pgsentinel_sigterm);
+static bool
+pgssh_get_varint(const char **p, const char *end, uint64 *value)
+{
+	int shift = 0;
 
-	/* We're now ready to receive signals */
-	BackgroundWorkerUnblockSignals();
+	*value = 0;
+	while (*p < end && shift < 64)
+	{
+		unsigned char c = (unsigned char) *(*p)++;
 
-	/* Connect to a database */
-#if (PG_VERSION_NUM < 110000)
-	BackgroundWorkerInitializeConnection(pgsentinelDbName, NULL);
-#else
-	BackgroundWorkerInitializeConnection(pgsentinelDbName, NULL, 0);
-#endif
+		*value |= (uint64) (c & 0x7f) << shift;
+		if ((c & 0x80) == 0)
+			return true;
+		shift += 7;
+	}
+	return false;
+}
 
-	pgsentinel_loop_context = AllocSetContextCreate(TopMemoryContext,
-													"pgsentinel loop context",
-													ALLOCSET_DEFAULT_SIZES);
+static bool
+pgssh_get_int(const char **p, const char *end, int64 *value)
+{
+	uint64 u;
 
-	saved_context = MemoryContextSwitchTo(pgsentinel_loop_context);
+	if (!pgssh_get_varint(p, end, &u))
+		return false;
+	*value = (int64) ((u >> 1) ^ (0 - (u & 1)));
+	return true;
+}
 
-	while (!got_sigterm)
-	{
-		int rc, ret;
-		uint64 i;
-		bool gotactives;
-		TimestampTz ash_time;
-		gotactives=false; 
+static bool
+pgssh_get_double(const char **p, const char *end, double *value, double prev)
+{
+	uint64 bits;
+	uint64 prev_bits;
+
+	if (!pgssh_get_varint(p, end, &bits))
+		return false;
+	memcpy(&prev_bits, &prev, sizeof(uint64));
+	bits ^= prev_bits;
+	memcpy(value, &bits, sizeof(uint64));
+	return true;
+}
 
-letswait:
-		/* Wait necessary amount of time */
-#if PG_VERSION_NUM >= 100000
-		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-								ash_sampling_period * 1000L,PG_WAIT_EXTENSION);
-		ResetLatch(MyLatch);
-#else
-		rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT |
-							WL_POSTMASTER_DEATH, ash_sampling_period * 1000L);
-		ResetLatch(&MyProc->procLatch);
+/*
+ * Encode a pgssh entry into buf, at least PGSSH_ENCODED_MAX bytes, against
+ * the previous entry of its block in codec, which is advanced.  Returns the
+ * length of the encoded entry.
+ */
+static int
+pgssh_encode(char *buf, const pgsshEntry *entry, pgsshCodec *codec)
+{
+	const pgsshCounters *c = &entry->counters;
+	char *p = buf;
+	int64 time_delta = entry->ash_time - codec->ash_time;
+
+	*p++ = (entry->baseline ? 1 : 0) | (entry->checkpoint ? 2 : 0);
+	p = pgssh_put_int(p, time_delta - codec->time_delta);
+	p = pgssh_put_varint(p, entry->userid);
+	p = pgssh_put_varint(p, entry->dbid);
+	memcpy(p, &entry->queryid, sizeof(uint64));
+	p += sizeof(uint64);
+
+#define PGSSH_PUT_INT(field) p = pgssh_put_int(p, c->field)
+#define PGSSH_PUT_DOUBLE(field) \
+	p = pgssh_put_double(p, c->field, codec->counters.field)
+
+	PGSSH_PUT_INT(calls);
+	PGSSH_PUT_DOUBLE(total_time);
+	PGSSH_PUT_INT(rows);
+	PGSSH_PUT_INT(shared_blks_hit);
+	PGSSH_PUT_INT(shared_blks_read);
+	PGSSH_PUT_INT(shared_blks_dirtied);
+	PGSSH_PUT_INT(shared_blks_written);
+	PGSSH_PUT_INT(local_blks_hit);
+	PGSSH_PUT_INT(local_blks_read);
+	PGSSH_PUT_INT(local_blks_dirtied);
+	PGSSH_PUT_INT(local_blks_written);
+	PGSSH_PUT_INT(temp_blks_read);
+	PGSSH_PUT_INT(temp_blks_written);
+	PGSSH_PUT_DOUBLE(blk_read_time);
+	PGSSH_PUT_DOUBLE(blk_write_time);
+#if PG_VERSION_NUM >= 130000
+	PGSSH_PUT_INT(plans);
+	PGSSH_PUT_DOUBLE(total_plan_time);
+	PGSSH_PUT_INT(wal_records);
+	PGSSH_PUT_INT(wal_fpi);
+	p = pgssh_put_varint(p, c->wal_bytes);
 #endif
+#undef PGSSH_PUT_INT
+#undef PGSSH_PUT_DOUBLE
 
-		CHECK_FOR_INTERRUPTS();
-
-		/* Emergency bailout if postmaster has died */
-		if (rc & WL_POSTMASTER_DEATH)
-			proc_exit(1);
+	codec->ash_time = entry->ash_time;
+	codec->time_delta = time_delta;
+	codec->counters = *c;
 
-		/* Process signals */
-		if (got_sighup)
-		{
-			/* Process config file */
-			got_sighup = false;
-			ProcessConfigFile(PGC_SIGHUP);
-			ereport(LOG, (errmsg("bgworker pgsentinel signal: processed SIGHUP")));
-		}
+	Assert(p - buf <= PGSSH_ENCODED_MAX);
+	return p - buf;
+}
 
-		if (got_sigterm)
-		{
-			/* Simply exit */
-			ereport(LOG, (errmsg("bgworker pgsentinel signal: processed SIGTERM")));
-			proc_exit(0);
-		}
+/*
+ * Decode the entry at *p, up to end, the reverse of pgssh_encode().  Returns
+ * false if the data is truncated.
+ */
+static bool
+pgssh_decode(const char **p, const char *end, pgsshEntry *entry,
+			 pgsshCodec *codec)
+{
+	pgsshCounters *c = &entry->counters;
+	int64 time_dod;
+	uint64 value;
+	char flags;
+
+	memset(entry, 0, sizeof(pgsshEntry));
+	if (*p >= end)
+		return false;
+	flags = *(*p)++;
+	entry->baseline = (flags & 1) != 0;
+	entry->checkpoint = (flags & 2) != 0;
+	if (!pgssh_get_int(p, end, &time_dod))
+		return false;
+	codec->time_delta += time_dod;
+	codec->ash_time += codec->time_delta;
+	entry->ash_time = codec->ash_time;
+	if (!pgssh_get_varint(p, end, &value))
+		return false;
+	entry->userid = (Oid) value;
+	if (!pgssh_get_varint(p, end, &value))
+		return false;
+	entry->dbid = (Oid) value;
+	if (end - *p < (int) sizeof(uint64))
+		return false;
+	memcpy(&entry->queryid, *p, sizeof(uint64));
+	*p += sizeof(uint64);
+
+#define PGSSH_GET_INT(field) \
+	do { \
+		int64 v; \
+		if (!pgssh_get_int(p, end, &v)) \
+			return false; \
+		c->field = v; \
+	} while (0)
+#define PGSSH_GET_DOUBLE(field) \
+	do { \
+		if (!pgssh_get_double(p, end, &c->field, codec->counters.field)) \
+			return false; \
+	} while (0)
+
+	PGSSH_GET_INT(calls);
+	PGSSH_GET_DOUBLE(total_time);
+	PGSSH_GET_INT(rows);
+	PGSSH_GET_INT(shared_blks_hit);
+	PGSSH_GET_INT(shared_blks_read);
+	PGSSH_GET_INT(shared_blks_dirtied);
+	PGSSH_GET_INT(shared_blks_written);
+	PGSSH_GET_INT(local_blks_hit);
+	PGSSH_GET_INT(local_blks_read);
+	PGSSH_GET_INT(local_blks_dirtied);
+	PGSSH_GET_INT(local_blks_written);
+	PGSSH_GET_INT(temp_blks_read);
+	PGSSH_GET_INT(temp_blks_written);
+	PGSSH_GET_DOUBLE(blk_read_time);
+	PGSSH_GET_DOUBLE(blk_write_time);
+#if PG_VERSION_NUM >= 130000
+	PGSSH_GET_INT(plans);
+	PGSSH_GET_DOUBLE(total_plan_time);
+	PGSSH_GET_INT(wal_records);
+	PGSSH_GET_INT(wal_fpi);
+	if (!pgssh_get_varint(p, end, &c->wal_bytes))
+		return false;
+#endif
+#undef PGSSH_GET_INT
+#undef PGSSH_GET_DOUBLE
 
-		SetCurrentStatementStartTimestamp();
-		StartTransactionCommand();
-		PushActiveSnapshot(GetTransactionSnapshot());
+	codec->counters = *c;
+	return true;
+}
 
-		if (!PgSentinelHasBeenLoaded()) {
-			PopActiveSnapshot();
-			CommitTransactionCommand();
-			MemoryContextReset(pgsentinel_loop_context);
-			goto letswait;
-		}
+/*
+ * Decode the entries of a copy of a block into entries, room for
+ * PGSSH_BLOCK_MAX_ENTRIES.  Returns their number, less than block->nentries
+ * if the block is corrupted.
+ */
+static int
+pgssh_block_decode(const pgsshBlock *block, pgsshEntry *entries)
+{
+	const char *p = block->data;
+	const char *end = block->data + Min(block->used, PGSSH_BLOCK_SIZE);
+	pgsshCodec codec;
+	uint32 n;
 
-		SPI_connect();
+	memset(&codec, 0, sizeof(codec));
+	for (n = 0; n < Min(block->nentries, PGSSH_BLOCK_MAX_ENTRIES); n++)
+	{
+		if (!pgssh_decode(&p, end, &entries[n], &codec))
+			break;
+		entries[n].seq = block->first_seq + n;
+	}
+	return n;
+}
 
-		if (ash_track_idle_trans)
-		{
-			pgstat_report_activity(STATE_RUNNING, pgsa_query_track_idle);
+/* Block being filled by the worker and its last entry, private to it */
+static pgsshBlock *PgsshOpenBlock = NULL;
+static pgsshCodec PgsshOpenCodec;
 
-			/* We can now execute queries via SPI */
-			ret = SPI_execute(pgsa_query_track_idle, true, 0);
-		}
-		else
-		{
-			pgstat_report_activity(STATE_RUNNING, pgsa_query_no_track_idle);
+/*
+ * Append an entry to the compressed pgssh history, opening the next block
+ * (the oldest one) when it does not fit in the current one.
+ */
+static void
+pgssh_block_append(const pgsshEntry *entry)
+{
+	char buf[PGSSH_ENCODED_MAX];
+	pgsshCodec codec = PgsshOpenCodec;
+	pgsshBlock *block = PgsshOpenBlock;
+	int len = 0;
 
-			/* We can now execute queries via SPI */
-			ret = SPI_execute(pgsa_query_no_track_idle, true, 0);
-		}
+	if (block != NULL)
+		len = pgssh_encode(buf, entry, &codec);
 
-		if (ret != SPI_OK_SELECT)
-			elog(FATAL, "cannot select from pg_stat_activity: error code %d", ret);
+	if (block == NULL || block->used + len > PGSSH_BLOCK_SIZE ||
+		block->nentries >= PGSSH_BLOCK_MAX_ENTRIES)
+	{
+		uint64 no = ++IntEntryArray[0].pgssh_blocks_written;
+
+		block = &PgsshBlocks[(no - 1) % pgssh_nblocks()];
+		ASH_BEGIN_WRITE(block);
+		block->no = no;
+		block->first_seq = entry->seq;
+		block->nentries = 0;
+		block->used = 0;
+		ASH_END_WRITE(block);
+		PgsshOpenBlock = block;
+
+		memset(&codec, 0, sizeof(codec));
+		len = pgssh_encode(buf, entry, &codec);
+	}
 
-		ash_time=GetCurrentTimestamp();
-		/* Do some processing */
+	memcpy(block->data + block->used, buf, len);
+	ASH_BEGIN_WRITE(block);
+	block->used += len;
+	block->nentries++;
+	ASH_END_WRITE(block);
+	PgsshOpenCodec = codec;
+}
 
-		if (SPI_processed > 0)
-		{
-			gotactives=true;
-			for (i = 0; i < SPI_processed; i++)
-			{
-				bool isnull;
-				Datum data;
-				char *usenamevalue=NULL;
-				char *datnamevalue=NULL;
-				char *appnamevalue=NULL;
-				char *wait_event_typevalue=NULL;
-				char *wait_eventvalue=NULL;
-				char *client_hostnamevalue=NULL;
-				char *queryvalue=NULL;
-				char *backend_typevalue=NULL;
-				char *statevalue=NULL;
-				char *blockerstatevalue=NULL;
-				char *clientaddrvalue=NULL;
-				int pidvalue;
-#if PG_VERSION_NUM >= 130000
-				int leader_pidvalue;
-#endif
-				int client_portvalue;
-				int blockersvalue;
-				int blockerpidvalue;
-				Oid datidvalue;
-				Oid usesysidvalue;
-				TransactionId backend_xminvalue;
-				TransactionId backend_xidvalue;
-				TimestampTz backend_startvalue;
-				TimestampTz xact_startvalue;
-				TimestampTz query_startvalue;
-				TimestampTz state_changevalue;
-				uint64 queryidvalue;
-				char *gpi_queryvalue = NULL;
-				char *cmdtypevalue = NULL;
-
-				/* Fetch values */
-
-				/* datid */
-				datidvalue = DatumGetObjectId(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,1, &isnull));
-
-				/* usesysid */
-				usesysidvalue = DatumGetObjectId(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,4, &isnull));
-
-				/* datname */
-				datnamevalue = DatumGetCString(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,2, &isnull));
-
-				/* pid */
-				pidvalue = DatumGetInt32(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,3, &isnull));
+/*
+ * Drop from the last block the entries a previous worker did not publish,
+ * they are going to be numbered again.  The next entry opens a new block.
+ */
+static void
+pgssh_block_truncate(void)
+{
+	uint64 no = IntEntryArray[0].pgssh_blocks_written;
+	uint64 head = IntEntryArray[0].pgssh_written;
+	pgsshBlock *block;
+	const char *p;
+	pgsshCodec codec;
+	uint32 keep;
+	uint32 n;
+
+	PgsshOpenBlock = NULL;
+	if (PgsshBlocks == NULL || no == 0)
+		return;
 
-#if PG_VERSION_NUM >= 100000
-				/* blockerpid */
-				blockerpidvalue = DatumGetInt32(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,21, &isnull));
+	block = &PgsshBlocks[(no - 1) % pgssh_nblocks()];
+	if (block->no != no || block->first_seq + block->nentries <= head + 1)
+		return;
 
-				/* blockers */
-				blockersvalue = DatumGetInt32(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,22, &isnull));
-#else
-				/* blockerpid */
-				blockerpidvalue = DatumGetInt32(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,20, &isnull));
+	keep = head >= block->first_seq ? head - block->first_seq + 1 : 0;
+	p = block->data;
+	memset(&codec, 0, sizeof(codec));
+	for (n = 0; n < keep; n++)
+	{
+		pgsshEntry entry;
 
-				/* blockers */
-				blockersvalue = DatumGetInt32(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,21, &isnull));
+		if (!pgssh_decode(&p, block->data + block->used, &entry, &codec))
+			break;
+	}
+
+	ASH_BEGIN_WRITE(block);
+	block->nentries = n;
+	block->used = p - block->data;
+	ASH_END_WRITE(block);
+}
+
+/* Make the entries written so far visible to the readers */
+static void
+ash_publish_entries(void)
+{
+	pg_write_barrier();
+	pg_atomic_write_u64(&IntEntryArray[0].ash_head,
+						IntEntryArray[0].ash_written);
+	/* before pgssh_head, so that readers find the blocks of its entries */
+	pg_atomic_write_u64(&IntEntryArray[0].pgssh_block_head,
+						IntEntryArray[0].pgssh_blocks_written);
+	pg_atomic_write_u64(&IntEntryArray[0].pgssh_head,
+						IntEntryArray[0].pgssh_written);
+	pg_atomic_write_u64(&IntEntryArray[0].summary_head,
+						IntEntryArray[0].summary_written);
+}
+
+/*
+ * Copy ash slot i into entry, returns false if it holds no entry published
+ * as of head.
+ */
+static bool
+ash_entry_fetch(int i, uint64 head, ashEntry *entry)
+{
+	volatile ashEntry *slot = &AshEntryArray[i];
+
+	ASH_READ_SLOT(slot, entry);
+
+	return entry->seq != 0 && entry->seq <= head;
+}
+
+/* Same as ash_entry_fetch() for the pgssh slots */
+static bool
+pgssh_entry_fetch(int i, uint64 head, pgsshEntry *entry)
+{
+	volatile pgsshEntry *slot = &PgsshEntryArray[i];
+
+	ASH_READ_SLOT(slot, entry);
+
+	return entry->seq != 0 && entry->seq <= head;
+}
+
+/* Same as ash_entry_fetch() for the summary rows */
+static bool
+ash_summary_fetch(int i, uint64 head, ashSummaryEntry *entry)
+{
+	volatile ashSummaryEntry *slot = &AshSummaryArray[i];
+
+	ASH_READ_SLOT(slot, entry);
+
+	return entry->seq != 0 && entry->seq <= head;
+}
+
+/*
+ * Index the summary rows of a new current bucket.  They are at the end of
+ * the ring if a previous worker already sampled this bucket.
+ */
+static void
+ash_summary_start_bucket(TimestampTz bucket)
+{
+	HASHCTL info;
+	uint64 seq;
+
+	if (AshSummaryLocalHash)
+		hash_destroy(AshSummaryLocalHash);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(ashSummaryKey);
+	info.entrysize = sizeof(ashSummaryLocalEntry);
+	AshSummaryLocalHash = hash_create("pgsentinel summary bucket", 256, &info,
+									  HASH_ELEM | HASH_BLOBS);
+	AshSummaryLocalBucket = bucket;
+
+	for (seq = IntEntryArray[0].summary_written;
+		 seq > 0 &&
+		 seq + ash_summary_max_entries > IntEntryArray[0].summary_written;
+		 seq--)
+	{
+		ashSummaryEntry *row = &AshSummaryArray[(seq - 1) % ash_summary_max_entries];
+		ashSummaryLocalEntry *local;
+
+		if (row->seq != seq || row->key.bucket != bucket)
+			break;
+
+		local = (ashSummaryLocalEntry *) hash_search(AshSummaryLocalHash,
+													 &row->key, HASH_ENTER,
+													 NULL);
+		local->seq = seq;
+	}
+}
+
+/* Count an ash entry in the summary */
+static void
+ash_summary_add(const ashEntry *entry)
+{
+	ashSummaryKey key;
+	ashSummaryLocalEntry *local;
+	ashSummaryEntry *row;
+	int64 width = (int64) ash_summary_bucket_width * USECS_PER_SEC;
+	bool found;
+
+	if (!AshSummaryArray)
+		return;
+
+	memset(&key, 0, sizeof(key));
+	key.bucket = entry->ash_time - entry->ash_time % width;
+	key.queryid = entry->queryid;
+	key.datid = entry->datid;
+	key.wait_event_info = entry->wait_event_info;
+	key.backend_type_id = entry->backend_type_id;
+
+	if (!AshSummaryLocalHash || key.bucket != AshSummaryLocalBucket)
+		ash_summary_start_bucket(key.bucket);
+
+	local = (ashSummaryLocalEntry *) hash_search(AshSummaryLocalHash, &key,
+												 HASH_ENTER, &found);
+	if (found)
+	{
+		row = &AshSummaryArray[(local->seq - 1) % ash_summary_max_entries];
+
+		/* unless the ring is too small for a single bucket */
+		if (row->seq == local->seq)
+		{
+			ASH_BEGIN_WRITE(row);
+			row->samples++;
+			row->sample_weight += entry->sample_weight;
+			ASH_END_WRITE(row);
+			return;
+		}
+	}
+
+	local->seq = ++IntEntryArray[0].summary_written;
+	row = &AshSummaryArray[(local->seq - 1) % ash_summary_max_entries];
+	ASH_BEGIN_WRITE(row);
+	row->seq = local->seq;
+	row->key = key;
+	row->samples = 1;
+	row->sample_weight = entry->sample_weight;
+	ASH_END_WRITE(row);
+}
+
+/*
+ * Ids of the dictionary freed by ash_dict_reclaim(), private to the worker,
+ * and the number of entries written when it last ran.
+ */
+static uint16 *ash_dict_free_ids = NULL;
+static int ash_dict_nfree = 0;
+static uint64 ash_dict_reclaimed_seq = 0;
+
+/*
+ * Free the ids of the dictionary that no ash entry nor summary row
+ * references anymore, for the new strings.  The string of a freed id is
+ * emptied, so that it is not reloaded with the dump.  Readers copy the
+ * strings of an entry and then check it was not overwritten meanwhile, so
+ * they never return the new string of an id (see ash_row_copy_strings()).
+ */
+static void
+ash_dict_reclaim(void)
+{
+	bool *used;
+	HASH_SEQ_STATUS status;
+	ashDictEntry *entry;
+	int i;
+
+	if (ash_dict_free_ids == NULL)
+		ash_dict_free_ids = (uint16 *)
+			MemoryContextAlloc(TopMemoryContext,
+							   sizeof(uint16) * ash_dict_max_entries);
+	used = (bool *) palloc0(sizeof(bool) * ash_dict_max_entries);
+
+#define ASH_DICT_USE(id) \
+	do { \
+		if ((id) < ash_dict_max_entries) \
+			used[(id)] = true; \
+	} while (0)
+
+	for (i = 0; i < ash_max_entries; i++)
+	{
+		ashEntry *ash = &AshEntryArray[i];
+
+		if (ash->seq == 0)
+			continue;
+		ASH_DICT_USE(ash->usename_id);
+		ASH_DICT_USE(ash->datname_id);
+		ASH_DICT_USE(ash->application_name_id);
+		ASH_DICT_USE(ash->state_id);
+		ASH_DICT_USE(ash->blocker_state_id);
+		ASH_DICT_USE(ash->client_hostname_id);
+		ASH_DICT_USE(ash->cmdtype_id);
+		ASH_DICT_USE(ash->backend_type_id);
+		ASH_DICT_USE(ash->client_addr_id);
+	}
+	for (i = 0; AshSummaryArray && i < ash_summary_max_entries; i++)
+	{
+		if (AshSummaryArray[i].seq != 0)
+			ASH_DICT_USE(AshSummaryArray[i].key.backend_type_id);
+	}
+#undef ASH_DICT_USE
+
+	/* the ids left out of the hash are free too, the previous ones */
+	hash_seq_init(&status, AshDictHash);
+	while ((entry = (ashDictEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (used[entry->id])
+			continue;
+		AshDictBuffer[(Size) entry->id * NAMEDATALEN] = '\0';
+		hash_search(AshDictHash, entry->str, HASH_REMOVE, NULL);
+	}
+	hash_seq_init(&status, AshDictHash);
+	while ((entry = (ashDictEntry *) hash_seq_search(&status)) != NULL)
+		used[entry->id] = true;
+
+	ash_dict_nfree = 0;
+	for (i = IntEntryArray[0].dictentries - 1; i > 0; i--)
+	{
+		if (!used[i])
+			ash_dict_free_ids[ash_dict_nfree++] = (uint16) i;
+	}
+	pfree(used);
+
+	ash_dict_reclaimed_seq = IntEntryArray[0].ash_written;
+}
+
+/*
+ * Once the dictionary is full, look for the ids to reuse before a sample,
+ * at most once every eighth of the ring: the entries of the sample never
+ * pay for the scan of the ring, and the ids they are given are not freed
+ * before they are stored.
+ */
+static void
+ash_dict_maybe_reclaim(void)
+{
+	if (IntEntryArray[0].dictentries < ash_dict_max_entries)
+		return;
+	if (ash_dict_free_ids != NULL &&
+		IntEntryArray[0].ash_written - ash_dict_reclaimed_seq <
+		(uint64) Max(ash_max_entries / 8, 1))
+		return;
+	ash_dict_reclaim();
+}
+
+/*
+ * Return the id of a string in the shared dictionary, adding it if needed.
+ *
+ * A string never moves while it has an id, so backends can read it without
+ * any lock.  Only the worker adds strings.  Once the dictionary is full, the
+ * ids found by ash_dict_maybe_reclaim() are reused.  The empty string is
+ * id 0, which is also used when there is no room left.
+ */
+static uint16
+ash_dict_intern(const char *str)
+{
+	ashDictEntry *entry;
+	bool found;
+	int id;
+
+	if (str[0] == '\0')
+		return 0;
+
+	entry = (ashDictEntry *) hash_search(AshDictHash, str, HASH_FIND, NULL);
+	if (entry)
+		return entry->id;
+
+	id = IntEntryArray[0].dictentries;
+	if (id >= ash_dict_max_entries && ash_dict_nfree == 0)
+	{
+		if (!IntEntryArray[0].dictfull)
+			ereport(WARNING,
+					(errmsg("pgsentinel string dictionary is full"),
+					 errhint("Consider increasing pgsentinel_ash.max_dictionary_entries, new strings are recorded as NULL.")));
+		IntEntryArray[0].dictfull = true;
+		return 0;
+	}
+
+	entry = (ashDictEntry *) hash_search(AshDictHash, str, HASH_ENTER_NULL,
+										 &found);
+	if (!entry)
+		return 0;
+
+	if (id >= ash_dict_max_entries)
+	{
+		id = ash_dict_free_ids[--ash_dict_nfree];
+		/* after the entries that referenced it, see ash_dict_reclaim() */
+		pg_write_barrier();
+	}
+
+	/* Publish the string before anything can reference its id */
+	strlcpy(AshDictBuffer + (Size) id * NAMEDATALEN, str, NAMEDATALEN);
+	pg_write_barrier();
+	entry->id = id;
+	if (id >= IntEntryArray[0].dictentries)
+		IntEntryArray[0].dictentries = id + 1;
+
+	return id;
+}
+
+/* String of a dictionary id, NULL for the empty string */
+static const char *
+ash_dict_string(uint16 id)
+{
+	if (id == 0 || id >= ash_dict_max_entries)
+		return NULL;
+	return AshDictBuffer + (Size) id * NAMEDATALEN;
+}
+
+/* hash of a query text, for the texts without a queryid */
+static uint64
+ash_qtext_hash(const char *str, int len)
+{
+#if PG_VERSION_NUM >= 110000
+	return DatumGetUInt64(hash_any_extended((const unsigned char *) str,
+																	len, 0));
+#else
+	return DatumGetUInt32(hash_any((const unsigned char *) str, len));
+#endif
+}
+
+/* Pick the query text slot to (re)use, clock sweep over the slots */
+static int
+ash_qtext_victim(void)
+{
+	for (;;)
+	{
+		int slot = IntEntryArray[0].qtexthand;
+		ashQueryTextSlot *entry = &AshQueryTextSlots[slot];
+
+		IntEntryArray[0].qtexthand = (slot + 1) % ash_max_query_texts;
+
+		if (entry->key.kind == ASH_QTEXT_NONE)
+			return slot;
+		if (entry->usage == 0)
+			return slot;
+		entry->usage--;
+	}
+}
+
+/*
+ * Make ref point to the stored copy of text, storing it if needed.
+ *
+ * Texts are stored once per key: the queryid when there is one, otherwise
+ * the hash of the text.  Only the worker calls this, so the hash needs no
+ * lock; readers only look at the slots.
+ */
+static void
+ash_qtext_store(ashQueryTextRef *ref, uint32 kind, uint64 id,
+				const char *text)
+{
+	ashQueryTextKey key;
+	ashQueryTextEntry *entry;
+	volatile ashQueryTextSlot *slot;
+	bool found;
+	int len;
+	int victim;
+
+	len = Min((int) strlen(text), pgstat_track_activity_query_size - 1);
+	if (len == 0)
+	{
+		MemSet(ref, 0, sizeof(ashQueryTextRef));
+		ref->slot = -1;
+		return;
+	}
+
+	MemSet(&key, 0, sizeof(ashQueryTextKey));
+	key.kind = kind;
+	key.id = (kind == ASH_QTEXT_TEXTHASH) ? ash_qtext_hash(text, len) : id;
+
+	ref->key = key;
+
+	entry = (ashQueryTextEntry *) hash_search(AshQueryTextHash, &key,
+											  HASH_FIND, NULL);
+	if (entry)
+	{
+		slot = &AshQueryTextSlots[entry->slot];
+		if (slot->usage < ASH_QTEXT_MAX_USAGE)
+			slot->usage++;
+		ref->slot = entry->slot;
+		return;
+	}
+
+	victim = ash_qtext_victim();
+	slot = &AshQueryTextSlots[victim];
+
+	if (slot->key.kind != ASH_QTEXT_NONE)
+	{
+		hash_search(AshQueryTextHash, (const void *) &slot->key, HASH_REMOVE,
+					NULL);
+		IntEntryArray[0].qtextentries--;
+		IntEntryArray[0].qtextevictions++;
+	}
+
+	entry = (ashQueryTextEntry *) hash_search(AshQueryTextHash, &key,
+											  HASH_ENTER_NULL, &found);
+	if (!entry)
+	{
+		slot->key.kind = ASH_QTEXT_NONE;
+		ref->slot = -1;
+		return;
+	}
+	entry->slot = victim;
+	IntEntryArray[0].qtextentries++;
+
+	slot->changecount++;
+	pg_write_barrier();
+	slot->key = key;
+	slot->usage = 1;
+	memcpy(AshQueryTextBuffer + (Size) victim * pgstat_track_activity_query_size,
+		   text, len);
+	AshQueryTextBuffer[(Size) victim * pgstat_track_activity_query_size + len] = '\0';
+	pg_write_barrier();
+	slot->changecount++;
+
+	ref->slot = victim;
+}
+
+/*
+ * Copy the text ref points to into buf (pgstat_track_activity_query_size
+ * bytes).  Returns false if there is no text or it has been evicted.
+ */
+static bool
+ash_qtext_fetch(const ashQueryTextRef *ref, char *buf)
+{
+	volatile ashQueryTextSlot *slot;
+	bool match;
+
+	if (ref->slot < 0 || ref->slot >= ash_max_query_texts)
+		return false;
+
+	slot = &AshQueryTextSlots[ref->slot];
+
+	for (;;)
+	{
+		uint32 before_changecount;
+		uint32 after_changecount;
+
+		before_changecount = slot->changecount;
+		pg_read_barrier();
+
+		match = slot->key.kind == ref->key.kind && slot->key.id == ref->key.id;
+		if (match)
+			strlcpy(buf, AshQueryTextBuffer +
+					(Size) ref->slot * pgstat_track_activity_query_size,
+					pgstat_track_activity_query_size);
+
+		pg_read_barrier();
+		after_changecount = slot->changecount;
+
+		if (before_changecount == after_changecount &&
+			(before_changecount & 1) == 0)
+			break;
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	return match;
+}
+
+/*
+ * Sample being taken, private to the worker: the weight of its entries (the
+ * seconds of session activity each one stands for), the part of the active
+ * sessions it keeps (see ash_sample_end()), and the load it saw, which
+ * drives the adaptive sampling rate.
+ */
+#define ASH_SAMPLE_MAX_WAITS		64
+#define ASH_SAMPLE_MIN_FRACTION		0.01
+
+static double ash_sample_weight = 1.0;
+static double ash_sample_fraction = 1.0;
+static double ash_sample_accum = 0.0;
+static int ash_sample_nactive = 0;
+static int ash_sample_nwaits = 0;	/* distinct wait events, up to the max */
+static uint32 ash_sample_waits[ASH_SAMPLE_MAX_WAITS];
+static instr_time ash_sample_store_time;	/* in ash_prepare_store() */
+
+/*
+ * Count an active session in the load of the sample, and tell whether it is
+ * sampled.  When only a fraction f of them are, one every 1/f sessions is
+ * kept, from an offset that changes with each sample so that the same
+ * sessions are not always skipped.
+ */
+static bool
+ash_sample_keep(uint32 wait_event_info)
+{
+	int i;
+
+	ash_sample_nactive++;
+	for (i = 0; i < ash_sample_nwaits; i++)
+	{
+		if (ash_sample_waits[i] == wait_event_info)
+			break;
+	}
+	if (i == ash_sample_nwaits && i < ASH_SAMPLE_MAX_WAITS)
+		ash_sample_waits[ash_sample_nwaits++] = wait_event_info;
+
+	if (ash_sample_fraction >= 1.0)
+		return true;
+	ash_sample_accum += ash_sample_fraction;
+	if (ash_sample_accum < 1.0)
+		return false;
+	ash_sample_accum -= 1.0;
+	return true;
+}
+
+/*
+ * queryids of the current sample, kept by the worker for the pgssh query so
+ * that it does not have to read them back from the history
+ */
+static uint64 *ash_sample_queryids = NULL;
+static int ash_sample_nqueryids = 0;
+static int ash_sample_maxqueryids = 0;
+
+static void
+ash_sample_add_queryid(uint64 queryid)
+{
+	if (queryid == 0)
+		return;
+
+	if (ash_sample_nqueryids >= ash_sample_maxqueryids)
+	{
+		ash_sample_maxqueryids = Max(ash_sample_maxqueryids * 2, 64);
+		if (ash_sample_queryids == NULL)
+			ash_sample_queryids = (uint64 *)
+				MemoryContextAlloc(TopMemoryContext,
+								   sizeof(uint64) * ash_sample_maxqueryids);
+		else
+			ash_sample_queryids = (uint64 *)
+				repalloc(ash_sample_queryids,
+						 sizeof(uint64) * ash_sample_maxqueryids);
+	}
+	ash_sample_queryids[ash_sample_nqueryids++] = queryid;
+}
+
+static int
+ash_queryid_cmp(const void *a, const void *b)
+{
+	uint64 qa = *(const uint64 *) a;
+	uint64 qb = *(const uint64 *) b;
+
+	if (qa < qb)
+		return -1;
+	if (qa > qb)
+		return 1;
+	return 0;
+}
+
+/*
+ * The pg_stat_statements query for the queryids of the sample, NULL if
+ * there are none.
+ */
+static char *
+ash_pgssh_build_query(void)
+{
+	StringInfoData buf;
+	int i;
+
+	if (ash_sample_nqueryids == 0)
+		return NULL;
+
+	qsort(ash_sample_queryids, ash_sample_nqueryids, sizeof(uint64),
+		  ash_queryid_cmp);
+
+	initStringInfo(&buf);
+	appendStringInfoString(&buf, pg_stat_statements_query);
+	for (i = 0; i < ash_sample_nqueryids; i++)
+	{
+		if (i > 0 && ash_sample_queryids[i] == ash_sample_queryids[i - 1])
+			continue;
+		appendStringInfo(&buf, i == 0 ? "(" INT64_FORMAT : ", " INT64_FORMAT,
+						 (int64) ash_sample_queryids[i]);
+	}
+	appendStringInfoChar(&buf, ')');
+
+	return buf.data;
+}
+
+/* Key of the pgssh entries of a query */
+typedef struct pgsshKey
+{
+	Oid userid;
+	Oid dbid;
+	uint64 queryid;
+} pgsshKey;
+
+/* Last counters stored for a query, private to the worker */
+typedef struct pgsshLastEntry
+{
+	pgsshKey key;				/* hash key, must be first */
+	uint64 seq;					/* of the last entry stored */
+	uint64 anchor_seq;			/* of the last baseline or checkpoint */
+	pgsshCounters counters;		/* cumulative */
+} pgsshLastEntry;
+
+static HTAB *PgsshLastHash = NULL;
+
+static void
+pgssh_last_init(void)
+{
+	HASHCTL info;
+
+	if (PgsshLastHash != NULL)
+		return;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(pgsshKey);
+	info.entrysize = sizeof(pgsshLastEntry);
+	PgsshLastHash = hash_create("pgsentinel pgssh last counters",
+								pgssh_max_entries, &info,
+								HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * delta = cur - prev.  Returns false if a counter went backwards, which
+ * means the pg_stat_statements entry was reset or evicted meanwhile.
+ */
+static bool
+pgssh_counters_sub(pgsshCounters *delta, const pgsshCounters *cur,
+				   const pgsshCounters *prev)
+{
+#define PGSSH_SUB(field) \
+	do { \
+		if (cur->field < prev->field) \
+			return false; \
+		delta->field = cur->field - prev->field; \
+	} while (0)
+
+	PGSSH_SUB(calls);
+	PGSSH_SUB(total_time);
+	PGSSH_SUB(rows);
+	PGSSH_SUB(shared_blks_hit);
+	PGSSH_SUB(shared_blks_read);
+	PGSSH_SUB(shared_blks_dirtied);
+	PGSSH_SUB(shared_blks_written);
+	PGSSH_SUB(local_blks_hit);
+	PGSSH_SUB(local_blks_read);
+	PGSSH_SUB(local_blks_dirtied);
+	PGSSH_SUB(local_blks_written);
+	PGSSH_SUB(temp_blks_read);
+	PGSSH_SUB(temp_blks_written);
+	PGSSH_SUB(blk_read_time);
+	PGSSH_SUB(blk_write_time);
+#if PG_VERSION_NUM >= 130000
+	PGSSH_SUB(plans);
+	PGSSH_SUB(total_plan_time);
+	PGSSH_SUB(wal_records);
+	PGSSH_SUB(wal_fpi);
+	PGSSH_SUB(wal_bytes);
+#endif
+#undef PGSSH_SUB
+
+	return true;
+}
+
+/* sum += delta */
+static void
+pgssh_counters_add(pgsshCounters *sum, const pgsshCounters *delta)
+{
+	sum->calls += delta->calls;
+	sum->total_time += delta->total_time;
+	sum->rows += delta->rows;
+	sum->shared_blks_hit += delta->shared_blks_hit;
+	sum->shared_blks_read += delta->shared_blks_read;
+	sum->shared_blks_dirtied += delta->shared_blks_dirtied;
+	sum->shared_blks_written += delta->shared_blks_written;
+	sum->local_blks_hit += delta->local_blks_hit;
+	sum->local_blks_read += delta->local_blks_read;
+	sum->local_blks_dirtied += delta->local_blks_dirtied;
+	sum->local_blks_written += delta->local_blks_written;
+	sum->temp_blks_read += delta->temp_blks_read;
+	sum->temp_blks_written += delta->temp_blks_written;
+	sum->blk_read_time += delta->blk_read_time;
+	sum->blk_write_time += delta->blk_write_time;
+#if PG_VERSION_NUM >= 130000
+	sum->plans += delta->plans;
+	sum->total_plan_time += delta->total_plan_time;
+	sum->wal_records += delta->wal_records;
+	sum->wal_fpi += delta->wal_fpi;
+	sum->wal_bytes += delta->wal_bytes;
+#endif
+}
+
+/* Write a new pgssh entry, numbered already */
+static void
+pgssh_append(pgsshEntry *entry)
+{
+	if (PgsshBlocks)
+		pgssh_block_append(entry);
+	else
+	{
+		pgsshEntry *slot = &PgsshEntryArray[(entry->seq - 1) % pgssh_max_entries];
+
+		ASH_BEGIN_WRITE(slot);
+		entry->changecount = slot->changecount;
+		*slot = *entry;
+		ASH_END_WRITE(slot);
+	}
+}
+
+/*
+ * Oldest pgssh entry still in memory, from the worker's point of view: the
+ * first one of the oldest block, for the compressed history.
+ */
+static uint64
+pgssh_oldest_seq(void)
+{
+	uint64 written = IntEntryArray[0].pgssh_written;
+
+	if (PgsshBlocks)
+	{
+		uint64 last = IntEntryArray[0].pgssh_blocks_written;
+		uint64 no = pgssh_first_block(last);
+		pgsshBlock *block;
+
+		if (last == 0)
+			return 1;
+		block = &PgsshBlocks[(no - 1) % pgssh_nblocks()];
+		return block->no == no ? block->first_seq : written + 1;
+	}
+	return written > (uint64) pgssh_max_entries ?
+		written - pgssh_max_entries + 1 : 1;
+}
+
+/* Store a checkpoint of a query, with its last cumulative counters */
+static void
+pgssh_store_checkpoint(pgsshLastEntry *last, TimestampTz ash_time)
+{
+	pgsshEntry entry;
+	uint64 seq;
+
+	seq = IntEntryArray[0].pgssh_written + 1;
+	IntEntryArray[0].pgssh_written = seq;
+	memset(&entry, 0, sizeof(pgsshEntry));
+	entry.seq = seq;
+	entry.checkpoint = true;
+	entry.ash_time = ash_time;
+	entry.userid = last->key.userid;
+	entry.dbid = last->key.dbid;
+	entry.queryid = last->key.queryid;
+	entry.counters = last->counters;
+	pgssh_append(&entry);
+
+	last->anchor_seq = seq;
+}
+
+/*
+ * Store the counters of a query read from pg_stat_statements, as the
+ * difference with the ones stored last time, or nothing if they did not
+ * change.  See pgsshEntry.
+ */
+static void
+pgssh_store(TimestampTz ash_time, Oid userid, Oid dbid, uint64 queryid,
+			const pgsshCounters *counters)
+{
+	pgsshKey key;
+	pgsshLastEntry *last;
+	pgsshEntry entry;
+	uint64 seq;
+	bool found;
+
+	pgssh_last_init();
+
+	memset(&key, 0, sizeof(key));
+	key.userid = userid;
+	key.dbid = dbid;
+	key.queryid = queryid;
+	last = (pgsshLastEntry *) hash_search(PgsshLastHash, &key, HASH_ENTER,
+										  &found);
+
+	if (found && memcmp(&last->counters, counters, sizeof(pgsshCounters)) == 0)
+		return;
+
+	memset(&entry, 0, sizeof(pgsshEntry));
+	entry.baseline = !found ||
+		!pgssh_counters_sub(&entry.counters, counters, &last->counters);
+	if (entry.baseline)
+	{
+		/* the deltas before the reset are rebuilt back from a checkpoint */
+		if (found && last->seq > last->anchor_seq)
+			pgssh_store_checkpoint(last, ash_time);
+		entry.counters = *counters;
+	}
+
+	seq = IntEntryArray[0].pgssh_written + 1;
+	IntEntryArray[0].pgssh_written = seq;
+	entry.seq = seq;
+	entry.ash_time = ash_time;
+	entry.userid = userid;
+	entry.dbid = dbid;
+	entry.queryid = queryid;
+	pgssh_append(&entry);
+
+	last->seq = seq;
+	if (entry.baseline)
+		last->anchor_seq = seq;
+	last->counters = *counters;
+}
+
+/*
+ * Store a checkpoint of the queries having deltas in the ring after a
+ * baseline or checkpoint that reached the older half of the ring, before it
+ * leaves it.
+ */
+static void
+pgssh_checkpoint_queries(TimestampTz ash_time)
+{
+	HASH_SEQ_STATUS status;
+	pgsshLastEntry *last;
+	uint64 oldest;
+	uint64 middle;
+
+	if (PgsshLastHash == NULL)
+		return;
+
+	oldest = pgssh_oldest_seq();
+	middle = oldest + (IntEntryArray[0].pgssh_written + 1 - oldest) / 2;
+
+	hash_seq_init(&status, PgsshLastHash);
+	while ((last = (pgsshLastEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (last->seq > last->anchor_seq && last->seq >= oldest &&
+			last->anchor_seq < middle)
+			pgssh_store_checkpoint(last, ash_time);
+	}
+}
+
+/*
+ * Forget the last counters of the queries whose entries all left the ring,
+ * once there are many of them.
+ */
+static void
+pgssh_forget_queries(void)
+{
+	HASH_SEQ_STATUS status;
+	pgsshLastEntry *last;
+
+	if (PgsshLastHash == NULL ||
+		hash_get_num_entries(PgsshLastHash) <= 2 * (long) pgssh_max_entries)
+		return;
+
+	hash_seq_init(&status, PgsshLastHash);
+	while ((last = (pgsshLastEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (last->seq + pgssh_max_entries <= IntEntryArray[0].pgssh_written)
+			hash_search(PgsshLastHash, &last->key, HASH_REMOVE, NULL);
+	}
+}
+
+static void
+ash_entry_store(TimestampTz ash_time, const int pid,
+#if PG_VERSION_NUM >= 130000
+				int leader_pid,
+#endif
+				const char *usename,
+				const int client_port, Oid datid, const char *datname,
+				const char *application_name, const char *client_addr,
+				TransactionId backend_xmin, TimestampTz backend_start,
+				TimestampTz xact_start, TimestampTz query_start,
+				TimestampTz state_change, uint32 wait_event_info,
+				const char *state,
+				const char *client_hostname, const char *query,
+				const char *backend_type, Oid usesysid,
+				TransactionId backend_xid, int blockers, int blockerpid,
+				int root_blockerpid, int blocker_depth,
+				const char *blocker_state, uint64 queryid,
+				const char *gpi_query, const char *cmdtype)
+{
+	uint64 seq = IntEntryArray[0].ash_written;
+	int inserted;
+	uint16 usename_id;
+	uint16 datname_id;
+	uint16 application_name_id;
+	uint16 state_id;
+	uint16 blocker_state_id;
+	uint16 client_hostname_id;
+	uint16 backend_type_id;
+	uint16 client_addr_id;
+	uint16 cmdtype_id;
+	ashQueryTextRef top_level_query_ref;
+	ashQueryTextRef query_ref;
+
+	/*
+	 * Intern the strings and store the texts first: readers of the slot
+	 * retry while it is being written, so only copy values in there.
+	 */
+	usename_id=ash_dict_intern(usename);
+	datname_id=ash_dict_intern(datname);
+	application_name_id=ash_dict_intern(application_name);
+	state_id=ash_dict_intern(state);
+	blocker_state_id=ash_dict_intern(blocker_state);
+	client_hostname_id=ash_dict_intern(client_hostname);
+	backend_type_id=ash_dict_intern(backend_type);
+	client_addr_id=ash_dict_intern(client_addr);
+	cmdtype_id=ash_dict_intern(cmdtype);
+	ash_qtext_store(&top_level_query_ref, ASH_QTEXT_TEXTHASH, 0, query);
+	ash_qtext_store(&query_ref,
+					queryid ? ASH_QTEXT_QUERYID : ASH_QTEXT_TEXTHASH,
+					queryid, gpi_query);
+
+	inserted=(int) ((seq - 1) % ash_max_entries);
+	ASH_BEGIN_WRITE(&AshEntryArray[inserted]);
+	AshEntryArray[inserted].seq=seq;
+	AshEntryArray[inserted].usename_id=usename_id;
+	AshEntryArray[inserted].datname_id=datname_id;
+	AshEntryArray[inserted].application_name_id=application_name_id;
+	AshEntryArray[inserted].wait_event_info=wait_event_info;
+	AshEntryArray[inserted].state_id=state_id;
+	AshEntryArray[inserted].blocker_state_id=blocker_state_id;
+	AshEntryArray[inserted].client_hostname_id=client_hostname_id;
+	AshEntryArray[inserted].top_level_query=top_level_query_ref;
+	AshEntryArray[inserted].backend_type_id=backend_type_id;
+	AshEntryArray[inserted].client_addr_id=client_addr_id;
+	AshEntryArray[inserted].query=query_ref;
+	AshEntryArray[inserted].cmdtype_id=cmdtype_id;
+	AshEntryArray[inserted].client_port=client_port;
+	AshEntryArray[inserted].datid=datid;
+	AshEntryArray[inserted].usesysid=usesysid;
+	AshEntryArray[inserted].pid=pid;
+#if PG_VERSION_NUM >= 130000
+	AshEntryArray[inserted].leader_pid=leader_pid;
+#endif
+	AshEntryArray[inserted].backend_xmin=backend_xmin;
+	AshEntryArray[inserted].backend_xid=backend_xid;
+	AshEntryArray[inserted].backend_start=backend_start;
+	AshEntryArray[inserted].xact_start=xact_start;
+	AshEntryArray[inserted].query_start=query_start;
+	AshEntryArray[inserted].state_change=state_change;
+	AshEntryArray[inserted].ash_time=ash_time;
+	AshEntryArray[inserted].blockers=blockers;
+	AshEntryArray[inserted].blockerpid=blockerpid;
+	AshEntryArray[inserted].root_blockerpid=root_blockerpid;
+	AshEntryArray[inserted].blocker_depth=blocker_depth;
+	AshEntryArray[inserted].queryid=queryid;
+	AshEntryArray[inserted].sample_weight=ash_sample_weight;
+	ASH_END_WRITE(&AshEntryArray[inserted]);
+
+	ash_summary_add(&AshEntryArray[inserted]);
+}
+
+static void
+ash_prepare_store(TimestampTz ash_time, const int pid,
+#if PG_VERSION_NUM >= 130000
+					int leader_pid,
+#endif
+					const char* usename,
+					const int client_port, Oid datid, const char *datname,
+					const char *application_name, const char *client_addr,
+					TransactionId backend_xmin, TimestampTz backend_start,
+					TimestampTz xact_start, TimestampTz query_start,
+					TimestampTz state_change, uint32 wait_event_info,
+					const char *state,
+					const char *client_hostname, const char *query,
+					const char *backend_type, Oid usesysid,
+					TransactionId backend_xid, int blockers, int blockerpid,
+					int root_blockerpid, int blocker_depth,
+					const char *blocker_state, uint64 queryid,
+					const char *gpi_query, const char *cmdtype)
+{
+	instr_time start;
+	instr_time end;
+
+	/* Safety check... */
+	if (!AshEntryArray) { return; }
+
+	INSTR_TIME_SET_CURRENT(start);
+	IntEntryArray[0].ash_written++;
+	ash_sample_add_queryid(queryid);
+	ash_entry_store(ash_time, pid,
+#if PG_VERSION_NUM >= 130000
+					leader_pid,
+#endif
+					usename, client_port, datid, datname,
+					application_name, client_addr,backend_xmin, backend_start,
+					xact_start, query_start, state_change, wait_event_info,
+					state, client_hostname, query, backend_type,
+					usesysid, backend_xid, blockers, blockerpid,
+					root_blockerpid, blocker_depth, blocker_state,
+					queryid, gpi_query, cmdtype);
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_ACCUM_DIFF(ash_sample_store_time, end, start);
+}
+
+/* Fetch the i-th (1-based) entry of the local backend status snapshot */
+static LocalPgBackendStatus *
+ash_fetch_local_beentry(int i)
+{
+#if PG_VERSION_NUM >= 170000
+	return pgstat_get_local_beentry_by_index(i);
+#else
+	return pgstat_fetch_stat_local_beentry(i);
+#endif
+}
+
+/* pid to PGPROC index, sorted by pid for the sampler lookups */
+typedef struct ashProcMapEntry
+{
+	int pid;
+	int procno;
+	int beindex;		/* in the local backend status snapshot, 0 if none */
+	uint32 wait_event_info;	/* when the map was built */
+} ashProcMapEntry;
+
+static int
+ash_procmap_cmp(const void *a, const void *b)
+{
+	int pa = ((const ashProcMapEntry *) a)->pid;
+	int pb = ((const ashProcMapEntry *) b)->pid;
+
+	if (pa < pb)
+		return -1;
+	if (pa > pb)
+		return 1;
+	return 0;
+}
+
+static ashProcMapEntry *
+ash_procmap_find(ashProcMapEntry *map, int nentries, int pid)
+{
+	ashProcMapEntry key;
+
+	key.pid = pid;
+	return (ashProcMapEntry *) bsearch(&key, map, nentries,
+									   sizeof(ashProcMapEntry),
+									   ash_procmap_cmp);
+}
+
+/*
+ * Build a pid sorted copy of the live PGPROC entries, so that each sampled
+ * backend can be matched to its PGPROC (and ProcEntryArray slot) with a
+ * binary search instead of a walk of the whole proc array.  Each entry also
+ * records where the first num_backends entries of the local backend status
+ * snapshot have the process, for the state of the blockers.
+ */
+static ashProcMapEntry *
+ash_build_procmap(int num_backends, int *nentries)
+{
+	ashProcMapEntry *map;
+	ashProcMapEntry *entry;
+	uint32 i;
+	int n = 0;
+	int b;
+
+	map = (ashProcMapEntry *) palloc(sizeof(ashProcMapEntry) *
+											ProcGlobal->allProcCount);
+	for (i = 0; i < ProcGlobal->allProcCount; i++)
+	{
+		int pid = ProcGlobal->allProcs[i].pid;
+
+		if (pid == 0)
+			continue;
+		map[n].pid = pid;
+		map[n].procno = i;
+		map[n].beindex = 0;
+		map[n].wait_event_info =
+			*((volatile uint32 *) &ProcGlobal->allProcs[i].wait_event_info);
+		n++;
+	}
+	qsort(map, n, sizeof(ashProcMapEntry), ash_procmap_cmp);
+
+	for (b = 1; b <= num_backends; b++)
+	{
+		LocalPgBackendStatus *local_beentry = ash_fetch_local_beentry(b);
+
+		if (!local_beentry)
+			continue;
+		entry = ash_procmap_find(map, n, local_beentry->backendStatus.st_procpid);
+		if (entry)
+			entry->beindex = b;
+	}
+
+	*nentries = n;
+	return map;
+}
+
+static int
+ash_procmap_lookup(ashProcMapEntry *map, int nentries, int pid)
+{
+	ashProcMapEntry *found = ash_procmap_find(map, nentries, pid);
+
+	return found ? found->procno : -1;
+}
+
+/* Same strings as pg_stat_activity.state */
+static const char *
+ash_backend_state_name(BackendState state)
+{
+	switch (state)
+	{
+		case STATE_IDLE:
+			return "idle";
+		case STATE_RUNNING:
+			return "active";
+		case STATE_IDLEINTRANSACTION:
+			return "idle in transaction";
+		case STATE_FASTPATH:
+			return "fastpath function call";
+		case STATE_IDLEINTRANSACTION_ABORTED:
+			return "idle in transaction (aborted)";
+		case STATE_DISABLED:
+			return "disabled";
+#if PG_VERSION_NUM >= 170000
+		case STATE_STARTING:
+			return "starting";
+#endif
+		default:
+			return "";
+	}
+}
+
+/* pg_stat_activity.state of the backend having this pid, if any */
+static const char *
+ash_procmap_state(ashProcMapEntry *map, int nentries, int pid)
+{
+	ashProcMapEntry *found = ash_procmap_find(map, nentries, pid);
+	LocalPgBackendStatus *local_beentry;
+
+	if (!found || found->beindex == 0)
+		return "";
+	local_beentry = ash_fetch_local_beentry(found->beindex);
+	if (!local_beentry)
+		return "";
+	return ash_backend_state_name(local_beentry->backendStatus.st_state);
+}
+
+/*
+ * Client address and port, formatted as text(pg_stat_activity.client_addr)
+ * and pg_stat_activity.client_port would be.
+ */
+static void
+ash_client_addr(PgBackendStatus *beentry, char *client_addr, Size len,
+				int *client_port)
+{
+	SockAddr zero_clientaddr;
+
+	client_addr[0] = '\0';
+	*client_port = 0;
+
+	/* A zeroed client addr means we don't know */
+	memset(&zero_clientaddr, 0, sizeof(zero_clientaddr));
+	if (memcmp(&(beentry->st_clientaddr), &zero_clientaddr,
+			   sizeof(zero_clientaddr)) == 0)
+		return;
+
+	if (beentry->st_clientaddr.addr.ss_family == AF_INET
+#ifdef AF_INET6
+		|| beentry->st_clientaddr.addr.ss_family == AF_INET6
+#endif
+		)
+	{
+		char remote_host[NI_MAXHOST];
+		char remote_port[NI_MAXSERV];
+
+		remote_host[0] = '\0';
+		remote_port[0] = '\0';
+		if (pg_getnameinfo_all(&beentry->st_clientaddr.addr,
+							   beentry->st_clientaddr.salen,
+							   remote_host, sizeof(remote_host),
+							   remote_port, sizeof(remote_port),
+							   NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+		{
+			snprintf(client_addr, len, "%s/%d", remote_host,
+					 beentry->st_clientaddr.addr.ss_family == AF_INET ? 32 : 128);
+			*client_port = atoi(remote_port);
+		}
+	}
+	else if (beentry->st_clientaddr.addr.ss_family == AF_UNIX)
+		*client_port = -1;
+}
+
+/*
+ * Lock wait graph of a sample
+ *
+ * pg_blocking_pids() takes all the lock manager partition locks at each call,
+ * so rather than calling it for every waiting session, the lock manager is
+ * copied once per sample with GetLockStatusData() and the blockers of all the
+ * waiters are worked out from that copy the way pg_blocking_pids() does: the
+ * holders of a conflicting mode block hard, the waiters queued ahead for a
+ * conflicting mode block soft.  Blockers are reported by the pid of their
+ * lock group leader, and a leader is blocked by what blocks its workers.
+ */
+typedef struct ashLockWait
+{
+	int pid;					/* hash key, must be first */
+	int blockers;
+	int hard_blockerpid;		/* first holder of a conflicting mode */
+	int soft_blockerpid;		/* first conflicting waiter queued ahead */
+	int blockerpid;
+	int root_blockerpid;
+	int blocker_depth;
+} ashLockWait;
+
+typedef struct ashLockGraph
+{
+	bool built;					/* built on the first lookup of the sample */
+	HTAB *waits;				/* ashLockWait by pid, NULL if none */
+} ashLockGraph;
+
+static int
+ash_lock_instance_cmp(const void *a, const void *b)
+{
+	return memcmp(&((const LockInstanceData *) a)->locktag,
+				  &((const LockInstanceData *) b)->locktag, sizeof(LOCKTAG));
+}
+
+static void
+ash_lock_graph_add(ashLockGraph *graph, int pid, int blockerpid, bool hard)
+{
+	ashLockWait *wait;
+	bool found;
+
+	if (graph->waits == NULL)
+	{
+		HASHCTL info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(int);
+		info.entrysize = sizeof(ashLockWait);
+		info.hcxt = CurrentMemoryContext;
+		graph->waits = hash_create("pgsentinel lock waits", 64, &info,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	wait = (ashLockWait *) hash_search(graph->waits, &pid, HASH_ENTER, &found);
+	if (!found)
+		memset((char *) wait + sizeof(int), 0,
+			   sizeof(ashLockWait) - sizeof(int));
+
+	wait->blockers++;
+	if (hard && wait->hard_blockerpid == 0)
+		wait->hard_blockerpid = blockerpid;
+	if (!hard && wait->soft_blockerpid == 0)
+		wait->soft_blockerpid = blockerpid;
+}
+
+static void
+ash_lock_graph_build(ashLockGraph *graph)
+{
+	LockData *lockData;
+	LockInstanceData *locks;
+	HASH_SEQ_STATUS status;
+	ashLockWait *wait;
+	long nwaits;
+	int start;
+	int end;
+
+	graph->built = true;
+	graph->waits = NULL;
+
+	/* Group the instances of each lock */
+	lockData = GetLockStatusData();
+	locks = lockData->locks;
+	qsort(locks, lockData->nelements, sizeof(LockInstanceData),
+		  ash_lock_instance_cmp);
+
+	for (start = 0; start < lockData->nelements; start = end)
+	{
+		int i;
+		int j;
+
+		for (end = start + 1; end < lockData->nelements; end++)
+		{
+			if (memcmp(&locks[end].locktag, &locks[start].locktag,
+					   sizeof(LOCKTAG)) != 0)
+				break;
+		}
+
+		for (i = start; i < end; i++)
+		{
+			LockInstanceData *waiter = &locks[i];
+			LOCKMASK conflictMask;
+
+			if (waiter->waitLockMode == NoLock)
+				continue;
+
+			conflictMask = GetLockTagsMethodTable(&waiter->locktag)->
+				conflictTab[waiter->waitLockMode];
+
+			for (j = start; j < end; j++)
+			{
+				LockInstanceData *other = &locks[j];
+				bool hard;
+
+				/* The lock group of the waiter does not block it */
+				if (other->leaderPid == waiter->leaderPid)
+					continue;
+
+				if (conflictMask & other->holdMask)
+					hard = true;
+#if PG_VERSION_NUM >= 140000
+				/* The wait queue order is only known through waitStart */
+				else if (other->waitLockMode != NoLock &&
+						 (conflictMask & LOCKBIT_ON(other->waitLockMode)) &&
+						 other->waitStart != 0 &&
+						 (waiter->waitStart == 0 ||
+						  other->waitStart < waiter->waitStart))
+					hard = false;
+#endif
+				else
+					continue;
+
+				ash_lock_graph_add(graph, waiter->pid, other->leaderPid, hard);
+				if (waiter->leaderPid != waiter->pid)
+					ash_lock_graph_add(graph, waiter->leaderPid,
+									   other->leaderPid, hard);
+			}
+		}
+	}
+
+	if (graph->waits == NULL)
+		return;
+
+	/* As (pg_blocking_pids())[1]: a hard blocker if any */
+	hash_seq_init(&status, graph->waits);
+	while ((wait = (ashLockWait *) hash_seq_search(&status)) != NULL)
+		wait->blockerpid = wait->hard_blockerpid ?
+			wait->hard_blockerpid : wait->soft_blockerpid;
+
+	/*
+	 * Follow the first blockers up to a session that is not blocked.  A
+	 * deadlock not broken yet is a cycle, give up once it has been walked.
+	 */
+	nwaits = hash_get_num_entries(graph->waits);
+	hash_seq_init(&status, graph->waits);
+	while ((wait = (ashLockWait *) hash_seq_search(&status)) != NULL)
+	{
+		ashLockWait *next;
+		int root = wait->blockerpid;
+		int depth = 1;
+
+		while (depth <= nwaits &&
+			   (next = (ashLockWait *) hash_search(graph->waits, &root,
+												   HASH_FIND, NULL)) != NULL)
+		{
+			root = next->blockerpid;
+			depth++;
+		}
+		wait->root_blockerpid = root;
+		wait->blocker_depth = depth;
+	}
+}
+
+/*
+ * Blockers of the session having this pid and PGPROC.  Only the ones waiting
+ * on a heavyweight lock and the lock group leaders (whose parallel workers
+ * may be) can be blocked, so the graph is only built when one of them shows
+ * up in the sample.
+ */
+static void
+ash_lock_graph_lookup(ashLockGraph *graph, PGPROC *proc, int pid,
+					  int *blockers, int *blockerpid, int *root_blockerpid,
+					  int *blocker_depth)
+{
+	ashLockWait *wait = NULL;
+
+	*blockers = 0;
+	*blockerpid = 0;
+	*root_blockerpid = 0;
+	*blocker_depth = 0;
+
+	if (proc == NULL ||
+		((*((volatile uint32 *) &proc->wait_event_info) & 0xFF000000) !=
+		 PG_WAIT_LOCK && proc->lockGroupLeader != proc))
+		return;
+
+	if (!graph->built)
+		ash_lock_graph_build(graph);
+	if (graph->waits != NULL)
+		wait = (ashLockWait *) hash_search(graph->waits, &pid, HASH_FIND,
+										   NULL);
+	if (wait == NULL)
+		return;
+
+	*blockers = wait->blockers;
+	*blockerpid = wait->blockerpid;
+	*root_blockerpid = wait->root_blockerpid;
+	*blocker_depth = wait->blocker_depth;
+}
+
+/*
+ * Sample the active sessions straight from the backend status array and the
+ * PGPROC array: no SPI, no parser and no planner are involved.  This returns
+ * the same data as the pg_stat_activity based query below.
+ */
+static bool
+ash_sample_native(TimestampTz ash_time)
+{
+	int num_backends;
+	int curr_backend;
+	ashProcMapEntry *procmap;
+	int nprocs;
+	ashLockGraph lock_graph;
+	bool gotactives = false;
+	char *lazy_query = palloc(pgstat_track_activity_query_size);
+	char *parsed_query = palloc(pgstat_track_activity_query_size);
+
+	lock_graph.built = false;
+
+	/* Make sure we look at a fresh copy of the backend status array */
+	pgstat_clear_snapshot();
+	num_backends = pgstat_fetch_stat_numbackends();
+	procmap = ash_build_procmap(num_backends, &nprocs);
+
+	for (curr_backend = 1; curr_backend <= num_backends; curr_backend++)
+	{
+		LocalPgBackendStatus *local_beentry;
+		PgBackendStatus *beentry;
+		PGPROC *proc = NULL;
+		int procno;
+		uint32 wait_event_info = 0;
+		const char *backend_type = "";
+		const char *top_level_query;
+		char *usename;
+		char *datname;
+		char client_addr[NI_MAXHOST + 5];
+		int client_port;
+		int blockers;
+		int blockerpid;
+		int root_blockerpid;
+		int blocker_depth;
+		const char *blocker_state = "";
+#if PG_VERSION_NUM >= 130000
+		int leader_pid = 0;
+#endif
+		uint64 queryid = 0;
+		const char *gpi_query = "";
+		const char *cmdtype = "";
+		procEntry parsed;
+		bool lazy = false;
+
+		local_beentry = ash_fetch_local_beentry(curr_backend);
+		if (!local_beentry)
+			continue;
+		beentry = &local_beentry->backendStatus;
+
+		if (beentry->st_procpid == 0 || beentry->st_procpid == MyProcPid)
+			continue;
+		if (beentry->st_state != STATE_RUNNING &&
+			!(ash_track_idle_trans &&
+			  beentry->st_state == STATE_IDLEINTRANSACTION))
+			continue;
+
+		procno = ash_procmap_lookup(procmap, nprocs, beentry->st_procpid);
+		if (procno >= 0)
+		{
+			proc = &ProcGlobal->allProcs[procno];
+			wait_event_info = *((volatile uint32 *) &proc->wait_event_info);
+			getparsedinfo_read_entry(procno, &parsed, parsed_query);
+			lazy = parsed.lazy;
+			gpi_query = parsed.query;
+			cmdtype = parsed.cmdtype < PROC_CMD_NTYPES ?
+				procCmdTypeNames[parsed.cmdtype] : "";
+#if PG_VERSION_NUM < 160000
+			queryid = parsed.queryid;
+#endif
+		}
+#if PG_VERSION_NUM >= 160000
+		queryid = beentry->st_query_id;
+#endif
+
+		if (!ash_sample_keep(wait_event_info))
+			continue;
+
+#if PG_VERSION_NUM >= 130000
+		if (proc)
+		{
+			PGPROC *leader = proc->lockGroupLeader;
+
+			/* Only report the leader of parallel workers, as pg_stat_activity */
+			if (leader && leader->pid != beentry->st_procpid)
+				leader_pid = leader->pid;
+		}
+#endif
+
+#if PG_VERSION_NUM >= 100000
+#if PG_VERSION_NUM >= 130000
+		backend_type = GetBackendTypeDesc(beentry->st_backendType);
+#else
+		backend_type = pgstat_get_backend_desc(beentry->st_backendType);
+#endif
+#if PG_VERSION_NUM >= 110000
+		if (beentry->st_backendType == B_BG_WORKER)
+		{
+			const char *bgw_type;
+
+			bgw_type = GetBackgroundWorkerTypeByPid(beentry->st_procpid);
+			if (bgw_type)
+				backend_type = bgw_type;
+		}
+#endif
+#endif
+
+#if PG_VERSION_NUM >= 110000
+		top_level_query = pgstat_clip_activity(beentry->st_activity_raw);
+#else
+		top_level_query = beentry->st_activity;
+#endif
+
+		/* the statement was only located in the top level query */
+		if (lazy)
+		{
+			gpi_query = getparsedinfo_lazy_query(&parsed, top_level_query,
+												 lazy_query);
+			if (gpi_query == NULL)
+				gpi_query = "";
+		}
+
+		ash_lock_graph_lookup(&lock_graph, proc, beentry->st_procpid,
+							  &blockers, &blockerpid, &root_blockerpid,
+							  &blocker_depth);
+		if (blockerpid != 0)
+			blocker_state = ash_procmap_state(procmap, nprocs, blockerpid);
+
+		usename = GetUserNameFromId(beentry->st_userid, true);
+		datname = OidIsValid(beentry->st_databaseid) ?
+			get_database_name(beentry->st_databaseid) : NULL;
+		ash_client_addr(beentry, client_addr, sizeof(client_addr),
+						&client_port);
+
+		gotactives = true;
+
+		/* prepare to store the entry */
+		ash_prepare_store(ash_time, beentry->st_procpid,
+#if PG_VERSION_NUM >= 130000
+							leader_pid,
+#endif
+							usename ? usename : "\0",
+							client_port, beentry->st_databaseid,
+							datname ? datname : "\0",
+							beentry->st_appname ? beentry->st_appname : "\0",
+							client_addr,
+							local_beentry->backend_xmin,
+							beentry->st_proc_start_timestamp,
+							beentry->st_xact_start_timestamp,
+							beentry->st_activity_start_timestamp,
+							beentry->st_state_start_timestamp,
+							wait_event_info,
+							ash_backend_state_name(beentry->st_state),
+							beentry->st_clienthostname ?
+								beentry->st_clienthostname : "\0",
+							top_level_query ? top_level_query : "\0",
+							backend_type ? backend_type : "\0",
+							beentry->st_userid, local_beentry->backend_xid,
+							blockers, blockerpid, root_blockerpid,
+							blocker_depth, blocker_state,
+							queryid, gpi_query, cmdtype);
+	}
+
+	return gotactives;
+}
+
+/*
+ * Sample the active sessions by running the pg_stat_activity query through
+ * SPI.  This is the fallback when pgsentinel_ash.native_sampler is off.
+ */
+static bool
+ash_sample_spi(TimestampTz ash_time)
+{
+	int ret;
+	uint64 i;
+	bool gotactives = false;
+	ashLockGraph lock_graph;
+	ashProcMapEntry *procmap;
+	int nprocs;
+
+	lock_graph.built = false;
+	SPI_connect();
+
+	if (ash_track_idle_trans)
+	{
+		pgstat_report_activity(STATE_RUNNING, pgsa_query_track_idle);
+
+		/* We can now execute queries via SPI */
+		ret = SPI_execute(pgsa_query_track_idle, true, 0);
+	}
+	else
+	{
+		pgstat_report_activity(STATE_RUNNING, pgsa_query_no_track_idle);
+
+		/* We can now execute queries via SPI */
+		ret = SPI_execute(pgsa_query_no_track_idle, true, 0);
+	}
+
+	if (ret != SPI_OK_SELECT)
+		elog(FATAL, "cannot select from pg_stat_activity: error code %d", ret);
+
+	/*
+	 * PGPROC of the rows, their wait event and the state of their blockers:
+	 * pg_stat_activity has no wait_event_info, so take it with the backend
+	 * status snapshot the rows come from, once for the whole sample.
+	 */
+	procmap = ash_build_procmap(pgstat_fetch_stat_numbackends(), &nprocs);
+
+	/* Do some processing */
+
+	if (SPI_processed > 0)
+	{
+		gotactives=true;
+		for (i = 0; i < SPI_processed; i++)
+		{
+			bool isnull;
+			Datum data;
+			char *usenamevalue=NULL;
+			char *datnamevalue=NULL;
+			char *appnamevalue=NULL;
+			char *client_hostnamevalue=NULL;
+			char *queryvalue=NULL;
+			char *backend_typevalue=NULL;
+			char *statevalue=NULL;
+			const char *blockerstatevalue=NULL;
+			char *clientaddrvalue=NULL;
+			int pidvalue;
+			ashProcMapEntry *procentry;
+			PGPROC *procvalue = NULL;
+			uint32 wait_event_infovalue = 0;
+#if PG_VERSION_NUM >= 130000
+			int leader_pidvalue;
+#endif
+			int client_portvalue;
+			int blockersvalue;
+			int blockerpidvalue;
+			int root_blockerpidvalue;
+			int blocker_depthvalue;
+			Oid datidvalue;
+			Oid usesysidvalue;
+			TransactionId backend_xminvalue;
+			TransactionId backend_xidvalue;
+			TimestampTz backend_startvalue;
+			TimestampTz xact_startvalue;
+			TimestampTz query_startvalue;
+			TimestampTz state_changevalue;
+			uint64 queryidvalue;
+			char *gpi_queryvalue = NULL;
+			char *cmdtypevalue = NULL;
+
+			/* Fetch values */
+
+			/* datid */
+			datidvalue = DatumGetObjectId(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,1, &isnull));
+
+			/* usesysid */
+			usesysidvalue = DatumGetObjectId(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,4, &isnull));
+
+			/* datname */
+			datnamevalue = DatumGetCString(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,2, &isnull));
+
+			/* pid */
+			pidvalue = DatumGetInt32(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,3, &isnull));
+
+			/* wait event, and whether this session is sampled */
+			procentry = ash_procmap_find(procmap, nprocs, pidvalue);
+			if (procentry)
+			{
+				procvalue = &ProcGlobal->allProcs[procentry->procno];
+				wait_event_infovalue = procentry->wait_event_info;
+			}
+			if (!ash_sample_keep(wait_event_infovalue))
+				continue;
+
+			/* client_port */
+			client_portvalue = DatumGetInt32(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,9, &isnull));
+
+			/* usename */
+			data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
+																5, &isnull);
+			if (!isnull) {
+				usenamevalue = DatumGetCString(data);
+			}
+
+			/* appname */
+			data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
+																6, &isnull);
+			if (!isnull) {
+				appnamevalue = TextDatumGetCString(data);
+			}
+
+			/* state */
+			data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
+															16, &isnull);
+			if (!isnull) {
+				statevalue = TextDatumGetCString(data);
+			}
+
+#if PG_VERSION_NUM >= 100000
+			/* queryid */
+			queryidvalue = DatumGetUInt64(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,22, &isnull));
+
+			/* gpi query */
+			data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
+															23, &isnull);
+			if (!isnull) {
+				gpi_queryvalue = TextDatumGetCString(data);
+			}
+
+			/* cmdtype */
+			data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
+															24, &isnull);
+			if (!isnull) {
+				cmdtypevalue = TextDatumGetCString(data);
+			}
+#else
+			/* queryid */
+			queryidvalue = DatumGetUInt64(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,21, &isnull));
+
+			/* gpi query */
+			data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
+															22, &isnull);
+			if (!isnull) {
+				gpi_queryvalue = TextDatumGetCString(data);
+			}
+
+			/* cmdtype */
+			data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
+															23, &isnull);
+			if (!isnull) {
+				cmdtypevalue = TextDatumGetCString(data);
+			}
+#endif
+
+			/* blockers, from the lock wait graph of this sample */
+			ash_lock_graph_lookup(&lock_graph, procvalue,
+								  pidvalue, &blockersvalue,
+								  &blockerpidvalue, &root_blockerpidvalue,
+								  &blocker_depthvalue);
+			if (blockerpidvalue != 0)
+				blockerstatevalue = ash_procmap_state(procmap, nprocs,
+													  blockerpidvalue);
+
+			/* client_hostname */
+			data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
+																8, &isnull);
+			if (!isnull) {
+				client_hostnamevalue = TextDatumGetCString(data);
+			}
+
+			/* query */
+			data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
+															19, &isnull);
+			if (!isnull) {
+				queryvalue = TextDatumGetCString(data);
+			}
+
+#if PG_VERSION_NUM >= 100000
+			/* backend_type */
+			data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
+															20, &isnull);
+			if (!isnull) {
+				backend_typevalue = TextDatumGetCString(data);
+			}
+#endif
+
+			/* client addr */
+			data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
+															7, &isnull);
+			if (!isnull) {
+				clientaddrvalue = TextDatumGetCString(data);
+			}
+
+			/* backend xid */
+			backend_xidvalue = DatumGetTransactionId(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,17, &isnull));
+
+			/* backedn xmin */
+			backend_xminvalue = DatumGetTransactionId(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,18, &isnull));
+
+			/* backend start */
+			backend_startvalue = DatumGetTimestamp(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,10, &isnull));
+
+			/* xact start */
+			xact_startvalue = DatumGetTimestamp(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,11, &isnull));
+
+			/* query start */
+			query_startvalue = DatumGetTimestamp(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,12, &isnull));
+
+			/* state change */
+			state_changevalue = DatumGetTimestamp(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,13, &isnull));
+#if PG_VERSION_NUM >= 130000
+			/* leader pid */
+			leader_pidvalue = DatumGetInt32(SPI_getbinval(
+				SPI_tuptable->vals[i],SPI_tuptable->tupdesc,25, &isnull));
+#endif
+
+			/* prepare to store the entry */
+			ash_prepare_store(ash_time, pidvalue,
+#if PG_VERSION_NUM >= 130000
+								leader_pidvalue,
+#endif
+								usenamevalue ? usenamevalue : "\0",
+								client_portvalue, datidvalue,
+								datnamevalue ? datnamevalue : "\0",
+								appnamevalue ? appnamevalue : "\0",
+								clientaddrvalue ? clientaddrvalue : "\0",
+								backend_xminvalue, backend_startvalue,
+								xact_startvalue,query_startvalue,
+								state_changevalue,
+								wait_event_infovalue,
+								statevalue ? statevalue : "\0",
+								client_hostnamevalue ? client_hostnamevalue : "\0",
+								queryvalue ? queryvalue : "\0",
+								backend_typevalue ? backend_typevalue : "\0",
+								usesysidvalue, backend_xidvalue,
+								blockersvalue, blockerpidvalue,
+								root_blockerpidvalue, blocker_depthvalue,
+								blockerstatevalue ? blockerstatevalue : "\0",
+								queryidvalue,
+								gpi_queryvalue ? gpi_queryvalue : "\0",
+								cmdtypevalue ? cmdtypevalue : "\0");
+		}
+	}
+	SPI_finish();
+
+	return gotactives;
+}
+
+/* Adaptive sampling period in microseconds, private to the worker */
+static int64 ash_adaptive_period = 0;	/* 0 until adapted */
+/* moving averages of the load of the samples, see ash_sample_end() */
+static double ash_active_avg = -1;
+static double ash_waits_avg = -1;
+
+/* Configured sampling period, in microseconds */
+static int64
+ash_base_period_us(void)
+{
+	if (ash_sampling_interval > 0)
+		return (int64) ash_sampling_interval * 1000;
+	return (int64) ash_sampling_period * USECS_PER_SEC;
+}
+
+/* Sampling period, in microseconds */
+static int64
+ash_sampling_period_us(void)
+{
+	if (ash_adaptive_min_interval > 0 && ash_adaptive_period > 0)
+		return ash_adaptive_period;
+	return ash_base_period_us();
+}
+
+/*
+ * Prepare the sample of the current tick, see ash_sample_keep().  It also
+ * stands for the missed ticks before it.
+ */
+static void
+ash_sample_begin(int64 missed)
+{
+	double offset = (double) IntEntryArray[0].ticks * 0.6180339887498949;
+
+	if (ash_sample_budget == 0)
+		ash_sample_fraction = 1.0;
+	ash_sample_nactive = 0;
+	ash_sample_nwaits = 0;
+	INSTR_TIME_SET_ZERO(ash_sample_store_time);
+	ash_sample_accum = offset - floor(offset);
+	ash_sample_weight = (double) ash_sampling_period_us() / USECS_PER_SEC /
+		ash_sample_fraction * (double) (missed + 1);
+
+	IntEntryArray[0].sample_period = ash_sampling_period_us();
+	IntEntryArray[0].sample_fraction = ash_sample_fraction;
+}
+
+/* Account for a phase of the sample that took us */
+static void
+ash_stats_record(ashStatsPhase phase, int64 us)
+{
+	uint64 value = (uint64) Max(us, 0);
+	int bucket = 0;
+
+	while (value > 0 && bucket < ASH_STATS_HIST_BUCKETS - 1)
+	{
+		value >>= 1;
+		bucket++;
+	}
+
+	IntEntryArray[0].phase_time[phase] += Max(us, 0);
+	IntEntryArray[0].phase_hist[phase][bucket]++;
+}
+
+static emit_log_hook_type prev_emit_log_hook = NULL;
+
+/* Keep the last error of the worker for pgsentinel_stats */
+static void
+pgsentinel_emit_log(ErrorData *edata)
+{
+	if (edata->elevel >= ERROR && IntEntryArray != NULL)
+	{
+		ashStatsError *error = &IntEntryArray[0].last_error;
+
+		ASH_BEGIN_WRITE(error);
+		error->time = GetCurrentTimestamp();
+		strlcpy(error->message, edata->message ? edata->message : "",
+				sizeof(error->message));
+		ASH_END_WRITE(error);
+	}
+
+	if (prev_emit_log_hook)
+		prev_emit_log_hook(edata);
+}
+
+/*
+ * Adapt the sampling to the sample just taken, which took elapsed us.
+ *
+ * Over pgsentinel_ash.sample_budget, the next samples only keep part of the
+ * active sessions, and more of them again once well under the budget.  With
+ * pgsentinel_ash.adaptive_min_interval set, the period drops to it when the
+ * number of active sessions or of distinct wait events jumps above its
+ * moving average, doubles up to pgsentinel_ash.adaptive_max_interval while
+ * nothing is active or the samples are over budget, and else goes back to
+ * the configured period.  The weight of the entries follows, so that their
+ * sum over a time range stays the active session time.
+ *
+ * Returns true if the period changed.
+ */
+static bool
+ash_sample_end(int64 elapsed)
+{
+	int64 budget = (int64) ash_sample_budget * 1000;
+	int64 min_period = (int64) ash_adaptive_min_interval * 1000;
+	int64 max_period = Max((int64) ash_adaptive_max_interval * 1000, min_period);
+	int64 old_period = ash_sampling_period_us();
+	int64 period;
+	bool over_budget = budget > 0 && elapsed > budget;
+	bool spike;
+
+	if (over_budget)
+		ash_sample_fraction = Max(ash_sample_fraction * budget / elapsed,
+								  ASH_SAMPLE_MIN_FRACTION);
+	else if (ash_sample_fraction < 1.0 && elapsed < budget / 2)
+		ash_sample_fraction = Min(ash_sample_fraction * 2, 1.0);
+
+	spike = ash_active_avg >= 0 &&
+		(ash_sample_nactive > ash_active_avg * 1.5 + 1 ||
+		 ash_sample_nwaits > ash_waits_avg + 2);
+	if (ash_active_avg < 0)
+	{
+		ash_active_avg = ash_sample_nactive;
+		ash_waits_avg = ash_sample_nwaits;
+	}
+	else
+	{
+		ash_active_avg += (ash_sample_nactive - ash_active_avg) / 8;
+		ash_waits_avg += (ash_sample_nwaits - ash_waits_avg) / 8;
+	}
+
+	if (min_period == 0)
+	{
+		ash_adaptive_period = 0;
+		return false;
+	}
+
+	if (spike)
+		period = min_period;
+	else if (over_budget || ash_sample_nactive == 0)
+		period = old_period * 2;
+	else
+		period = ash_base_period_us();
+	ash_adaptive_period = Min(Max(period, min_period), max_period);
+
+	return ash_adaptive_period != old_period;
+}
+
+/* First sampling deadline strictly after ts */
+static TimestampTz
+ash_next_tick(TimestampTz ts)
+{
+	int64 period = ash_sampling_period_us();
+
+	return (ts / period + 1) * period;
+}
+
+/*
+ * pgsentinel_bench_fill() request, in a single value so that the worker never
+ * sees half of one: the number of entries in the low bits and the number of
+ * sessions above them.
+ */
+#define ASH_BENCH_SESSIONS_SHIFT	40
+#define ASH_BENCH_MAX_ENTRIES		((UINT64CONST(1) << ASH_BENCH_SESSIONS_SHIFT) - 1)
+#define ASH_BENCH_MAX_SESSIONS		100000
+/* set by the worker once it works on the request */
+#define ASH_BENCH_TAKEN				(UINT64CONST(1) << 63)
+/* seconds a request waits for the worker to take it */
+#define ASH_BENCH_TIMEOUT			10
+#define ASH_BENCH_QUERIES			1000
+#define ASH_BENCH_FIRST_PID			1000000
+
+/*
+ * Synthetic entries ever appended.  Each one carries its number as
+ * backend_xid and a checksum of its backend_xid, pid and queryid as
+ * backend_xmin, so that bench/stress.sh can tell torn or duplicated rows:
+ * (backend_xid * 65599 + pid * 257 + queryid * 31) % 4294967295 + 1.
+ */
+static uint32 ash_bench_entries = 0;
+
+static TransactionId
+ash_bench_checksum(TransactionId xid, int pid, uint64 queryid)
+{
+	uint64 sum = (uint64) xid * 65599 + (uint64) pid * 257 + queryid * 31;
+
+	return (TransactionId) (sum % UINT64CONST(4294967295) + 1);
+}
+
+/*
+ * Append the synthetic entries a pgsentinel_bench_fill() call asked for:
+ * one per session and per second, the last ones now, on CPU or waiting on
+ * a lock, running ASH_BENCH_QUERIES distinct queries.  The worker does it as
+ * the only writer of the ring, after the entries already there to keep it
+ * in ash_time order.
+ */
+static void
+ash_bench_fill(void)
+{
+	uint64 request = pg_atomic_read_u64(&IntEntryArray[0].bench_fill);
+	uint64 entries = request & ASH_BENCH_MAX_ENTRIES;
+	int sessions = (int) (request >> ASH_BENCH_SESSIONS_SHIFT);
+	uint64 ticks;
+	TimestampTz now = GetCurrentTimestamp();
+	TimestampTz start;
+	int64 step = USECS_PER_SEC;
+	double saved_weight = ash_sample_weight;
+	uint64 i;
+
+	/* the caller may have given up meanwhile */
+	if (request == 0 || (request & ASH_BENCH_TAKEN) != 0 ||
+		!pg_atomic_compare_exchange_u64(&IntEntryArray[0].bench_fill,
+										&request, request | ASH_BENCH_TAKEN))
+		return;
+
+	ticks = (entries + sessions - 1) / sessions;
+	start = now - (int64) ticks * USECS_PER_SEC;
+
+	if (IntEntryArray[0].ash_written > 0)
+	{
+		TimestampTz last = AshEntryArray[(IntEntryArray[0].ash_written - 1) %
+										 ash_max_entries].ash_time;
+
+		if (last >= start)
+		{
+			start = last + 1;
+			step = Max(now - start, 0) / (int64) ticks;
+		}
+	}
+
+	ash_sample_weight = 1.0;
+	for (i = 0; i < entries; i++)
+	{
+		int session = (int) (i % sessions);
+		uint64 tick = i / sessions;
+		uint64 queryid = (session * 7 + tick) % ASH_BENCH_QUERIES + 1;
+		uint32 wait_event_info = 0;
+		TimestampTz ash_time = start + (int64) tick * step;
+		TransactionId xid;
+		char query[64];
+
+		if (session == 0)
+			ash_dict_maybe_reclaim();
+
+		/* 0 would be reported as NULL */
+		if (++ash_bench_entries == 0)
+			ash_bench_entries = 1;
+		xid = ash_bench_entries;
+
+		if (session % 4 == 0)
+			wait_event_info = PG_WAIT_LOCK | (uint32) (tick % 4);
+		snprintf(query, sizeof(query), "select %d /* pgsentinel bench */",
+				 (int) queryid);
+
+		ash_prepare_store(ash_time, ASH_BENCH_FIRST_PID + session,
+#if PG_VERSION_NUM >= 130000
+						  0,
+#endif
+						  "bench", 5432, MyDatabaseId, "bench", "pgbench",
+						  "127.0.0.1",
+						  ash_bench_checksum(xid, ASH_BENCH_FIRST_PID + session,
+											 queryid),
+						  start, ash_time, ash_time, ash_time, wait_event_info,
+						  "active", "", query, "client backend",
+						  BOOTSTRAP_SUPERUSERID, xid, 0, 0, 0, 0, "", queryid,
+						  query, "SELECT");
+
+		/* a second of entries at a time, like the samples */
+		if (session == sessions - 1)
+			ash_publish_entries();
+	}
+	ash_publish_entries();
+	ash_sample_weight = saved_weight;
+	ash_sample_nqueryids = 0;
+
+	ereport(LOG,
+			(errmsg("bgworker pgsentinel appended " UINT64_FORMAT " synthetic entries",
+					entries)));
+	pg_atomic_write_u64(&IntEntryArray[0].bench_fill, 0);
+}
+
+/*
+ * Sleep until the next sampling deadline and return it.
+ *
+ * Deadlines are absolute and aligned on multiples of the sampling period, so
+ * the cost of a sample does not make the schedule drift and samples taken on
+ * several nodes line up.  If we are so late that whole periods went by, these
+ * deadlines are counted as missed and we sample for the most recent one,
+ * their number is returned in *missed.  Returns DT_NOBEGIN on SIGTERM, for the caller to flush the archive and
+ * exit.
+ */
+static TimestampTz
+ash_wait_for_tick(TimestampTz *next_tick, int64 *missed)
+{
+	int64 period = ash_sampling_period_us();
+	TimestampTz now;
+	TimestampTz tick;
+	int64 lag;
+
+	for (;;)
+	{
+		int rc;
+		long timeout;
+
+		/* Process signals */
+		if (got_sighup)
+		{
+			/* Process config file */
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+			ereport(LOG, (errmsg("bgworker pgsentinel signal: processed SIGHUP")));
+
+			/* Realign the schedule if the period has been changed */
+			if (ash_sampling_period_us() != period)
+			{
+				period = ash_sampling_period_us();
+				*next_tick = ash_next_tick(GetCurrentTimestamp());
+			}
+		}
+
+		if (got_sigterm)
+		{
+			ereport(LOG, (errmsg("bgworker pgsentinel signal: processed SIGTERM")));
+			return DT_NOBEGIN;
+		}
+
+		if (ash_bench && pg_atomic_read_u64(&IntEntryArray[0].bench_fill) != 0)
+			ash_bench_fill();
+
+		now = GetCurrentTimestamp();
+		if (now >= *next_tick)
+			break;
+
+		/* WaitLatch() only has a millisecond resolution, round up */
+		timeout = (long) ((*next_tick - now + 999) / 1000);
+#if PG_VERSION_NUM >= 100000
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+								timeout, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+#else
+		rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT |
+							WL_POSTMASTER_DEATH, timeout);
+		ResetLatch(&MyProc->procLatch);
+#endif
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+
+	tick = *next_tick;
+	lag = now - tick;
+	*missed = 0;
+	if (lag >= period)
+	{
+		*missed = lag / period;
+
+		tick += *missed * period;
+		lag -= *missed * period;
+		IntEntryArray[0].missed_ticks += *missed;
+		ereport(DEBUG1,
+				(errmsg("bgworker pgsentinel missed " INT64_FORMAT " sampling deadlines",
+						*missed)));
+	}
+	*next_tick = tick + period;
+
+	IntEntryArray[0].ticks++;
+	IntEntryArray[0].last_tick = tick;
+	IntEntryArray[0].last_tick_lag = lag;
+	IntEntryArray[0].total_tick_lag += lag;
+	if (lag > IntEntryArray[0].max_tick_lag)
+		IntEntryArray[0].max_tick_lag = lag;
+
+	return tick;
+}
+
+/* Next archive flush deadline after ts, aligned on the flush interval */
+static TimestampTz
+ash_next_flush(TimestampTz ts)
+{
+	int64 interval = (int64) Max(ash_archive_flush_interval, 1) * USECS_PER_SEC;
+
+	return (ts / interval + 1) * interval;
+}
+
+/*
+ * Text of a query text reference, copied once per slot in texts/keys so
+ * that a flush does not copy the same text for every entry.
+ */
+static const char *
+ash_archive_text(const ashQueryTextRef *ref, char **texts,
+				 ashQueryTextKey *keys, char *buf)
+{
+	if (ref->slot < 0 || ref->slot >= ash_max_query_texts)
+		return NULL;
+
+	if (texts[ref->slot] == NULL ||
+		keys[ref->slot].kind != ref->key.kind ||
+		keys[ref->slot].id != ref->key.id)
+	{
+		if (!ash_qtext_fetch(ref, buf))
+			return NULL;
+		texts[ref->slot] = pstrdup(buf);
+		keys[ref->slot] = ref->key;
+	}
+
+	return texts[ref->slot];
+}
+
+/*
+ * Append the published entries not archived yet to the archive.  Only the
+ * worker writes entries, so it can read them without the change counters.
+ * The entries overwritten before being archived (the ring is too small for
+ * pgsentinel_ash.archive_flush_interval) are counted in archive_lost.
+ *
+ * Unless all is set, only ASH_ARCHIVE_FLUSH_ROWS entries are written, so that
+ * a tick never compresses a whole ring; returns true if some are left.
+ */
+static bool
+ash_archive_flush(bool all)
+{
+	MemoryContext flush_context;
+	MemoryContext oldcontext;
+	uint64 head = pg_atomic_read_u64(&IntEntryArray[0].ash_head);
+	uint64 low = head > (uint64) ash_max_entries ? head - ash_max_entries + 1 : 1;
+	uint64 seq = IntEntryArray[0].archived_seq + 1;
+	int chunk = Min(ash_max_entries, ASH_ARCHIVE_FLUSH_ROWS);
+	bool failed = false;
+
+	if (seq < low)
+	{
+		IntEntryArray[0].archive_lost += low - seq;
+		seq = low;
+	}
+
+	flush_context = AllocSetContextCreate(CurrentMemoryContext,
+										  "pgsentinel archive flush",
+										  ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(flush_context);
+
+	while (seq <= head)
+	{
+		ashRow *rows = palloc(sizeof(ashRow) * chunk);
+		char **texts = palloc0(sizeof(char *) * ash_max_query_texts);
+		ashQueryTextKey *keys = palloc0(sizeof(ashQueryTextKey) * ash_max_query_texts);
+		char *buf = palloc(pgstat_track_activity_query_size);
+		int n;
+
+		for (n = 0; n < chunk && seq <= head; n++, seq++)
+		{
+			ashEntry *entry = &AshEntryArray[(seq - 1) % ash_max_entries];
+
+			ash_entry_to_row(entry, &rows[n]);
+			rows[n].top_level_query = ash_archive_text(&entry->top_level_query,
+													   texts, keys, buf);
+			rows[n].query = ash_archive_text(&entry->query, texts, keys, buf);
+		}
+
+		/* On failure, retry at the next flush */
+		if (!ash_archive_write(rows, n))
+		{
+			failed = true;
+			break;
+		}
+
+		IntEntryArray[0].archived_seq = rows[n - 1].seq;
+		MemoryContextReset(flush_context);
+
+		if (!all)
+			break;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(flush_context);
+
+	return !failed && IntEntryArray[0].archived_seq < head;
+}
+
+void
+pgsentinel_main(Datum main_arg)
+{
+	MemoryContext pgsentinel_loop_context;
+	MemoryContext saved_context;
+	TimestampTz next_tick;
+	TimestampTz next_flush;
+
+	ereport(LOG, (errmsg("starting bgworker pgsentinel")));
+
+	/* Register functions for SIGTERM/SIGHUP management */
+	pqsignal(SIGHUP, pgsentinel_sighup);
+	pqsignal(SIGINT, SIG_IGN);
+	pqsignal(SIGTERM, pgsentinel_sigterm);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	prev_emit_log_hook = emit_log_hook;
+	emit_log_hook = pgsentinel_emit_log;
+
+	IntEntryArray[0].worker_latch = &MyProc->procLatch;
+
+	/* Connect to a database */
+#if (PG_VERSION_NUM < 110000)
+	BackgroundWorkerInitializeConnection(pgsentinelDbName, NULL);
+#else
+	BackgroundWorkerInitializeConnection(pgsentinelDbName, NULL, 0);
+#endif
+
+	pgsentinel_loop_context = AllocSetContextCreate(TopMemoryContext,
+													"pgsentinel loop context",
+													ALLOCSET_DEFAULT_SIZES);
+
+	saved_context = MemoryContextSwitchTo(pgsentinel_loop_context);
+
+	/* Forget the entries a previous worker did not publish */
+	IntEntryArray[0].ash_written = pg_atomic_read_u64(&IntEntryArray[0].ash_head);
+	IntEntryArray[0].pgssh_written = pg_atomic_read_u64(&IntEntryArray[0].pgssh_head);
+	IntEntryArray[0].summary_written = pg_atomic_read_u64(&IntEntryArray[0].summary_head);
+	IntEntryArray[0].pgssh_blocks_written = pg_atomic_read_u64(&IntEntryArray[0].pgssh_block_head);
+	pgssh_block_truncate();
+	pgssh_load_last();
+
+	/*
+	 * Keep numbering the entries after the archived ones, the history may
+	 * have been lost in a crash.
+	 */
+	if (ash_archive_flush_interval > 0)
+	{
+		uint64 last_seq = ash_archive_last_seq();
+
+		if (last_seq > IntEntryArray[0].ash_written)
+		{
+			IntEntryArray[0].ash_written = last_seq;
+			ash_publish_entries();
+		}
+		if (last_seq > IntEntryArray[0].archived_seq)
+			IntEntryArray[0].archived_seq = last_seq;
+		ash_archive_retention();
+	}
+
+	next_tick = ash_next_tick(GetCurrentTimestamp());
+	next_flush = ash_next_flush(next_tick);
+
+	while (!got_sigterm)
+	{
+		int ret;
+		uint64 i;
+		bool gotactives;
+		char *pgssh_query;
+		TimestampTz ash_time;
+		int64 missed;
+		TimestampTz sample_start;
+		int64 elapsed;
+		int64 store_time;
+		gotactives=false; 
+
+letswait:
+		/* Wait until the next sampling deadline */
+		ash_time = ash_wait_for_tick(&next_tick, &missed);
+		if (ash_time == DT_NOBEGIN)
+			break;
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		PushActiveSnapshot(GetTransactionSnapshot());
+
+		if (!PgSentinelHasBeenLoaded()) {
+			PopActiveSnapshot();
+			CommitTransactionCommand();
+			MemoryContextReset(pgsentinel_loop_context);
+			goto letswait;
+		}
+
+		ash_sample_nqueryids = 0;
+		ash_sample_begin(missed);
+		ash_dict_maybe_reclaim();
+		sample_start = GetCurrentTimestamp();
+		if (ash_native_sampler)
+			gotactives = ash_sample_native(ash_time);
+		else
+			gotactives = ash_sample_spi(ash_time);
+
+		/* the pgssh query below reads this sample */
+		ash_publish_entries();
+
+		elapsed = GetCurrentTimestamp() - sample_start;
+		store_time = (int64) INSTR_TIME_GET_MICROSEC(ash_sample_store_time);
+		ash_stats_record(ASH_STATS_CAPTURE, elapsed - store_time);
+		ash_stats_record(ASH_STATS_STORE, store_time);
+
+		/* Sample at the new rate from now on */
+		if (ash_sample_end(elapsed))
+			next_tick = ash_next_tick(ash_time);
+
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+		pgstat_report_activity(STATE_IDLE, NULL);
+
+		/* pg_stat_statement_history */
+		if (gotactives && pgssh_enable &&
+			(pgssh_query = ash_pgssh_build_query()) != NULL)
+		{
+			sample_start = GetCurrentTimestamp();
+			SetCurrentStatementStartTimestamp();
+			StartTransactionCommand();
+			SPI_connect();
+			PushActiveSnapshot(GetTransactionSnapshot());
+			pgstat_report_activity(STATE_RUNNING, pgssh_query);
+
+			/* We can now execute queries via SPI */
+			ret = SPI_execute(pgssh_query,true, 0);
+
+			if (ret != SPI_OK_SELECT)
+				elog(FATAL, "cannot select from pg_stat_statements: error code %d", ret);
+
+			/* Do some processing */
+			if (SPI_processed > 0)
+			{
+				for (i = 0; i < SPI_processed; i++)
+				{
+					bool isnull;
+					Oid userid;
+					Oid dbid;
+					uint64 queryid;
+					pgsshCounters counters;
+
+					userid=DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,1, &isnull));
+					dbid=DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,2, &isnull));
+					queryid=DatumGetUInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,3, &isnull));
+					counters.calls=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,4, &isnull));
+					counters.total_time=DatumGetFloat8(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,5, &isnull));
+					counters.rows=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,6, &isnull));
+					counters.shared_blks_hit=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,7, &isnull));
+					counters.shared_blks_read=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,8, &isnull));
+					counters.shared_blks_dirtied=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,9, &isnull));
+					counters.shared_blks_written=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,10, &isnull));
+					counters.local_blks_hit=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,11, &isnull));
+					counters.local_blks_read=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,12, &isnull));
+					counters.local_blks_dirtied=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,13, &isnull));
+					counters.local_blks_written=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,14, &isnull));
+					counters.temp_blks_read=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,15, &isnull));
+					counters.temp_blks_written=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,16, &isnull));
+					counters.blk_read_time=DatumGetFloat8(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,17, &isnull));
+					counters.blk_write_time=DatumGetFloat8(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,18, &isnull));
+#if PG_VERSION_NUM >= 130000
+					counters.plans=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,19, &isnull));
+					counters.total_plan_time=DatumGetFloat8(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,20, &isnull));
+					counters.wal_records=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,21, &isnull));
+					counters.wal_fpi=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,22, &isnull));
+					counters.wal_bytes=DatumGetInt64(DirectFunctionCall1(numeric_int8,SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,23, &isnull)));
+#endif
+
+					pgssh_store(ash_time, userid, dbid, queryid, &counters);
+				}
+			}
+			pgssh_checkpoint_queries(ash_time);
+			pgssh_forget_queries();
+			SPI_finish();
+			PopActiveSnapshot();
+			CommitTransactionCommand();
+			pgstat_report_activity(STATE_IDLE, NULL);
+			ash_publish_entries();
+			ash_stats_record(ASH_STATS_PGSSH,
+							 GetCurrentTimestamp() - sample_start);
+		}
+
+		/* Move the entries to the archive */
+		if (ash_archive_flush_interval > 0 && ash_time >= next_flush)
+		{
+			/* the rest of a large flush is written by the next ticks */
+			if (!ash_archive_flush(false))
+				next_flush = ash_next_flush(ash_time);
+		}
+		MemoryContextReset(pgsentinel_loop_context);
+	}
+
+	if (ash_archive_flush_interval > 0)
+	{
+		ash_archive_flush(true);
+		ash_archive_sync();
+	}
+
+	/* No problems, so clean exit */
+	MemoryContextSwitchTo(saved_context);
+	proc_exit(0);
+}
+
+static void
+pgsentinel_load_params(void)
+{
+
+	DefineCustomIntVariable("pgsentinel_ash.sampling_period",
+							"Duration between each pull (in seconds).",
+							NULL,
+							&ash_sampling_period,
+							1,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.sampling_interval",
+							"Duration between each pull, overrides pgsentinel_ash.sampling_period when set.",
+							NULL,
+							&ash_sampling_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.adaptive_min_interval",
+							"Shortest duration between each pull when the sampling rate adapts to the load, 0 to sample at a fixed rate.",
+							NULL,
+							&ash_adaptive_min_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.adaptive_max_interval",
+							"Longest duration between each pull when the sampling rate adapts to the load.",
+							NULL,
+							&ash_adaptive_max_interval,
+							10000,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.sample_budget",
+							"Time a sample may take before only part of the active sessions are sampled, 0 for no limit.",
+							NULL,
+							&ash_sample_budget,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pgsentinel_ash.native_sampler",
+	                        "Sample the sessions directly from shared memory instead of querying pg_stat_activity.",
+							NULL,
+							&ash_native_sampler,
+							true,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pgsentinel_ash.lazy_capture",
+	                        "Locate the parsed statements in the top level query instead of copying them.",
+							"Their text is then only read when the native sampler samples the backend.",
+							&ash_lazy_capture,
+							false,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pgsentinel_ash.bench",
+	                        "Allow pgsentinel_bench_fill() to add synthetic entries to the history.",
+							"Only meant for the benchmarks and stress tests of the repository.",
+							&ash_bench,
+							false,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pgsentinel_ash.track_idle_trans",
+	                        "Track session in idle transaction state.",
+							NULL,
+							&ash_track_idle_trans,
+							false,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	/* can't define PGC_POSTMASTER variable after startup */
+	DefineCustomIntVariable("pgsentinel_ash.max_entries",
+							"Maximum number of ash entries.",
+							NULL,
+							&ash_max_entries,
+							1000,
+							1000,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pgsentinel_ash.save",
+							 "Save the history across server shutdowns.",
+							 NULL,
+							 &ash_save,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.archive_flush_interval",
+							"Interval between the moves of the ash entries to the on-disk archive, 0 disables the archive.",
+							NULL,
+							&ash_archive_flush_interval,
+							0,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.archive_segment_size",
+							"Size (in MB) of the archive segment files.",
+							NULL,
+							&ash_archive_segment_size,
+							64,
+							1,
+							1024,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.archive_max_size",
+							"Size (in MB) above which the oldest archive segments are removed.",
+							NULL,
+							&ash_archive_max_size,
+							1024,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.archive_max_age",
+							"Age after which the archive segments are removed, 0 keeps them.",
+							NULL,
+							&ash_archive_max_age,
+							7 * 24 * 60 * 60,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.max_query_texts",
+							"Maximum number of distinct query texts kept for the ash entries.",
+							NULL,
+							&ash_max_query_texts,
+							1000,
+							10,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.max_dictionary_entries",
+							"Maximum number of distinct strings (user, database, application, wait event...) kept for the ash entries.",
+							NULL,
+							&ash_dict_max_entries,
+							8192,
+							64,
+							PG_UINT16_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.summary_max_entries",
+							"Maximum number of rows of the ash summary, 0 disables it.",
+							NULL,
+							&ash_summary_max_entries,
+							100000,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.summary_bucket_width",
+							"Width of the time buckets of the ash summary.",
+							NULL,
+							&ash_summary_bucket_width,
+							60,
+							60,
+							24 * 60 * 60,
+							PGC_POSTMASTER,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pgsentinel_ash.summary_retention",
+							"Age after which the rows of the ash summary are not returned anymore.",
+							NULL,
+							&ash_summary_retention,
+							24 * 60 * 60,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("pgsentinel_ash");
+
+	DefineCustomIntVariable("pgsentinel_pgssh.max_entries",
+							"Maximum number of pgssh entries.",
+							NULL,
+							&pgssh_max_entries,
+							10000,
+							10000,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pgsentinel_pgssh.enable",
+	                        "Enable pg_stat_statements_history.",
+							NULL,
+							&pgssh_enable,
+							false,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pgsentinel_pgssh.compress",
+							"Keep the pgssh history in compressed blocks.",
+							"They take the memory of pgsentinel_pgssh.max_entries entries.",
+							&pgssh_compress,
+							false,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("pgsentinel_pgssh");
+
+	DefineCustomStringVariable("pgsentinel.db_name",
+							gettext_noop("Database on which the worker connect."),
+							NULL,
+							&pgsentinelDbName,
+							"postgres",
+							PGC_POSTMASTER,
+							GUC_SUPERUSER_ONLY,
+							NULL, NULL, NULL);
+}
+
+/*
+ * Entry point for worker loading
+ */
+void
+_PG_init(void)
+{
+
+	BackgroundWorker worker;
+
+	if (IsBinaryUpgrade)
+		return;
+
+	/* Add parameters */
+	pgsentinel_load_params();
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+#if PG_VERSION_NUM < 150000
+	ash_shmem_request();
+#endif
+
+	/*
+	 * Install hooks.
+	 */
+#if PG_VERSION_NUM >= 150000
+	ash_prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = ash_shmem_request;
+#endif
+	ash_prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = ash_shmem_startup;
+	prev_post_parse_analyze_hook = post_parse_analyze_hook;
+	post_parse_analyze_hook = getparsedinfo_post_parse_analyze;
+
+	/* Worker parameter and registration */
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+#if PG_VERSION_NUM >= 100000
+	sprintf(worker.bgw_library_name, "pgsentinel");
+	sprintf(worker.bgw_function_name, "pgsentinel_main");
+#else
+	worker.bgw_main = pgsentinel_main;
+#endif
+	snprintf(worker.bgw_name, BGW_MAXLEN, "%s", worker_name);
+	/* Wait ash_restart_wait_time seconds for restart before crash */
+	worker.bgw_restart_time = ash_restart_wait_time;
+	worker.bgw_main_arg = (Datum) 0;
+#if PG_VERSION_NUM >= 90400
+	/*
+	 * Notify PID is present since 9.4. If this is not initialized
+	 * a static background worker cannot start properly.
+	 */
+	worker.bgw_notify_pid = 0;
+#endif
+	RegisterBackgroundWorker(&worker);
+}
+
+/* State of a pg_active_session_history call, for ash_emit_row() */
+/* Parts of a pg_active_session_history scan, in the order they are read */
+typedef enum ashScanPhase
+{
+	ASH_SCAN_ARCHIVE,			/* archived entries older than the ring */
+	ASH_SCAN_RING,				/* the ring, oldest entries first */
+	ASH_SCAN_MISSING,			/* entries overwritten while reading the ring */
+	ASH_SCAN_DONE
+} ashScanPhase;
+
+/* Dictionary strings of an ashRow */
+#define ASH_ROW_DICT_STRINGS 9
+
+/*
+ * State of a scan of the ash or pgssh history, kept across the calls of the
+ * function returning its rows one at a time, so that the rows are read from
+ * shared memory as the caller asks for them.
+ */
+typedef struct ashScanState
+{
+	TimestampTz from;
+	TimestampTz to;
+	ashFilter filter;
+	Oid userid;
+	bool is_allowed_role;
+	ashScanPhase phase;
+	uint64 head;				/* last entry of the ring when the scan began */
+	uint64 seq;					/* next entry to read in the ring */
+	uint64 missing_lo;			/* entries overwritten before being read */
+	uint64 missing_hi;
+	ashArchiveScan *archive;
+	char *top_level_query;
+	char *query;
+	/* copies of the dictionary strings of the row, see ash_row_copy_strings() */
+	char dict_strings[ASH_ROW_DICT_STRINGS][NAMEDATALEN];
+	bool pgssh_deltas;			/* return the pgssh counters as deltas */
+	HTAB *pgssh_queries;		/* pgsshScanQuery by pgsshKey */
+	/* compressed pgssh blocks, see pgssh_scan_fetch() */
+	uint64 pgssh_block_no;		/* next block to read */
+	uint64 pgssh_last_block;
+	pgsshBlock *pgssh_block;	/* copy of the block being read */
+	pgsshEntry *pgssh_entries;	/* its entries, decoded */
+	int pgssh_nentries;
+	int pgssh_pos;				/* next entry to return */
+	MemoryContext context;		/* of the scan, lives across the calls */
+} ashScanState;
+
+/* Cumulative counters of a query, rebuilt along a pgssh scan */
+typedef struct pgsshScanQuery
+{
+	pgsshKey key;				/* hash key, must be first */
+	bool known;					/* false until a baseline entry is read */
+	bool prepared;				/* first baseline or checkpoint found */
+	uint64 seq;					/* of the last entry read */
+	uint64 anchor_seq;			/* of the last baseline or checkpoint read */
+	pgsshCounters counters;
+} pgsshScanQuery;
+
+/* wait_event_type of a wait_event_info, no wait event means on CPU */
+static const char *
+ash_wait_event_type(uint32 wait_event_info)
+{
+	const char *str = pgstat_get_wait_event_type(wait_event_info);
+
+	return str != NULL ? str : "CPU";
+}
+
+/* Decode an ash entry, except its query texts */
+static void
+ash_entry_to_row(const ashEntry *entry, ashRow *row)
+{
+	row->seq = entry->seq;
+	row->ash_time = entry->ash_time;
+	row->datid = entry->datid;
+	row->datname = ash_dict_string(entry->datname_id);
+	row->pid = entry->pid;
+#if PG_VERSION_NUM >= 130000
+	row->leader_pid = entry->leader_pid;
+#else
+	row->leader_pid = 0;
+#endif
+	row->usesysid = entry->usesysid;
+	row->usename = ash_dict_string(entry->usename_id);
+	row->application_name = ash_dict_string(entry->application_name_id);
+	row->client_addr = ash_dict_string(entry->client_addr_id);
+	row->client_hostname = ash_dict_string(entry->client_hostname_id);
+	row->client_port = entry->client_port;
+	row->backend_start = entry->backend_start;
+	row->xact_start = entry->xact_start;
+	row->query_start = entry->query_start;
+	row->state_change = entry->state_change;
+	row->wait_event_info = entry->wait_event_info;
+	row->state = ash_dict_string(entry->state_id);
+	row->backend_xid = entry->backend_xid;
+	row->backend_xmin = entry->backend_xmin;
+	row->top_level_query = NULL;
+	row->query = NULL;
+	row->cmdtype = ash_dict_string(entry->cmdtype_id);
+	row->queryid = entry->queryid;
+	row->backend_type = ash_dict_string(entry->backend_type_id);
+	row->blockers = entry->blockers;
+	row->blockerpid = entry->blockerpid;
+	row->blocker_state = ash_dict_string(entry->blocker_state_id);
+	row->root_blockerpid = entry->root_blockerpid;
+	row->blocker_depth = entry->blocker_depth;
+	row->sample_weight = entry->sample_weight;
+}
+
+/*
+ * Copy the dictionary strings of a row decoded from ash slot i into the scan,
+ * and tell whether the slot still holds the entry they come from: the ids of
+ * an entry can be reused once it is overwritten (see ash_dict_reclaim()).
+ */
+static bool
+ash_row_copy_strings(ashScanState *scan, ashRow *row, int i,
+					 const ashEntry *entry)
+{
+	const char **strings[ASH_ROW_DICT_STRINGS];
+	int n;
+
+	strings[0] = &row->datname;
+	strings[1] = &row->usename;
+	strings[2] = &row->application_name;
+	strings[3] = &row->client_addr;
+	strings[4] = &row->client_hostname;
+	strings[5] = &row->state;
+	strings[6] = &row->cmdtype;
+	strings[7] = &row->backend_type;
+	strings[8] = &row->blocker_state;
+
+	for (n = 0; n < ASH_ROW_DICT_STRINGS; n++)
+	{
+		if (*strings[n] == NULL)
+			continue;
+		strlcpy(scan->dict_strings[n], *strings[n], NAMEDATALEN);
+		*strings[n] = scan->dict_strings[n];
+	}
+
+	pg_read_barrier();
+	return AshEntryArray[i].changecount == entry->changecount;
+}
+
+/* Build the pg_active_session_history columns of an entry */
+static void
+ash_row_values(const ashRow *row, bool show_text, Datum *values, bool *nulls)
+{
+	int                     j = 0;
+	const char     *str;
+
+	// ash_time
+	values[j++] = TimestampTzGetDatum(row->ash_time);
+
+	// datid
+	if (ObjectIdGetDatum(row->datid))
+		values[j++] = ObjectIdGetDatum(row->datid);
+	else
+		nulls[j++] = true;
+
+	// datname
+	if (row->datname != NULL)
+		values[j++] = CStringGetTextDatum(row->datname);
+	else
+		nulls[j++] = true;
+
+	// pid
+	if (Int32GetDatum(row->pid))
+		values[j++] = Int32GetDatum(row->pid);
+	else
+		nulls[j++] = true;
+
+#if PG_VERSION_NUM >= 130000
+	// leader_pid
+	if (Int32GetDatum(row->leader_pid))
+		values[j++] = Int32GetDatum(row->leader_pid);
+	else
+		nulls[j++] = true;
+#else
+		nulls[j++] = true;
 #endif
 
-				/* client_port */
-				client_portvalue = DatumGetInt32(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,9, &isnull));
+	// usesysid
+	if (ObjectIdGetDatum(row->usesysid))
+		values[j++] = ObjectIdGetDatum(row->usesysid);
+	else
+		nulls[j++] = true;
+
+	// usename
+	if (row->usename != NULL)
+		values[j++] = CStringGetTextDatum(row->usename);
+	else
+		nulls[j++] = true;
+
+	// application_name
+	if (row->application_name != NULL)
+		values[j++] = CStringGetTextDatum(row->application_name);
+	else
+		nulls[j++] = true;
 
-				/* usename */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																	5, &isnull);
-				if (!isnull) {
-					usenamevalue = DatumGetCString(data);
-				}
+	// client_addr
+	if (row->client_addr != NULL)
+		values[j++] = CStringGetTextDatum(row->client_addr);
+	else
+		nulls[j++] = true;
 
-				/* appname */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																	6, &isnull);
-				if (!isnull) {
-					appnamevalue = TextDatumGetCString(data);
-				}
+	// client_hostname
+	if (row->client_hostname != NULL)
+		values[j++] = CStringGetTextDatum(row->client_hostname);
+	else
+		nulls[j++] = true;
 
-				/* wait_event_type */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																14, &isnull);
-				if (!isnull) {
-					wait_event_typevalue = TextDatumGetCString(data);
-				}
+	// client_port
+	if (Int32GetDatum(row->client_port))
+		values[j++] = Int32GetDatum(row->client_port);
+	else
+		nulls[j++] = true;
 
-				/* wait_event */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																15, &isnull);
-				if (!isnull) {
-					wait_eventvalue = TextDatumGetCString(data);
-				}
+	// backend_start
+	if (TimestampTzGetDatum(row->backend_start))
+		values[j++] = TimestampTzGetDatum(row->backend_start);
+	else
+		nulls[j++] = true;
 
-				/* state */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																16, &isnull);
-				if (!isnull) {
-					statevalue = TextDatumGetCString(data);
-				}
+	// xact_start
+	if (TimestampTzGetDatum(row->xact_start))
+		values[j++] = TimestampTzGetDatum(row->xact_start);
+	else
+		nulls[j++] = true;
 
-#if PG_VERSION_NUM >= 100000
-				/* blocker state */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																23, &isnull);
-				if (!isnull) {
-					blockerstatevalue = TextDatumGetCString(data);
-				}
+	// query_start
+	if (TimestampTzGetDatum(row->query_start))
+		values[j++] = TimestampTzGetDatum(row->query_start);
+	else
+		nulls[j++] = true;
 
-				/* queryid */
-				queryidvalue = DatumGetUInt64(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,25, &isnull));
+	// state_change
+	if (TimestampTzGetDatum(row->state_change))
+		values[j++] = TimestampTzGetDatum(row->state_change);
+	else
+		nulls[j++] = true;
 
-				/* gpi query */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																26, &isnull);
-				if (!isnull) {
-					gpi_queryvalue = TextDatumGetCString(data);
-				}
+	// wait_event_type
+	values[j++] = CStringGetTextDatum(ash_wait_event_type(row->wait_event_info));
+
+	// wait_event
+	if ((str = pgstat_get_wait_event(row->wait_event_info)) != NULL)
+		values[j++] = CStringGetTextDatum(str);
+	else
+		values[j++] = CStringGetTextDatum("CPU");
+
+	// state
+	if (row->state != NULL)
+		values[j++] = CStringGetTextDatum(row->state);
+	else
+		nulls[j++] = true;
+
+	// backend_xid
+	if (TransactionIdGetDatum(row->backend_xid))
+		values[j++] = TransactionIdGetDatum(row->backend_xid);
+	else
+		nulls[j++] = true;
+
+	// backend_xmin
+	if (TransactionIdGetDatum(row->backend_xmin))
+		values[j++] = TransactionIdGetDatum(row->backend_xmin);
+	else
+		nulls[j++] = true;
+
+	// top_level_query - apply privilege check
+	if (show_text)
+	{
+		if (row->top_level_query)
+			values[j++] = CStringGetTextDatum(row->top_level_query);
+		else
+			nulls[j++] = true;
+	}
+	else
+	{
+		values[j++] = CStringGetTextDatum("<insufficient privilege>");
+	}
+
+	// query - apply privilege check
+	if (show_text)
+	{
+		if (row->query)
+			values[j++] = CStringGetTextDatum(row->query);
+		else
+			nulls[j++] = true;
+	}
+	else
+	{
+		values[j++] = CStringGetTextDatum("<insufficient privilege>");
+	}
+
+	// cmdtype
+	if (row->cmdtype != NULL)
+                        values[j++] = CStringGetTextDatum(row->cmdtype);
+	else
+                        nulls[j++] = true;
+
+	// query_id - apply privilege check
+	if (show_text)
+	{
+		if (row->queryid)
+			values[j++] = Int64GetDatum(row->queryid);
+		else
+			nulls[j++] = true;
+	}
+	else
+	{
+		nulls[j++] = true;
+	}
+
+
+	// backend_type
+	if (row->backend_type != NULL)
+		values[j++] = CStringGetTextDatum(row->backend_type);
+	else
+		nulls[j++] = true;
+
+	// blockers
+	if (Int32GetDatum(row->blockers))
+		values[j++] = Int32GetDatum(row->blockers);
+	else
+		nulls[j++] = true;
+
+	// blockerspid
+	if (Int32GetDatum(row->blockerpid))
+		values[j++] = Int32GetDatum(row->blockerpid);
+	else
+		nulls[j++] = true;
+
+	// blocker state
+	if (row->blocker_state != NULL)
+		values[j++] = CStringGetTextDatum(row->blocker_state);
+	else
+		nulls[j++] = true;
+
+	// root blocker pid
+	if (row->root_blockerpid)
+		values[j++] = Int32GetDatum(row->root_blockerpid);
+	else
+		nulls[j++] = true;
+
+	// blocker depth
+	values[j++] = Int32GetDatum(row->blocker_depth);
+
+	// sample weight
+	values[j++] = Float8GetDatum(row->sample_weight);
+
+}
+
+/*
+ * Does a row pass the filters of the caller. The queryid of the rows
+ * the caller may not see never matches, else filtering on it would
+ * reveal it.
+ */
+static bool
+ash_row_matches(const ashRow *row, const ashScanState *scan)
+{
+	const ashFilter *filter = &scan->filter;
+
+	if (filter->has_pid && row->pid != filter->pid)
+		return false;
+	if (filter->has_datid && row->datid != filter->datid)
+		return false;
+	if (filter->has_usesysid && row->usesysid != filter->usesysid)
+		return false;
+	if (filter->has_queryid &&
+		(row->queryid != filter->queryid ||
+		 !(scan->is_allowed_role || row->usesysid == scan->userid)))
+		return false;
+	if (filter->wait_event_type != NULL &&
+		strcmp(ash_wait_event_type(row->wait_event_info),
+			   filter->wait_event_type) != 0)
+		return false;
+	if (filter->backend_type != NULL &&
+		(row->backend_type == NULL ||
+		 strcmp(row->backend_type, filter->backend_type) != 0))
+		return false;
+
+	return true;
+}
+
+/*
+ * First sequence number in [low, head] of an entry not older than from.
+ * Entries are written in ash_time order, and the worker overwrites the
+ * oldest ones first, so the ones overwritten meanwhile count as older.
+ */
+static uint64
+ash_seq_search(uint64 low, uint64 head, TimestampTz from)
+{
+	uint64 lo = low;
+	uint64 hi = head + 1;
 
-				/* cmdtype */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																27, &isnull);
-				if (!isnull) {
-					cmdtypevalue = TextDatumGetCString(data);
+	while (lo < hi)
+	{
+		uint64 mid = lo + (hi - lo) / 2;
+		ashEntry entry;
+
+		if (!ash_entry_fetch((mid - 1) % ash_max_entries, head, &entry) ||
+			entry.seq != mid || entry.ash_time < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Next entry of a pg_active_session_history scan passing its filters, with
+ * its query texts if the caller may see them (and the scan fetches them, the
+ * archived entries always have theirs).  Returns false at the end of the
+ * scan.
+ */
+static bool
+ash_scan_next(ashScanState *scan, ashRow *row)
+{
+	for (;;)
+	{
+		switch (scan->phase)
+		{
+			case ASH_SCAN_ARCHIVE:
+			case ASH_SCAN_MISSING:
+				while (scan->archive != NULL &&
+					   ash_archive_scan_next(scan->archive, row))
+				{
+					if (ash_row_matches(row, scan))
+						return true;
 				}
-#else
-				/* blocker state */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																22, &isnull);
-				if (!isnull) {
-					blockerstatevalue = TextDatumGetCString(data);
+				if (scan->archive != NULL)
+					ash_archive_end_scan(scan->archive);
+				scan->archive = NULL;
+				scan->phase = (scan->phase == ASH_SCAN_ARCHIVE) ?
+					ASH_SCAN_RING : ASH_SCAN_DONE;
+				break;
+
+			case ASH_SCAN_RING:
+				while (scan->seq <= scan->head)
+				{
+					uint64 seq = scan->seq++;
+					ashEntry entry;
+
+					/*
+					 * The worker overwrites the oldest entries first, those
+					 * it overwrote since the scan began are read from the
+					 * archive afterwards.
+					 */
+					if (!ash_entry_fetch((seq - 1) % ash_max_entries,
+										 scan->head, &entry) ||
+						entry.seq != seq)
+					{
+						if (scan->missing_lo == 0)
+							scan->missing_lo = seq;
+						scan->missing_hi = seq;
+						continue;
+					}
+
+					if (entry.ash_time > scan->to)
+					{
+						scan->seq = scan->head + 1;
+						break;
+					}
+
+					ash_entry_to_row(&entry, row);
+					if (!ash_row_copy_strings(scan, row,
+											  (seq - 1) % ash_max_entries,
+											  &entry))
+					{
+						/* overwritten meanwhile, as above */
+						if (scan->missing_lo == 0)
+							scan->missing_lo = seq;
+						scan->missing_hi = seq;
+						continue;
+					}
+
+					if (!ash_row_matches(row, scan))
+						continue;
+
+					/* texts only of the rows returned */
+					if (scan->query != NULL &&
+						(scan->is_allowed_role || entry.usesysid == scan->userid))
+					{
+						if (ash_qtext_fetch(&entry.top_level_query,
+											scan->top_level_query))
+							row->top_level_query = scan->top_level_query;
+						if (ash_qtext_fetch(&entry.query, scan->query))
+							row->query = scan->query;
+					}
+
+					return true;
 				}
 
-				/* queryid */
-				queryidvalue = DatumGetUInt64(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,24, &isnull));
+				if (ash_archive_flush_interval > 0 && scan->missing_lo != 0)
+				{
+					MemoryContext oldcontext;
 
-				/* gpi query */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																25, &isnull);
-				if (!isnull) {
-					gpi_queryvalue = TextDatumGetCString(data);
+					oldcontext = MemoryContextSwitchTo(scan->context);
+					scan->archive = ash_archive_begin_scan(scan->from, scan->to,
+														   scan->missing_lo,
+														   scan->missing_hi);
+					MemoryContextSwitchTo(oldcontext);
 				}
+				scan->phase = (scan->archive != NULL) ?
+					ASH_SCAN_MISSING : ASH_SCAN_DONE;
+				break;
 
-				/* cmdtype */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																26, &isnull);
-				if (!isnull) {
-					cmdtypevalue = TextDatumGetCString(data);
-				}
-#endif
+			case ASH_SCAN_DONE:
+				return false;
+		}
+	}
+}
 
-				/* client_hostname */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																	8, &isnull);
-				if (!isnull) {
-					client_hostnamevalue = TextDatumGetCString(data);
-				}
+/*
+ * Set up the state of the calls to a history function returning rows one
+ * at a time, in the multi-call memory context of the function.
+ */
+static ashScanState *
+ash_scan_begin(FunctionCallInfo fcinfo, TimestampTz from, TimestampTz to,
+			   const ashFilter *filter)
+{
+	FuncCallContext *funcctx;
+	MemoryContext oldcontext;
+	TupleDesc       tupdesc;
+	ashScanState *scan;
 
-				/* query */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																19, &isnull);
-				if (!isnull) {
-					queryvalue = TextDatumGetCString(data);
-				}
+	funcctx = SRF_FIRSTCALL_INIT();
+	oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
-#if PG_VERSION_NUM >= 100000
-				/* backend_type */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																20, &isnull);
-				if (!isnull) {
-					backend_typevalue = TextDatumGetCString(data);
-				}
-#endif
+	/* Build a tuple descriptor */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+	scan = palloc0(sizeof(ashScanState));
+	scan->from = from;
+	scan->to = to;
+	scan->filter = *filter;
+	if (filter->wait_event_type != NULL)
+		scan->filter.wait_event_type = pstrdup(filter->wait_event_type);
+	if (filter->backend_type != NULL)
+		scan->filter.backend_type = pstrdup(filter->backend_type);
+	scan->userid = GetUserId();
+	scan->is_allowed_role = IS_ALLOWED_ROLE(scan->userid);
+	scan->context = funcctx->multi_call_memory_ctx;
+	funcctx->user_fctx = scan;
 
-				/* client addr */
-				data=SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,
-																7, &isnull);
-				if (!isnull) {
-					clientaddrvalue = TextDatumGetCString(data);
-				}
+	MemoryContextSwitchTo(oldcontext);
+
+	return scan;
+}
+
+/*
+ * Position a scan of the ash entries at the first one of its range, in the
+ * archive or in the ring.
+ */
+static void
+ash_scan_start(ashScanState *scan, bool fetch_texts)
+{
+	MemoryContext oldcontext;
+	uint64 low;
+
+	/* Entry array must exist already */
+	if (!AshEntryArray)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("pg_active_session_history must be loaded via shared_preload_libraries")));
+
+	oldcontext = MemoryContextSwitchTo(scan->context);
+
+	scan->head = pg_atomic_read_u64(&IntEntryArray[0].ash_head);
+	pg_read_barrier();
+	low = scan->head > (uint64) ash_max_entries ?
+		scan->head - ash_max_entries + 1 : 1;
+
+	/* where the range starts in the ring */
+	scan->seq = (scan->from == DT_NOBEGIN) ?
+		low : ash_seq_search(low, scan->head, scan->from);
+
+	/*
+	 * Archived entries older than the ring, unless the range starts after
+	 * the oldest entry of the ring.
+	 */
+	if (ash_archive_flush_interval > 0 && scan->seq == low)
+		scan->archive = ash_archive_begin_scan(scan->from, scan->to, 1, low - 1);
+	scan->phase = (scan->archive != NULL) ? ASH_SCAN_ARCHIVE : ASH_SCAN_RING;
+
+	if (fetch_texts)
+	{
+		scan->top_level_query = palloc(pgstat_track_activity_query_size);
+		scan->query = palloc(pgstat_track_activity_query_size);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/* Begin a scan of the entries with ash_time in [from, to] */
+static void
+pg_active_session_history_begin(FunctionCallInfo fcinfo, TimestampTz from,
+								TimestampTz to, const ashFilter *filter)
+{
+	ashScanState *scan;
+
+	scan = ash_scan_begin(fcinfo, from, to, filter);
+	ash_scan_start(scan, true);
+}
+
+/* Next row of pg_active_session_history */
+static Datum
+pg_active_session_history_internal(FunctionCallInfo fcinfo)
+{
+	FuncCallContext *funcctx;
+	ashScanState *scan;
+	ashRow row;
+
+	funcctx = SRF_PERCALL_SETUP();
+	scan = (ashScanState *) funcctx->user_fctx;
 
-				/* backend xid */
-				backend_xidvalue = DatumGetTransactionId(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,17, &isnull));
+	if (ash_scan_next(scan, &row))
+	{
+		Datum           values[PG_ACTIVE_SESSION_HISTORY_COLS];
+		bool            nulls[PG_ACTIVE_SESSION_HISTORY_COLS];
+		bool            show_text;
+		HeapTuple       tuple;
 
-				/* backedn xmin */
-				backend_xminvalue = DatumGetTransactionId(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,18, &isnull));
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
 
-				/* backend start */
-				backend_startvalue = DatumGetTimestamp(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,10, &isnull));
+		show_text = scan->is_allowed_role || row.usesysid == scan->userid;
+		ash_row_values(&row, show_text, values, nulls);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
 
-				/* xact start */
-				xact_startvalue = DatumGetTimestamp(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,11, &isnull));
+	SRF_RETURN_DONE(funcctx);
+}
 
-				/* query start */
-				query_startvalue = DatumGetTimestamp(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,12, &isnull));
 
-				/* state change */
-				state_changevalue = DatumGetTimestamp(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,13, &isnull));
+/*
+ * Build the pg_stat_statements_history columns of an entry, with these
+ * counters (NULL if unknown)
+ */
+static void
+pgssh_entry_values(const pgsshEntry *entry, bool show_text,
+				   const pgsshCounters *counters, Datum *values, bool *nulls)
+{
+	int             j = 0;
 #if PG_VERSION_NUM >= 130000
-				/* leader pid */
-				leader_pidvalue = DatumGetInt32(SPI_getbinval(
-					SPI_tuptable->vals[i],SPI_tuptable->tupdesc,28, &isnull));
+	char        buf[256];
+	Datum       wal_bytes;
 #endif
 
-				/* prepare to store the entry */
-				ash_prepare_store(ash_time, pidvalue,
+	// ash_time
+	values[j++] = TimestampTzGetDatum(entry->ash_time);
+
+	// userid
+	if (ObjectIdGetDatum(entry->userid))
+		values[j++] = ObjectIdGetDatum(entry->userid);
+	else
+		nulls[j++] = true;
+
+	// dbid
+	if (ObjectIdGetDatum(entry->dbid))
+		values[j++] = ObjectIdGetDatum(entry->dbid);
+	else
+		nulls[j++] = true;
+
+	// query_id - apply privilege check
+	if (show_text)
+	{
+		if (Int64GetDatum(entry->queryid))
+			values[j++] = Int64GetDatum(entry->queryid);
+		else
+			nulls[j++] = true;
+	}
+	else
+	{
+		nulls[j++] = true;
+	}
+
+	if (counters == NULL)
+	{
+		while (j < PG_STAT_STATEMENTS_HISTORY_COLS)
+			nulls[j++] = true;
+		return;
+	}
+
+	// calls
+	if (Int64GetDatum(counters->calls))
+		values[j++] = Int64GetDatum(counters->calls);
+	else
+		values[j++] = 0;
+
+	// total_time
+	if (Float8GetDatum(counters->total_time))
+		values[j++] = Float8GetDatum(counters->total_time);
+	else
+		values[j++] = 0;
+
+	// rows
+	if (Int64GetDatum(counters->rows))
+		values[j++] = Int64GetDatum(counters->rows);
+	else
+		values[j++] = 0;
+
+	// shared_blks_hit
+	if (Int64GetDatum(counters->shared_blks_hit))
+		values[j++] = Int64GetDatum(counters->shared_blks_hit);
+	else
+		values[j++] = 0;
+
+	// shared_blks_read
+	if (Int64GetDatum(counters->shared_blks_read))
+		values[j++] = Int64GetDatum(counters->shared_blks_read);
+	else
+		values[j++] = 0;
+
+	// shared_blks_dirtied
+	if (Int64GetDatum(counters->shared_blks_dirtied))
+		values[j++] = Int64GetDatum(counters->shared_blks_dirtied);
+	else
+		values[j++] = 0;
+
+	// shared_blks_written
+	if (Int64GetDatum(counters->shared_blks_written))
+		values[j++] = Int64GetDatum(counters->shared_blks_written);
+	else
+		values[j++] = 0;
+
+	// local_blks_hit
+	if (Int64GetDatum(counters->local_blks_hit))
+		values[j++] = Int64GetDatum(counters->local_blks_hit);
+	else
+		values[j++] = 0;
+
+	// local_blks_read
+	if (Int64GetDatum(counters->local_blks_read))
+		values[j++] = Int64GetDatum(counters->local_blks_read);
+	else
+		values[j++] = 0;
+
+	// local_blks_dirtied
+	if (Int64GetDatum(counters->local_blks_dirtied))
+		values[j++] = Int64GetDatum(counters->local_blks_dirtied);
+	else
+		values[j++] = 0;
+
+	// local_blks_written
+	if (Int64GetDatum(counters->local_blks_written))
+		values[j++] = Int64GetDatum(counters->local_blks_written);
+	else
+		values[j++] = 0;
+
+	// temp_blks_read
+	if (Int64GetDatum(counters->temp_blks_read))
+		values[j++] = Int64GetDatum(counters->temp_blks_read);
+	else
+		values[j++] = 0;
+
+	// temp_blks_written
+	if (Int64GetDatum(counters->temp_blks_written))
+		values[j++] = Int64GetDatum(counters->temp_blks_written);
+	else
+		values[j++] = 0;
+
+	// blk_read_time
+	if (Float8GetDatum(counters->blk_read_time))
+		values[j++] = Float8GetDatum(counters->blk_read_time);
+	else
+		values[j++] = 0;
+
+	// blk_write_time
+	if (Float8GetDatum(counters->blk_write_time))
+		values[j++] = Float8GetDatum(counters->blk_write_time);
+	else
+		values[j++] = 0;
 #if PG_VERSION_NUM >= 130000
-									leader_pidvalue,
+	// plans
+	if (Int64GetDatum(counters->plans))
+		values[j++] = Int64GetDatum(counters->plans);
+	else
+		values[j++] = 0;
+
+	// total_plan_time
+	if (Float8GetDatum(counters->total_plan_time))
+		values[j++] = Float8GetDatum(counters->total_plan_time);
+	else
+		values[j++] = 0;
+
+	// wal_records
+	if (Int64GetDatum(counters->wal_records))
+		values[j++] = Int64GetDatum(counters->wal_records);
+	else
+		values[j++] = 0;
+
+	// wal_fpi
+	if (Int64GetDatum(counters->wal_fpi))
+		values[j++] = Int64GetDatum(counters->wal_fpi);
+	else
+		values[j++] = 0;
+
+	// wal_bytes
+	snprintf(buf, sizeof buf, UINT64_FORMAT, counters->wal_bytes);
+	/* Convert to numeric. */
+	wal_bytes = DirectFunctionCall3(numeric_in,
+									CStringGetDatum(buf),
+									ObjectIdGetDatum(0),
+									Int32GetDatum(-1));
+
+	values[j++] = wal_bytes;
+#else
+	nulls[j++] = true;
+	nulls[j++] = true;
+	nulls[j++] = true;
+	nulls[j++] = true;
+	nulls[j++] = true;
 #endif
-									usenamevalue ? usenamevalue : "\0",
-									client_portvalue, datidvalue,
-									datnamevalue ? datnamevalue : "\0",
-									appnamevalue ? appnamevalue : "\0",
-									clientaddrvalue ? clientaddrvalue : "\0",
-									backend_xminvalue, backend_startvalue,
-									xact_startvalue,query_startvalue,
-									state_changevalue,
-									wait_event_typevalue ? wait_event_typevalue : "\0",
-									wait_eventvalue ? wait_eventvalue : "\0",
-									statevalue ? statevalue : "\0",
-									client_hostnamevalue ? client_hostnamevalue : "\0",
-									queryvalue ? queryvalue : "\0",
-									backend_typevalue ? backend_typevalue : "\0",
-									usesysidvalue, backend_xidvalue,
-									blockersvalue, blockerpidvalue,
-									blockerstatevalue ? blockerstatevalue : "\0",
-									queryidvalue,
-									gpi_queryvalue ? gpi_queryvalue : "\0",
-									cmdtypevalue ? cmdtypevalue : "\0");
-			}
+}
+
+/*
+ * Next entry of the pgssh history in a scan, oldest first, up to the head of
+ * the scan.  *missed is set when entries were overwritten before they could
+ * be read.  Returns false at the end of the history.
+ */
+static bool
+pgssh_scan_fetch(ashScanState *scan, pgsshEntry *entry, bool *missed)
+{
+	volatile pgsshBlock *block;
+
+	*missed = false;
+
+	if (PgsshEntryArray)
+	{
+		while (scan->seq <= scan->head)
+		{
+			uint64 seq = scan->seq++;
+
+			if (pgssh_entry_fetch((seq - 1) % pgssh_max_entries, scan->head,
+								  entry) &&
+				entry->seq == seq)
+				return true;
+			*missed = true;
 		}
-		SPI_finish();
-		PopActiveSnapshot();
-		CommitTransactionCommand();
-		pgstat_report_activity(STATE_IDLE, NULL);
+		return false;
+	}
 
-		/* pg_stat_statement_history */
-		if (gotactives && pgssh_enable) 
+	for (;;)
+	{
+		if (scan->pgssh_pos < scan->pgssh_nentries)
 		{
-			SetCurrentStatementStartTimestamp();
-			StartTransactionCommand();
-			SPI_connect();
-			PushActiveSnapshot(GetTransactionSnapshot());
-			pgstat_report_activity(STATE_RUNNING, pg_stat_statements_query);
+			*entry = scan->pgssh_entries[scan->pgssh_pos++];
+			if (entry->seq > scan->head)
+				return false;
+			if (scan->seq != 0 && entry->seq != scan->seq)
+				*missed = true;
+			scan->seq = entry->seq + 1;
+			return true;
+		}
 
-			/* We can now execute queries via SPI */
-			ret = SPI_execute(pg_stat_statements_query,true, 0);
+		if (scan->pgssh_block_no > scan->pgssh_last_block)
+			return false;
+
+		/* a block reused meanwhile holds no entries for us */
+		block = &PgsshBlocks[(scan->pgssh_block_no - 1) % pgssh_nblocks()];
+		ASH_READ_SLOT(block, scan->pgssh_block);
+		scan->pgssh_nentries = 0;
+		scan->pgssh_pos = 0;
+		if (pgssh_block_entries(scan->pgssh_block, scan->pgssh_block_no,
+								scan->head) > 0)
+			scan->pgssh_nentries = pgssh_block_decode(scan->pgssh_block,
+													  scan->pgssh_entries);
+		scan->pgssh_block_no++;
+	}
+}
+
+/*
+ * Next entry of a pg_stat_statements_history scan passing its filters, with
+ * its cumulative counters or their deltas (see pgsshEntry) in counters.
+ * Checkpoint entries are not returned.  *has_counters is false when they
+ * can't be told: entries were overwritten while the scan read the ring, or
+ * the worker lost track of the query.  Returns false at the end of the scan.
+ */
+static bool
+pgssh_scan_next(ashScanState *scan, pgsshEntry *entry,
+				pgsshCounters *counters, bool *has_counters)
+{
+	bool missed;
+
+	if (scan->phase == ASH_SCAN_DONE)
+		return false;
+
+	while (pgssh_scan_fetch(scan, entry, &missed))
+	{
+		bool show_text;
+		pgsshKey key;
+		pgsshScanQuery *query;
+		bool found;
+
+		if (missed)
+		{
+			HASH_SEQ_STATUS status;
+
+			/* An entry was missed, the counters can't be rebuilt anymore */
+			hash_seq_init(&status, scan->pgssh_queries);
+			while ((query = (pgsshScanQuery *) hash_seq_search(&status)) != NULL)
+				query->known = false;
+		}
+
+		if (entry->ash_time > scan->to)
+			break;
+
+		show_text = scan->is_allowed_role || entry->userid == scan->userid;
+
+		if (scan->filter.has_usesysid && entry->userid != scan->filter.usesysid)
+			continue;
+		if (scan->filter.has_datid && entry->dbid != scan->filter.datid)
+			continue;
+		if (scan->filter.has_queryid &&
+			(entry->queryid != scan->filter.queryid || !show_text))
+			continue;
+
+		/*
+		 * Follow the counters of the query from the oldest entry, including
+		 * the ones before from.
+		 */
+		memset(&key, 0, sizeof(key));
+		key.userid = entry->userid;
+		key.dbid = entry->dbid;
+		key.queryid = entry->queryid;
+		query = (pgsshScanQuery *) hash_search(scan->pgssh_queries, &key,
+											   HASH_ENTER, &found);
+		if (!found)
+		{
+			query->known = false;
+			query->seq = 0;
+			query->anchor_seq = 0;
+		}
+
+		if (entry->checkpoint)
+		{
+			query->counters = entry->counters;
+			query->known = true;
+			query->anchor_seq = entry->seq;
+			continue;
+		}
+
+		query->seq = entry->seq;
+		if (entry->baseline)
+		{
+			query->anchor_seq = entry->seq;
+			*has_counters = query->known;
+			/* Statistics reset meanwhile, the counters restarted from 0 */
+			if (query->known &&
+				!pgssh_counters_sub(counters, &entry->counters,
+									&query->counters))
+				*counters = entry->counters;
+			query->counters = entry->counters;
+			query->known = true;
+		}
+		else
+		{
+			*has_counters = true;
+			*counters = entry->counters;
+			if (query->known)
+				pgssh_counters_add(&query->counters, &entry->counters);
+		}
+
+		if (entry->ash_time < scan->from)
+			continue;
+
+		if (!scan->pgssh_deltas)
+		{
+			*has_counters = query->known;
+			*counters = query->counters;
+		}
+		return true;
+	}
+
+	scan->phase = ASH_SCAN_DONE;
+	return false;
+}
+
+/*
+ * Find the cumulative counters of the queries whose oldest entries in the
+ * ring come before any of their baselines, from their first checkpoint: it
+ * holds the counters as of the entry before it, less the deltas read so far
+ * are the counters before the oldest entry.  Reads the ring once and leaves
+ * the scan at its oldest entry again.
+ */
+static void
+pgssh_scan_prepare(ashScanState *scan)
+{
+	uint64 seq = scan->seq;
+	uint64 block_no = scan->pgssh_block_no;
+	uint64 first_seq = 0;
+	pgsshEntry entry;
+	bool missed;
+
+	while (pgssh_scan_fetch(scan, &entry, &missed))
+	{
+		pgsshKey key;
+		pgsshScanQuery *query;
+		bool found;
+
+		if (first_seq == 0)
+			first_seq = entry.seq;
+
+		memset(&key, 0, sizeof(key));
+		key.userid = entry.userid;
+		key.dbid = entry.dbid;
+		key.queryid = entry.queryid;
+		query = (pgsshScanQuery *) hash_search(scan->pgssh_queries, &key,
+											   HASH_ENTER, &found);
+		if (!found)
+		{
+			query->known = false;
+			query->prepared = false;
+			query->seq = 0;
+			query->anchor_seq = 0;
+			memset(&query->counters, 0, sizeof(pgsshCounters));
+		}
+		if (query->prepared)
+			continue;
+
+		if (entry.checkpoint)
+		{
+			query->prepared = true;
+			query->known = pgssh_counters_sub(&query->counters,
+											  &entry.counters,
+											  &query->counters);
+		}
+		else if (entry.baseline)
+			query->prepared = true;
+		else
+			pgssh_counters_add(&query->counters, &entry.counters);
+	}
+
+	/* the queries having no checkpoint start unknown */
+	scan->seq = PgsshBlocks ? first_seq : seq;
+	scan->pgssh_block_no = block_no;
+	scan->pgssh_nentries = 0;
+	scan->pgssh_pos = 0;
+}
+
+/* Position a scan at the oldest entry of the pgssh history */
+static void
+pgssh_scan_start(ashScanState *scan, bool deltas)
+{
+	HASHCTL info;
 
-			if (ret != SPI_OK_SELECT)
-				elog(FATAL, "cannot select from pg_stat_statements: error code %d", ret);
+	scan->head = pg_atomic_read_u64(&IntEntryArray[0].pgssh_head);
+	pg_read_barrier();
 
-			/* Do some processing */
-			if (SPI_processed > 0)
-			{
-				for (i = 0; i < SPI_processed; i++)
-				{
-					bool isnull;
-					IntEntryArray[0].pgsshinserted=(IntEntryArray[0].pgsshinserted % pgssh_max_entries) + 1;
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].ash_time=ash_time;
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].userid=DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,1, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].dbid=DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,2, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].queryid=DatumGetUInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,3, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].calls=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,4, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].total_time=DatumGetFloat8(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,5, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].rows=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,6, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].shared_blks_hit=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,7, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].shared_blks_read=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,8, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].shared_blks_dirtied=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,9, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].shared_blks_written=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,10, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].local_blks_hit=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,11, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].local_blks_read=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,12, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].local_blks_dirtied=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,13, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].local_blks_written=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,14, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].temp_blks_read=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,15, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].temp_blks_written=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,16, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].blk_read_time=DatumGetFloat8(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,17, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].blk_write_time=DatumGetFloat8(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,18, &isnull));
-#if PG_VERSION_NUM >= 130000
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].plans=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,19, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].total_plan_time=DatumGetFloat8(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,20, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].wal_records=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,21, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].wal_fpi=DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,22, &isnull));
-					PgsshEntryArray[IntEntryArray[0].pgsshinserted-1].wal_bytes=DatumGetUInt64(SPI_getbinval(SPI_tuptable->vals[i],SPI_tuptable->tupdesc,23, &isnull));
-#endif
-				}
-			}
-			SPI_finish();
-			PopActiveSnapshot();
-			CommitTransactionCommand();
-			pgstat_report_activity(STATE_IDLE, NULL);
-		}
-		MemoryContextReset(pgsentinel_loop_context);
+	/* oldest entries first, to rebuild the counters */
+	if (PgsshBlocks)
+	{
+		/* see ash_publish_entries() */
+		scan->pgssh_last_block =
+			pg_atomic_read_u64(&IntEntryArray[0].pgssh_block_head);
+		scan->pgssh_block_no = pgssh_first_block(scan->pgssh_last_block);
+		scan->pgssh_block = MemoryContextAlloc(scan->context,
+											   sizeof(pgsshBlock));
+		scan->pgssh_entries = MemoryContextAlloc(scan->context,
+												 sizeof(pgsshEntry) *
+												 PGSSH_BLOCK_MAX_ENTRIES);
+		scan->seq = 0;			/* taken from the first entry */
 	}
-	/* No problems, so clean exit */
-	MemoryContextSwitchTo(saved_context);
-	proc_exit(0);
+	else
+		scan->seq = scan->head > (uint64) pgssh_max_entries ?
+			scan->head - pgssh_max_entries + 1 : 1;
+	scan->phase = ASH_SCAN_RING;
+
+	scan->pgssh_deltas = deltas;
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(pgsshKey);
+	info.entrysize = sizeof(pgsshScanQuery);
+	info.hcxt = scan->context;
+	scan->pgssh_queries = hash_create("pgsentinel pgssh scan", 1024, &info,
+									  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	pgssh_scan_prepare(scan);
 }
 
+/* Begin a scan of the pgssh entries with ash_time in [from, to] */
 static void
-pgsentinel_load_params(void)
+pg_stat_statements_history_begin(FunctionCallInfo fcinfo, TimestampTz from,
+								 TimestampTz to, const ashFilter *filter,
+								 bool deltas)
 {
+	ashScanState *scan;
 
-	DefineCustomIntVariable("pgsentinel_ash.sampling_period",
-							"Duration between each pull (in seconds).",
-							NULL,
-							&ash_sampling_period,
-							1,
-							1,
-							INT_MAX,
-							PGC_SIGHUP,
-							0,
-							NULL,
-							NULL,
-							NULL);
+	if (!pgssh_enable)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("pg_stat_statements_history not enabled, set pgsentinel_pgssh.enable")));
+	/* Entry array must exist already */
+	if (!PgsshEntryArray && !PgsshBlocks)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("pg_stat_statements_history must be loaded via shared_preload_libraries")));
 
-	DefineCustomBoolVariable("pgsentinel_ash.track_idle_trans",
-	                        "Track session in idle transaction state.",
-							NULL,
-							&ash_track_idle_trans,
-							false,
-							PGC_SIGHUP,
-							0,
-							NULL,
-							NULL,
-							NULL);
+	scan = ash_scan_begin(fcinfo, from, to, filter);
+	pgssh_scan_start(scan, deltas);
+}
 
-	if (!process_shared_preload_libraries_in_progress)
+/*
+ * Rebuild the last counters of the queries from the ring when the worker
+ * starts, so that their next entries follow the ones already there, and
+ * these keep their checkpoints.
+ */
+static void
+pgssh_load_last(void)
+{
+	ashScanState scan;
+	pgsshEntry entry;
+	pgsshCounters counters;
+	bool has_counters;
+	HASH_SEQ_STATUS status;
+	pgsshScanQuery *query;
+
+	if (!PgsshEntryArray && !PgsshBlocks)
 		return;
 
-	/* can't define PGC_POSTMASTER variable after startup */
-	DefineCustomIntVariable("pgsentinel_ash.max_entries",
-							"Maximum number of ash entries.",
-							NULL,
-							&ash_max_entries,
-							1000,
-							1000,
-							INT_MAX,
-							PGC_POSTMASTER,
-							0,
-							NULL,
-							NULL,
-							NULL);
+	memset(&scan, 0, sizeof(scan));
+	scan.from = DT_NOBEGIN;
+	scan.to = DT_NOEND;
+	scan.is_allowed_role = true;
+	scan.context = CurrentMemoryContext;
+	pgssh_scan_start(&scan, false);
+	while (pgssh_scan_next(&scan, &entry, &counters, &has_counters))
+		;
+
+	pgssh_last_init();
+	hash_seq_init(&status, scan.pgssh_queries);
+	while ((query = (pgsshScanQuery *) hash_seq_search(&status)) != NULL)
+	{
+		pgsshLastEntry *last;
+
+		if (!query->known || query->seq == 0)
+			continue;
+		last = (pgsshLastEntry *) hash_search(PgsshLastHash, &query->key,
+											  HASH_ENTER, NULL);
+		last->seq = query->seq;
+		last->anchor_seq = query->anchor_seq;
+		last->counters = query->counters;
+	}
+	hash_destroy(scan.pgssh_queries);
+}
 
-	EmitWarningsOnPlaceholders("pgsentinel_ash");
+/* Next row of pg_stat_statements_history */
+static Datum
+pg_stat_statements_history_internal(FunctionCallInfo fcinfo)
+{
+	FuncCallContext *funcctx;
+	ashScanState *scan;
+	pgsshEntry entry;
+	pgsshCounters counters;
+	bool has_counters;
 
-	DefineCustomIntVariable("pgsentinel_pgssh.max_entries",
-							"Maximum number of pgssh entries.",
-							NULL,
-							&pgssh_max_entries,
-							10000,
-							10000,
-							INT_MAX,
-							PGC_POSTMASTER,
-							0,
-							NULL,
-							NULL,
-							NULL);
+	funcctx = SRF_PERCALL_SETUP();
+	scan = (ashScanState *) funcctx->user_fctx;
 
-	DefineCustomBoolVariable("pgsentinel_pgssh.enable",
-	                        "Enable pg_stat_statements_history.",
-							NULL,
-							&pgssh_enable,
-							false,
-							PGC_POSTMASTER,
-							0,
-							NULL,
-							NULL,
-							NULL);
+	if (pgssh_scan_next(scan, &entry, &counters, &has_counters))
+	{
+		Datum           values[PG_STAT_STATEMENTS_HISTORY_COLS];
+		bool            nulls[PG_STAT_STATEMENTS_HISTORY_COLS];
+		bool            show_text;
+		HeapTuple       tuple;
 
-	EmitWarningsOnPlaceholders("pgsentinel_pgssh");
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
 
-	DefineCustomStringVariable("pgsentinel.db_name",
-							gettext_noop("Database on which the worker connect."),
-							NULL,
-							&pgsentinelDbName,
-							"postgres",
-							PGC_POSTMASTER,
-							GUC_SUPERUSER_ONLY,
-							NULL, NULL, NULL);
+		show_text = scan->is_allowed_role || entry.userid == scan->userid;
+		pgssh_entry_values(&entry, show_text,
+						   has_counters ? &counters : NULL, values, nulls);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
 }
 
 /*
- * Entry point for worker loading
+ * First sequence number in [low, head] of a summary row whose bucket is not
+ * older than from, see ash_seq_search().
  */
-void
-_PG_init(void)
+static uint64
+ash_summary_seq_search(uint64 low, uint64 head, TimestampTz from)
 {
+	uint64 lo = low;
+	uint64 hi = head + 1;
 
-	BackgroundWorker worker;
+	while (lo < hi)
+	{
+		uint64 mid = lo + (hi - lo) / 2;
+		ashSummaryEntry entry;
 
-	if (IsBinaryUpgrade)
-		return;
+		if (!ash_summary_fetch((mid - 1) % ash_summary_max_entries, head, &entry) ||
+			entry.seq != mid || entry.key.bucket < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	/* Add parameters */
-	pgsentinel_load_params();
+	return lo;
+}
 
-	if (!process_shared_preload_libraries_in_progress)
-		return;
+/*
+ * Next row of a pg_active_session_history_summary scan.  Returns false at
+ * the end of the scan.
+ */
+static bool
+ash_summary_scan_next(ashScanState *scan, ashSummaryEntry *entry,
+					  const char **backend_type)
+{
+	while (scan->seq <= scan->head)
+	{
+		uint64 seq = scan->seq++;
+		int i = (seq - 1) % ash_summary_max_entries;
 
-#if PG_VERSION_NUM < 150000
-	ash_shmem_request();
-#endif
+		if (!ash_summary_fetch(i, scan->head, entry) || entry->seq != seq)
+			continue;
 
-	/*
-	 * Install hooks.
-	 */
-#if PG_VERSION_NUM >= 150000
-	ash_prev_shmem_request_hook = shmem_request_hook;
-	shmem_request_hook = ash_shmem_request;
-#endif
-	ash_prev_shmem_startup_hook = shmem_startup_hook;
-	shmem_startup_hook = ash_shmem_startup;
-	prev_post_parse_analyze_hook = post_parse_analyze_hook;
-	post_parse_analyze_hook = getparsedinfo_post_parse_analyze;
+		if (entry->key.bucket < scan->from)
+			continue;
+		if (entry->key.bucket > scan->to)
+			break;
 
-	/* Worker parameter and registration */
-	memset(&worker, 0, sizeof(worker));
-	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
-		BGWORKER_BACKEND_DATABASE_CONNECTION;
-	worker.bgw_start_time = BgWorkerStart_ConsistentState;
-#if PG_VERSION_NUM >= 100000
-	sprintf(worker.bgw_library_name, "pgsentinel");
-	sprintf(worker.bgw_function_name, "pgsentinel_main");
-#else
-	worker.bgw_main = pgsentinel_main;
-#endif
-	snprintf(worker.bgw_name, BGW_MAXLEN, "%s", worker_name);
-	/* Wait ash_restart_wait_time seconds for restart before crash */
-	worker.bgw_restart_time = ash_restart_wait_time;
-	worker.bgw_main_arg = (Datum) 0;
-#if PG_VERSION_NUM >= 90400
-	/*
-	 * Notify PID is present since 9.4. If this is not initialized
-	 * a static background worker cannot start properly.
-	 */
-	worker.bgw_notify_pid = 0;
-#endif
-	RegisterBackgroundWorker(&worker);
+		/*
+		 * The row keeps its key until it is overwritten, see
+		 * ash_row_copy_strings().
+		 */
+		*backend_type = ash_dict_string(entry->key.backend_type_id);
+		if (*backend_type != NULL)
+		{
+			strlcpy(scan->dict_strings[0], *backend_type, NAMEDATALEN);
+			*backend_type = scan->dict_strings[0];
+			pg_read_barrier();
+			if (AshSummaryArray[i].seq != seq)
+				continue;
+		}
+
+		return true;
+	}
+
+	scan->seq = scan->head + 1;
+	return false;
 }
 
+/*
+ * Begin a scan of the summary rows with their bucket starting in [from, to],
+ * and not older than pgsentinel_ash.summary_retention.
+ */
 static void
-pg_active_session_history_internal(FunctionCallInfo fcinfo)
+pg_active_session_history_summary_begin(FunctionCallInfo fcinfo,
+										TimestampTz from, TimestampTz to)
 {
-	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	TupleDesc       tupdesc;
-	Tuplestorestate *tupstore;
-	MemoryContext per_query_ctx;
-	MemoryContext oldcontext;
-	int i;
-	Oid         userid = GetUserId();
-	bool        is_allowed_role = IS_ALLOWED_ROLE(userid);
+	ashScanState *scan;
+	ashFilter filter;
+	TimestampTz oldest;
+	uint64 low;
 
 	/* Entry array must exist already */
 	if (!AshEntryArray)
 		ereport(ERROR,
 			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				errmsg("pg_active_session_history must be loaded via shared_preload_libraries")));
-
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+				errmsg("pg_active_session_history_summary must be loaded via shared_preload_libraries")));
+	if (!AshSummaryArray)
 		ereport(ERROR,
-			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				errmsg("set-valued function called in context that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				errmsg("materialize mode required, but it is not " \
-					   "allowed in this context")));
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("pg_active_session_history_summary not enabled, set pgsentinel_ash.summary_max_entries")));
 
-	/* Switch context to construct returned data structures */
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	oldest = GetCurrentTimestamp() - (int64) ash_summary_retention * USECS_PER_SEC;
+	if (from < oldest)
+		from = oldest;
 
-	/* Build a tuple descriptor */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+	memset(&filter, 0, sizeof(filter));
+	scan = ash_scan_begin(fcinfo, from, to, &filter);
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+	scan->head = pg_atomic_read_u64(&IntEntryArray[0].summary_head);
+	pg_read_barrier();
+	low = scan->head > (uint64) ash_summary_max_entries ?
+		scan->head - ash_summary_max_entries + 1 : 1;
 
-	MemoryContextSwitchTo(oldcontext);
+	scan->seq = ash_summary_seq_search(low, scan->head, from);
+	scan->phase = ASH_SCAN_RING;
+}
 
-	for (i = 0; i < ash_max_entries; i++)
+/* Next row of pg_active_session_history_summary */
+static Datum
+pg_active_session_history_summary_internal(FunctionCallInfo fcinfo)
+{
+	FuncCallContext *funcctx;
+	ashScanState *scan;
+	ashSummaryEntry entry;
+	const char *backend_type;
+
+	funcctx = SRF_PERCALL_SETUP();
+	scan = (ashScanState *) funcctx->user_fctx;
+
+	if (ash_summary_scan_next(scan, &entry, &backend_type))
 	{
-		Datum           values[PG_ACTIVE_SESSION_HISTORY_COLS];
-		bool            nulls[PG_ACTIVE_SESSION_HISTORY_COLS];
-		int                     j = 0;
-		bool            show_text;
+		Datum           values[PG_ACTIVE_SESSION_HISTORY_SUMMARY_COLS];
+		bool            nulls[PG_ACTIVE_SESSION_HISTORY_SUMMARY_COLS];
+		int             j = 0;
+		const char     *str;
+		HeapTuple       tuple;
 
 		memset(values, 0, sizeof(values));
 		memset(nulls, 0, sizeof(nulls));
 
-		// ash_time
-		if (TimestampTzGetDatum(AshEntryArray[i].ash_time))
-			values[j++] = TimestampTzGetDatum(AshEntryArray[i].ash_time);
-		else
-			break;
+		// bucket_start
+		values[j++] = TimestampTzGetDatum(entry.key.bucket);
 
 		// datid
-		if (ObjectIdGetDatum(AshEntryArray[i].datid))
-			values[j++] = ObjectIdGetDatum(AshEntryArray[i].datid);
+		if (ObjectIdGetDatum(entry.key.datid))
+			values[j++] = ObjectIdGetDatum(entry.key.datid);
 		else
 			nulls[j++] = true;
 
-		// datname
-		if (AshEntryArray[i].datname[0] != '\0')
-			values[j++] = CStringGetTextDatum(AshEntryArray[i].datname);
+		// queryid - the rows are not per user, so only for the allowed roles
+		if (scan->is_allowed_role && entry.key.queryid != 0)
+			values[j++] = Int64GetDatum(entry.key.queryid);
 		else
 			nulls[j++] = true;
 
-		// pid
-		if (Int32GetDatum(AshEntryArray[i].pid))
-			values[j++] = Int32GetDatum(AshEntryArray[i].pid);
-		else
-			nulls[j++] = true;
+		// wait_event_type
+		values[j++] = CStringGetTextDatum(ash_wait_event_type(entry.key.wait_event_info));
 
-#if PG_VERSION_NUM >= 130000
-		// leader_pid
-		if (Int32GetDatum(AshEntryArray[i].leader_pid))
-			values[j++] = Int32GetDatum(AshEntryArray[i].leader_pid);
+		// wait_event
+		if ((str = pgstat_get_wait_event(entry.key.wait_event_info)) != NULL)
+			values[j++] = CStringGetTextDatum(str);
 		else
-			nulls[j++] = true;
-#else
-			nulls[j++] = true;
-#endif
+			values[j++] = CStringGetTextDatum("CPU");
 
-		// usesysid
-		if (ObjectIdGetDatum(AshEntryArray[i].usesysid))
-			values[j++] = ObjectIdGetDatum(AshEntryArray[i].usesysid);
+		// backend_type
+		if (backend_type != NULL)
+			values[j++] = CStringGetTextDatum(backend_type);
 		else
 			nulls[j++] = true;
 
-		// usename
-		if (AshEntryArray[i].usename[0] != '\0')
-			values[j++] = CStringGetTextDatum(AshEntryArray[i].usename);
-		else
-			nulls[j++] = true;
+		// samples
+		values[j++] = Int64GetDatum(entry.samples);
 
-		// application_name
-		if (AshEntryArray[i].application_name[0] != '\0')
-			values[j++] = CStringGetTextDatum(AshEntryArray[i].application_name);
-		else
-			nulls[j++] = true;
+		// sample_weight
+		values[j++] = Float8GetDatum(entry.sample_weight);
 
-		// client_addr
-		if (AshEntryArray[i].client_addr[0] != '\0')
-			values[j++] = CStringGetTextDatum(AshEntryArray[i].client_addr);
-		else
-			nulls[j++] = true;
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
 
-		// client_hostname
-		if (AshEntryArray[i].client_hostname[0] != '\0')
-			values[j++] = CStringGetTextDatum(AshEntryArray[i].client_hostname);
-		else
-			nulls[j++] = true;
+	SRF_RETURN_DONE(funcctx);
+}
 
-		// client_port
-		if (Int32GetDatum(AshEntryArray[i].client_port))
-			values[j++] = Int32GetDatum(AshEntryArray[i].client_port);
-		else
-			nulls[j++] = true;
+/* Groups of the ash_top_* functions */
+typedef enum ashTopKind
+{
+	ASH_TOP_QUERIES,			/* by queryid */
+	ASH_TOP_WAITS,				/* by wait_event_info */
+	ASH_TOP_SESSIONS			/* by pid and backend_start */
+} ashTopKind;
 
-		// backend_start
-		if (TimestampTzGetDatum(AshEntryArray[i].backend_start))
-			values[j++] = TimestampTzGetDatum(AshEntryArray[i].backend_start);
-		else
-			nulls[j++] = true;
+/* ash_top_* group key, hashed as a blob so always zeroed first */
+typedef struct ashTopKey
+{
+	uint64 id;					/* queryid, wait_event_info or pid */
+	TimestampTz backend_start;
+} ashTopKey;
 
-		// xact_start
-		if (TimestampTzGetDatum(AshEntryArray[i].xact_start))
-			values[j++] = TimestampTzGetDatum(AshEntryArray[i].xact_start);
-		else
-			nulls[j++] = true;
+typedef struct ashTopEntry
+{
+	ashTopKey key;				/* hash key, must be first */
+	int64 samples;
+	double sample_weight;
+	char *usename;
+	char *backend_type;
+	char *query;
+} ashTopEntry;
 
-		// query_start
-		if (TimestampTzGetDatum(AshEntryArray[i].query_start))
-			values[j++] = TimestampTzGetDatum(AshEntryArray[i].query_start);
-		else
-			nulls[j++] = true;
+/* Result of an ash_top_* function, returned one group at a time */
+typedef struct ashTopResult
+{
+	ashTopKind kind;
+	double total;				/* weight of the samples in the range */
+	ashTopEntry **groups;		/* by decreasing weight of their samples */
+} ashTopResult;
+
+/* Text of a queryid in the query text store, NULL if it is not there */
+static char *
+ash_qtext_lookup(uint64 queryid)
+{
+	ashQueryTextRef ref;
+	char *buf = palloc(pgstat_track_activity_query_size);
+	int i;
 
-		// state_change
-		if (TimestampTzGetDatum(AshEntryArray[i].state_change))
-			values[j++] = TimestampTzGetDatum(AshEntryArray[i].state_change);
-		else
-			nulls[j++] = true;
+	memset(&ref, 0, sizeof(ref));
+	ref.key.id = queryid;
+	ref.key.kind = ASH_QTEXT_QUERYID;
+
+	/* unlocked peek at the keys, ash_qtext_fetch() checks them again */
+	for (i = 0; i < ash_max_query_texts; i++)
+	{
+		if (AshQueryTextSlots[i].key.kind != ASH_QTEXT_QUERYID ||
+			AshQueryTextSlots[i].key.id != queryid)
+			continue;
+
+		ref.slot = i;
+		if (ash_qtext_fetch(&ref, buf))
+			return buf;
+	}
+
+	pfree(buf);
+	return NULL;
+}
+
+/* qsort comparator of the ash_top_* groups, heaviest samples first */
+static int
+ash_top_cmp(const void *a, const void *b)
+{
+	const ashTopEntry *ga = *(ashTopEntry *const *) a;
+	const ashTopEntry *gb = *(ashTopEntry *const *) b;
+
+	if (ga->sample_weight != gb->sample_weight)
+		return ga->sample_weight > gb->sample_weight ? -1 : 1;
+	if (ga->samples != gb->samples)
+		return ga->samples > gb->samples ? -1 : 1;
+	if (ga->key.id != gb->key.id)
+		return ga->key.id < gb->key.id ? -1 : 1;
+	if (ga->key.backend_start != gb->key.backend_start)
+		return ga->key.backend_start < gb->key.backend_start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Count the samples of the entries with ash_time in [from, to] per group,
+ * straight from the ring (and the archive), and keep the n groups with the
+ * most samples, by weight (see ash_sample_end()).  Only the groups returned
+ * get their query text.
+ */
+static void
+ash_top_begin(FunctionCallInfo fcinfo, ashTopKind kind)
+{
+	FuncCallContext *funcctx;
+	MemoryContext oldcontext;
+	TimestampTz from = DT_NOBEGIN;
+	TimestampTz to = DT_NOEND;
+	int n = -1;
+	ashFilter filter;
+	ashScanState *scan;
+	ashTopResult *result;
+	ashTopEntry *group;
+	HASHCTL info;
+	HTAB *groups;
+	HASH_SEQ_STATUS status;
+	ashRow row;
+	int ngroups = 0;
+	int i;
 
-		// wait_event_type
-		if (AshEntryArray[i].wait_event_type[0] != '\0')
-			values[j++] = CStringGetTextDatum(AshEntryArray[i].wait_event_type);
-		else
-			nulls[j++] = true;
+	/* ash_top_*(from_time, to_time, n), NULL for no bound or limit */
+	if (!PG_ARGISNULL(0))
+		from = PG_GETARG_TIMESTAMPTZ(0);
+	if (!PG_ARGISNULL(1))
+		to = PG_GETARG_TIMESTAMPTZ(1);
+	if (!PG_ARGISNULL(2))
+	{
+		n = PG_GETARG_INT32(2);
+		if (n < 0)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					errmsg("n must not be negative")));
+	}
 
-		// wait_event
-		if (AshEntryArray[i].wait_event[0] != '\0')
-			values[j++] = CStringGetTextDatum(AshEntryArray[i].wait_event);
-		else
-			nulls[j++] = true;
+	memset(&filter, 0, sizeof(filter));
+	scan = ash_scan_begin(fcinfo, from, to, &filter);
+	ash_scan_start(scan, false);
 
-		// state
-		if (AshEntryArray[i].state[0] != '\0')
-			values[j++] = CStringGetTextDatum(AshEntryArray[i].state);
-		else
-			nulls[j++] = true;
+	funcctx = SRF_PERCALL_SETUP();
+	oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
-		// backend_xid
-		if (TransactionIdGetDatum(AshEntryArray[i].backend_xid))
-			values[j++] = TransactionIdGetDatum(AshEntryArray[i].backend_xid);
-		else
-			nulls[j++] = true;
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(ashTopKey);
+	info.entrysize = sizeof(ashTopEntry);
+	info.hcxt = CurrentMemoryContext;
+	groups = hash_create("pgsentinel top groups", 1024, &info,
+						 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 
-		// backend_xmin
-		if (TransactionIdGetDatum(AshEntryArray[i].backend_xmin))
-			values[j++] = TransactionIdGetDatum(AshEntryArray[i].backend_xmin);
-		else
-			nulls[j++] = true;
+	result = palloc0(sizeof(ashTopResult));
+	result->kind = kind;
 
-		show_text = is_allowed_role || AshEntryArray[i].usesysid == userid;
+	while (ash_scan_next(scan, &row))
+	{
+		ashTopKey key;
+		bool show_text = scan->is_allowed_role || row.usesysid == scan->userid;
+		bool found;
 
-		// top_level_query - apply privilege check
-		if (show_text)
+		memset(&key, 0, sizeof(key));
+		switch (kind)
 		{
-			if (AshEntryArray[i].top_level_query[0] != '\0')
-				values[j++] = CStringGetTextDatum(AshEntryArray[i].top_level_query);
-			else
-				nulls[j++] = true;
+			case ASH_TOP_QUERIES:
+				/* the queries the caller may not see are counted together */
+				key.id = show_text ? row.queryid : 0;
+				break;
+			case ASH_TOP_WAITS:
+				key.id = row.wait_event_info;
+				break;
+			case ASH_TOP_SESSIONS:
+				key.id = (uint64) row.pid;
+				key.backend_start = row.backend_start;
+				break;
 		}
-		else
+
+		group = (ashTopEntry *) hash_search(groups, &key, HASH_ENTER, &found);
+		if (!found)
 		{
-			values[j++] = CStringGetTextDatum("<insufficient privilege>");
+			group->samples = 0;
+			group->sample_weight = 0;
+			group->usename = row.usename ? pstrdup(row.usename) : NULL;
+			group->backend_type = row.backend_type ? pstrdup(row.backend_type) : NULL;
+			/* the archived entries come with their text */
+			group->query = (kind == ASH_TOP_QUERIES && key.id != 0 && row.query) ?
+				pstrdup(row.query) : NULL;
+			ngroups++;
 		}
+		group->samples++;
+		group->sample_weight += row.sample_weight;
+		result->total += row.sample_weight;
+
+		CHECK_FOR_INTERRUPTS();
+	}
 
-		// query - apply privilege check
-		if (show_text)
+	result->groups = palloc(sizeof(ashTopEntry *) * Max(ngroups, 1));
+	ngroups = 0;
+	hash_seq_init(&status, groups);
+	while ((group = (ashTopEntry *) hash_seq_search(&status)) != NULL)
+		result->groups[ngroups++] = group;
+
+	qsort(result->groups, ngroups, sizeof(ashTopEntry *), ash_top_cmp);
+	if (n >= 0 && ngroups > n)
+		ngroups = n;
+
+	if (kind == ASH_TOP_QUERIES)
+	{
+		for (i = 0; i < ngroups; i++)
 		{
-			if (AshEntryArray[i].query[0] != '\0')
-				values[j++] = CStringGetTextDatum(AshEntryArray[i].query);
-			else
-				nulls[j++] = true;
+			group = result->groups[i];
+			if (group->query == NULL && group->key.id != 0)
+				group->query = ash_qtext_lookup(group->key.id);
 		}
-		else
+	}
+
+	funcctx->user_fctx = result;
+	funcctx->max_calls = ngroups;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/* Next row of an ash_top_* function */
+static Datum
+ash_top_internal(FunctionCallInfo fcinfo)
+{
+	FuncCallContext *funcctx;
+	ashTopResult *result;
+
+	funcctx = SRF_PERCALL_SETUP();
+	result = (ashTopResult *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		ashTopEntry *group = result->groups[funcctx->call_cntr];
+		Datum           values[ASH_TOP_MAX_COLS];
+		bool            nulls[ASH_TOP_MAX_COLS];
+		int             j = 0;
+		const char     *str;
+		HeapTuple       tuple;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		switch (result->kind)
 		{
-			values[j++] = CStringGetTextDatum("<insufficient privilege>");
+			case ASH_TOP_QUERIES:
+				// queryid
+				if (group->key.id != 0)
+					values[j++] = Int64GetDatum((int64) group->key.id);
+				else
+					nulls[j++] = true;
+				break;
+
+			case ASH_TOP_WAITS:
+				// wait_event_type
+				values[j++] = CStringGetTextDatum(ash_wait_event_type((uint32) group->key.id));
+
+				// wait_event
+				if ((str = pgstat_get_wait_event((uint32) group->key.id)) != NULL)
+					values[j++] = CStringGetTextDatum(str);
+				else
+					values[j++] = CStringGetTextDatum("CPU");
+				break;
+
+			case ASH_TOP_SESSIONS:
+				// pid
+				values[j++] = Int32GetDatum((int32) group->key.id);
+
+				// backend_start
+				if (TimestampTzGetDatum(group->key.backend_start))
+					values[j++] = TimestampTzGetDatum(group->key.backend_start);
+				else
+					nulls[j++] = true;
+
+				// usename
+				if (group->usename != NULL)
+					values[j++] = CStringGetTextDatum(group->usename);
+				else
+					nulls[j++] = true;
+
+				// backend_type
+				if (group->backend_type != NULL)
+					values[j++] = CStringGetTextDatum(group->backend_type);
+				else
+					nulls[j++] = true;
+				break;
 		}
 
-		// cmdtype
-		if (AshEntryArray[i].cmdtype[0] != '\0')
-                        values[j++] = CStringGetTextDatum(AshEntryArray[i].cmdtype);
-		else
-                        nulls[j++] = true;
+		// samples
+		values[j++] = Int64GetDatum(group->samples);
+
+		// pct, of the weight of the samples of the range
+		values[j++] = Float8GetDatum(result->total > 0 ?
+									 100.0 * group->sample_weight / result->total : 0);
 
-		// query_id - apply privilege check
-		if (show_text)
+		// query
+		if (result->kind == ASH_TOP_QUERIES)
 		{
-			if (AshEntryArray[i].queryid)
-				values[j++] = Int64GetDatum(AshEntryArray[i].queryid);
+			if (group->query != NULL)
+				values[j++] = CStringGetTextDatum(group->query);
 			else
 				nulls[j++] = true;
 		}
-		else
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+Datum
+pg_active_session_history(PG_FUNCTION_ARGS)
+{
+	if (SRF_IS_FIRSTCALL())
+	{
+		TimestampTz from = DT_NOBEGIN;
+		TimestampTz to = DT_NOEND;
+		ashFilter filter;
+
+		memset(&filter, 0, sizeof(filter));
+
+		/*
+		 * pg_active_session_history(from_time, to_time, pid, queryid, datid,
+		 * usesysid, wait_event_type, backend_type), NULL for no bound or
+		 * filter
+		 */
+		if (PG_NARGS() >= 8)
 		{
-			nulls[j++] = true;
+			if (!PG_ARGISNULL(0))
+				from = PG_GETARG_TIMESTAMPTZ(0);
+			if (!PG_ARGISNULL(1))
+				to = PG_GETARG_TIMESTAMPTZ(1);
+			if ((filter.has_pid = !PG_ARGISNULL(2)))
+				filter.pid = PG_GETARG_INT32(2);
+			if ((filter.has_queryid = !PG_ARGISNULL(3)))
+				filter.queryid = (uint64) PG_GETARG_INT64(3);
+			if ((filter.has_datid = !PG_ARGISNULL(4)))
+				filter.datid = PG_GETARG_OID(4);
+			if ((filter.has_usesysid = !PG_ARGISNULL(5)))
+				filter.usesysid = PG_GETARG_OID(5);
+			if (!PG_ARGISNULL(6))
+				filter.wait_event_type = text_to_cstring(PG_GETARG_TEXT_PP(6));
+			if (!PG_ARGISNULL(7))
+				filter.backend_type = text_to_cstring(PG_GETARG_TEXT_PP(7));
 		}
 
+		pg_active_session_history_begin(fcinfo, from, to, &filter);
+	}
 
-		// backend_type
-		if (AshEntryArray[i].backend_type[0] != '\0')
-			values[j++] = CStringGetTextDatum(AshEntryArray[i].backend_type);
-		else
-			nulls[j++] = true;
-
-		// blockers
-		if (Int32GetDatum(AshEntryArray[i].blockers))
-			values[j++] = Int32GetDatum(AshEntryArray[i].blockers);
-		else
-			nulls[j++] = true;
+	return pg_active_session_history_internal(fcinfo);
+}
 
-		// blockerspid
-		if (Int32GetDatum(AshEntryArray[i].blockerpid))
-			values[j++] = Int32GetDatum(AshEntryArray[i].blockerpid);
-		else
-			nulls[j++] = true;
+/*
+ * pg_stat_statements_history(from_time, to_time, queryid, userid, dbid), NULL
+ * for no bound or filter, and the same for
+ * pg_stat_statements_history_deltas()
+ */
+static void
+pgssh_begin_args(FunctionCallInfo fcinfo, bool deltas)
+{
+	TimestampTz from = DT_NOBEGIN;
+	TimestampTz to = DT_NOEND;
+	ashFilter filter;
 
-		// blocker state
-		if (AshEntryArray[i].blocker_state[0] != '\0')
-			values[j++] = CStringGetTextDatum(AshEntryArray[i].blocker_state);
-		else
-			nulls[j++] = true;
+	memset(&filter, 0, sizeof(filter));
 
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	if (PG_NARGS() >= 5)
+	{
+		if (!PG_ARGISNULL(0))
+			from = PG_GETARG_TIMESTAMPTZ(0);
+		if (!PG_ARGISNULL(1))
+			to = PG_GETARG_TIMESTAMPTZ(1);
+		if ((filter.has_queryid = !PG_ARGISNULL(2)))
+			filter.queryid = (uint64) PG_GETARG_INT64(2);
+		if ((filter.has_usesysid = !PG_ARGISNULL(3)))
+			filter.usesysid = PG_GETARG_OID(3);
+		if ((filter.has_datid = !PG_ARGISNULL(4)))
+			filter.datid = PG_GETARG_OID(4);
 	}
+
+	pg_stat_statements_history_begin(fcinfo, from, to, &filter, deltas);
 }
 
+Datum
+pg_stat_statements_history(PG_FUNCTION_ARGS)
+{
+	if (SRF_IS_FIRSTCALL())
+		pgssh_begin_args(fcinfo, false);
+
+	return pg_stat_statements_history_internal(fcinfo);
+}
 
-static void
-pg_stat_statements_history_internal(FunctionCallInfo fcinfo)
+Datum
+pg_stat_statements_history_deltas(PG_FUNCTION_ARGS)
 {
-	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	TupleDesc       tupdesc;
-	Tuplestorestate *tupstore;
-	MemoryContext per_query_ctx;
-	MemoryContext oldcontext;
-	int i;
-	Oid         userid = GetUserId();
-	bool        is_allowed_role = IS_ALLOWED_ROLE(userid);
+	if (SRF_IS_FIRSTCALL())
+		pgssh_begin_args(fcinfo, true);
 
-	if (!pgssh_enable)
-		ereport(ERROR,
-			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				errmsg("pg_stat_statements_history not enabled, set pgsentinel_pgssh.enable")));
-	/* Entry array must exist already */
-	if (!PgsshEntryArray)
-		ereport(ERROR,
-			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				errmsg("pg_stat_statements_history must be loaded via shared_preload_libraries")));
+	return pg_stat_statements_history_internal(fcinfo);
+}
 
-	/* check to see if caller supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				errmsg("set-valued function called in context that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				errmsg("materialize mode required, but it is not " \
-					   "allowed in this context")));
+Datum
+pg_active_session_history_summary(PG_FUNCTION_ARGS)
+{
+	if (SRF_IS_FIRSTCALL())
+	{
+		TimestampTz from = DT_NOBEGIN;
+		TimestampTz to = DT_NOEND;
+
+		/*
+		 * pg_active_session_history_summary(from_time, to_time), NULL for no
+		 * bound
+		 */
+		if (PG_NARGS() >= 2)
+		{
+			if (!PG_ARGISNULL(0))
+				from = PG_GETARG_TIMESTAMPTZ(0);
+			if (!PG_ARGISNULL(1))
+				to = PG_GETARG_TIMESTAMPTZ(1);
+		}
 
-	/* Switch context to construct returned data structures */
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+		pg_active_session_history_summary_begin(fcinfo, from, to);
+	}
 
-	/* Build a tuple descriptor */
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+	return pg_active_session_history_summary_internal(fcinfo);
+}
 
-	tupstore = tuplestore_begin_heap(true, false, work_mem);
-	rsinfo->returnMode = SFRM_Materialize;
-	rsinfo->setResult = tupstore;
-	rsinfo->setDesc = tupdesc;
+Datum
+ash_top_queries(PG_FUNCTION_ARGS)
+{
+	if (SRF_IS_FIRSTCALL())
+		ash_top_begin(fcinfo, ASH_TOP_QUERIES);
 
-	MemoryContextSwitchTo(oldcontext);
+	return ash_top_internal(fcinfo);
+}
 
-	for (i = 0; i < pgssh_max_entries; i++)
-	{
-		Datum           values[PG_STAT_STATEMENTS_HISTORY_COLS];
-		bool            nulls[PG_STAT_STATEMENTS_HISTORY_COLS];
-		int             j = 0;
-		bool            show_text;
-#if PG_VERSION_NUM >= 130000
-		char        buf[256];
-		Datum       wal_bytes;
-#endif
+Datum
+ash_top_waits(PG_FUNCTION_ARGS)
+{
+	if (SRF_IS_FIRSTCALL())
+		ash_top_begin(fcinfo, ASH_TOP_WAITS);
 
-		memset(values, 0, sizeof(values));
-		memset(nulls, 0, sizeof(nulls));
+	return ash_top_internal(fcinfo);
+}
 
-		// ash_time
-		if (TimestampTzGetDatum(PgsshEntryArray[i].ash_time))
-			values[j++] = TimestampTzGetDatum(PgsshEntryArray[i].ash_time);
-		else
-			break;
+Datum
+ash_top_sessions(PG_FUNCTION_ARGS)
+{
+	if (SRF_IS_FIRSTCALL())
+		ash_top_begin(fcinfo, ASH_TOP_SESSIONS);
 
-		// userid
-		if (ObjectIdGetDatum(PgsshEntryArray[i].userid))
-			values[j++] = ObjectIdGetDatum(PgsshEntryArray[i].userid);
-		else
-			nulls[j++] = true;
+	return ash_top_internal(fcinfo);
+}
 
-		// dbid
-		if (ObjectIdGetDatum(PgsshEntryArray[i].dbid))
-			values[j++] = ObjectIdGetDatum(PgsshEntryArray[i].dbid);
-		else
-			nulls[j++] = true;
+/* bigint[] of a pgsentinel_stats histogram */
+static Datum
+ash_stats_histogram(const uint64 *hist)
+{
+	Datum datums[ASH_STATS_HIST_BUCKETS];
+	int i;
 
-		show_text = is_allowed_role || PgsshEntryArray[i].userid == userid;
+	for (i = 0; i < ASH_STATS_HIST_BUCKETS; i++)
+		datums[i] = Int64GetDatum((int64) hist[i]);
 
-		// query_id - apply privilege check
-		if (show_text)
-		{
-			if (Int64GetDatum(PgsshEntryArray[i].queryid))
-				values[j++] = Int64GetDatum(PgsshEntryArray[i].queryid);
-			else
-				nulls[j++] = true;
-		}
-		else
-		{
-			nulls[j++] = true;
-		}
+	return PointerGetDatum(construct_array(datums, ASH_STATS_HIST_BUCKETS,
+										   INT8OID, sizeof(int64),
+										   FLOAT8PASSBYVAL, 'd'));
+}
 
-		// calls
-		if (Int64GetDatum(PgsshEntryArray[i].calls))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].calls);
-		else
-			values[j++] = 0;
+/* Part of a buffer of max slots in use, n of them being used */
+static int64
+ash_stats_used(Size bytes, uint64 n, uint64 max)
+{
+	if (max == 0)
+		return 0;
+	return (int64) ((double) bytes * Min(n, max) / max);
+}
 
-		// total_time
-		if (Float8GetDatum(PgsshEntryArray[i].total_time))
-			values[j++] = Float8GetDatum(PgsshEntryArray[i].total_time);
-		else
-			values[j++] = 0;
+/* Bytes of data in the compressed pgssh blocks */
+static int64
+ash_stats_pgssh_block_bytes(void)
+{
+	uint64 last = pg_atomic_read_u64(&IntEntryArray[0].pgssh_block_head);
+	uint64 no;
+	int64 bytes = 0;
 
-		// rows
-		if (Int64GetDatum(PgsshEntryArray[i].rows))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].rows);
-		else
-			values[j++] = 0;
+	/* unlocked peek, it is only an estimate */
+	for (no = pgssh_first_block(last); no <= last; no++)
+	{
+		pgsshBlock *block = &PgsshBlocks[(no - 1) % pgssh_nblocks()];
 
-		// shared_blks_hit
-		if (Int64GetDatum(PgsshEntryArray[i].shared_blks_hit))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].shared_blks_hit);
-		else
-			values[j++] = 0;
+		if (block->no == no)
+			bytes += offsetof(pgsshBlock, data) + block->used;
+	}
+	return bytes;
+}
 
-		// shared_blks_read
-		if (Int64GetDatum(PgsshEntryArray[i].shared_blks_read))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].shared_blks_read);
-		else
-			values[j++] = 0;
+/*
+ * Counters of the worker: how often and how late it samples, what a sample
+ * costs, its last error and the memory its buffers use.  The counters are
+ * read without locking, each of them is only written by the worker.
+ */
+Datum
+pgsentinel_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupdesc;
+	Datum values[PGSENTINEL_STATS_COLS];
+	bool nulls[PGSENTINEL_STATS_COLS];
+	intEntry *stats;
+	volatile ashStatsError *slot;
+	ashStatsError error;
+	uint64 ash_head;
+	uint64 pgssh_head;
+	uint64 summary_head;
+	int j = 0;
+	int i;
 
-		// shared_blks_dirtied
-		if (Int64GetDatum(PgsshEntryArray[i].shared_blks_dirtied))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].shared_blks_dirtied);
-		else
-			values[j++] = 0;
+	if (!IntEntryArray)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("pgsentinel must be loaded via shared_preload_libraries")));
 
-		// shared_blks_written
-		if (Int64GetDatum(PgsshEntryArray[i].shared_blks_written))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].shared_blks_written);
-		else
-			values[j++] = 0;
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupdesc = BlessTupleDesc(tupdesc);
 
-		// local_blks_hit
-		if (Int64GetDatum(PgsshEntryArray[i].local_blks_hit))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].local_blks_hit);
-		else
-			values[j++] = 0;
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
 
-		// local_blks_read
-		if (Int64GetDatum(PgsshEntryArray[i].local_blks_read))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].local_blks_read);
-		else
-			values[j++] = 0;
+	stats = &IntEntryArray[0];
+	ash_head = pg_atomic_read_u64(&stats->ash_head);
+	pgssh_head = pg_atomic_read_u64(&stats->pgssh_head);
+	summary_head = pg_atomic_read_u64(&stats->summary_head);
+	slot = &stats->last_error;
+	ASH_READ_SLOT(slot, &error);
 
-		// local_blks_dirtied
-		if (Int64GetDatum(PgsshEntryArray[i].local_blks_dirtied))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].local_blks_dirtied);
-		else
-			values[j++] = 0;
+	// samples
+	values[j++] = Int64GetDatum((int64) stats->ticks);
 
-		// local_blks_written
-		if (Int64GetDatum(PgsshEntryArray[i].local_blks_written))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].local_blks_written);
-		else
-			values[j++] = 0;
+	// missed_ticks
+	values[j++] = Int64GetDatum((int64) stats->missed_ticks);
 
-		// temp_blks_read
-		if (Int64GetDatum(PgsshEntryArray[i].temp_blks_read))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].temp_blks_read);
-		else
-			values[j++] = 0;
+	// last_tick
+	if (stats->ticks > 0)
+		values[j++] = TimestampTzGetDatum(stats->last_tick);
+	else
+		nulls[j++] = true;
 
-		// temp_blks_written
-		if (Int64GetDatum(PgsshEntryArray[i].temp_blks_written))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].temp_blks_written);
-		else
-			values[j++] = 0;
+	// last_tick_lag, max_tick_lag and avg_tick_lag, in ms
+	values[j++] = Float8GetDatum(stats->last_tick_lag / 1000.0);
+	values[j++] = Float8GetDatum(stats->max_tick_lag / 1000.0);
+	if (stats->ticks > 0)
+		values[j++] = Float8GetDatum(stats->total_tick_lag / 1000.0 / stats->ticks);
+	else
+		nulls[j++] = true;
 
-		// blk_read_time
-		if (Float8GetDatum(PgsshEntryArray[i].blk_read_time))
-			values[j++] = Float8GetDatum(PgsshEntryArray[i].blk_read_time);
-		else
-			values[j++] = 0;
+	// sampling_period, in ms, and sample_fraction
+	if (stats->ticks > 0)
+	{
+		values[j++] = Float8GetDatum(stats->sample_period / 1000.0);
+		values[j++] = Float8GetDatum(stats->sample_fraction);
+	}
+	else
+	{
+		nulls[j++] = true;
+		nulls[j++] = true;
+	}
 
-		// blk_write_time
-		if (Float8GetDatum(PgsshEntryArray[i].blk_write_time))
-			values[j++] = Float8GetDatum(PgsshEntryArray[i].blk_write_time);
-		else
-			values[j++] = 0;
-#if PG_VERSION_NUM >= 130000
-		// plans
-		if (Int64GetDatum(PgsshEntryArray[i].plans))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].plans);
-		else
-			values[j++] = 0;
+	// ash_rows and ash_wraps
+	values[j++] = Int64GetDatum((int64) ash_head);
+	values[j++] = Int64GetDatum((int64) (ash_head / ash_max_entries));
 
-		// total_plan_time
-		if (Float8GetDatum(PgsshEntryArray[i].total_plan_time))
-			values[j++] = Float8GetDatum(PgsshEntryArray[i].total_plan_time);
-		else
-			values[j++] = 0;
+	// pgssh_rows
+	values[j++] = Int64GetDatum((int64) pgssh_head);
 
-		// wal_records
-		if (Int64GetDatum(PgsshEntryArray[i].wal_records))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].wal_records);
-		else
-			values[j++] = 0;
+	// summary_rows
+	values[j++] = Int64GetDatum((int64) summary_head);
 
-		// wal_fpi
-		if (Int64GetDatum(PgsshEntryArray[i].wal_fpi))
-			values[j++] = Int64GetDatum(PgsshEntryArray[i].wal_fpi);
-		else
-			values[j++] = 0;
+	// archived_rows and archive_lost
+	values[j++] = Int64GetDatum((int64) stats->archived_seq);
+	values[j++] = Int64GetDatum((int64) stats->archive_lost);
 
-		// wal_bytes
-		snprintf(buf, sizeof buf, UINT64_FORMAT, PgsshEntryArray[i].wal_bytes);
-		/* Convert to numeric. */
-		wal_bytes = DirectFunctionCall3(numeric_in,
-										CStringGetDatum(buf),
-										ObjectIdGetDatum(0),
-										Int32GetDatum(-1));
+	// capture_time, store_time and pgssh_time, in ms, with their histograms
+	for (i = 0; i < ASH_STATS_NPHASES; i++)
+	{
+		values[j++] = Float8GetDatum(stats->phase_time[i] / 1000.0);
+		values[j++] = ash_stats_histogram(stats->phase_hist[i]);
+	}
 
-		values[j++] = wal_bytes;
-#else
-		nulls[j++] = true;
-		nulls[j++] = true;
-		nulls[j++] = true;
+	// dictionary_full
+	values[j++] = BoolGetDatum(stats->dictfull);
+
+	// query_text_evictions
+	values[j++] = Int64GetDatum((int64) stats->qtextevictions);
+
+	// last_error and last_error_time, which could tell about queries
+	if (error.time != 0 && IS_ALLOWED_ROLE(GetUserId()))
+	{
+		values[j++] = CStringGetTextDatum(error.message);
+		values[j++] = TimestampTzGetDatum(error.time);
+	}
+	else
+	{
 		nulls[j++] = true;
 		nulls[j++] = true;
-#endif
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
-        }
+	}
+
+	// ash_bytes and ash_used_bytes
+	values[j++] = Int64GetDatum((int64) ash_entry_memsize());
+	values[j++] = Int64GetDatum(ash_stats_used(ash_entry_memsize(), ash_head,
+											   ash_max_entries));
+
+	// pgssh_bytes and pgssh_used_bytes
+	if (PgsshBlocks)
+	{
+		values[j++] = Int64GetDatum((int64) pgssh_entry_memsize());
+		values[j++] = Int64GetDatum(ash_stats_pgssh_block_bytes());
+	}
+	else if (PgsshEntryArray)
+	{
+		values[j++] = Int64GetDatum((int64) pgssh_entry_memsize());
+		values[j++] = Int64GetDatum(ash_stats_used(pgssh_entry_memsize(),
+												   pgssh_head,
+												   pgssh_max_entries));
+	}
+	else
+	{
+		values[j++] = Int64GetDatum(0);
+		values[j++] = Int64GetDatum(0);
+	}
+
+	// summary_bytes and summary_used_bytes
+	if (AshSummaryArray)
+	{
+		values[j++] = Int64GetDatum((int64) ash_summary_memsize());
+		values[j++] = Int64GetDatum(ash_stats_used(ash_summary_memsize(),
+												   summary_head,
+												   ash_summary_max_entries));
+	}
+	else
+	{
+		values[j++] = Int64GetDatum(0);
+		values[j++] = Int64GetDatum(0);
+	}
+
+	// dictionary_bytes and dictionary_used_bytes
+	values[j++] = Int64GetDatum((int64) ash_dict_memsize());
+	values[j++] = Int64GetDatum(ash_stats_used(ash_dict_memsize(),
+											   stats->dictentries,
+											   ash_dict_max_entries));
+
+	// query_text_bytes and query_text_used_bytes
+	values[j++] = Int64GetDatum((int64) ash_qtext_memsize());
+	values[j++] = Int64GetDatum(ash_stats_used(ash_qtext_memsize(),
+											   stats->qtextentries,
+											   ash_max_query_texts));
+
+	Assert(j == PGSENTINEL_STATS_COLS);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
-Datum
-pg_active_session_history(PG_FUNCTION_ARGS)
+/* request of the running pgsentinel_bench_fill() */
+static uint64 ash_bench_request = 0;
+
+/* Withdraw the request of a failed pgsentinel_bench_fill() if still pending */
+static void
+ash_bench_fill_cancel(int code, Datum arg)
 {
-	pg_active_session_history_internal(fcinfo);
-	return (Datum) 0;
+	uint64 expected = ash_bench_request;
+
+	(void) pg_atomic_compare_exchange_u64(&IntEntryArray[0].bench_fill,
+										  &expected, 0);
 }
 
+/*
+ * pgsentinel_bench_fill(entries, sessions): have the worker append entries
+ * synthetic entries of sessions sessions to the history (see
+ * ash_bench_fill()) and wait until it has.  Only meant for the read path
+ * benchmark and stress test, which create the function and turn
+ * pgsentinel_ash.bench on: the extension scripts do neither.
+ */
 Datum
-pg_stat_statements_history(PG_FUNCTION_ARGS)
+pgsentinel_bench_fill(PG_FUNCTION_ARGS)
 {
-	pg_stat_statements_history_internal(fcinfo);
-	return (Datum) 0;
+	int64 entries = PG_GETARG_INT64(0);
+	int32 sessions = PG_GETARG_INT32(1);
+	uint64 expected = 0;
+	uint64 request;
+	Latch *latch;
+	TimestampTz deadline;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to fill pg_active_session_history")));
+
+	if (!ash_bench)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("pgsentinel_bench_fill() not enabled, set pgsentinel_ash.bench")));
+
+	/* Entry array must exist already */
+	if (!AshEntryArray)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				errmsg("pg_active_session_history must be loaded via shared_preload_libraries")));
+
+	if (entries <= 0 || (uint64) entries > ASH_BENCH_MAX_ENTRIES ||
+		sessions <= 0 || sessions > ASH_BENCH_MAX_SESSIONS)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("entries must be between 1 and " UINT64_FORMAT " and sessions between 1 and %d",
+						ASH_BENCH_MAX_ENTRIES, ASH_BENCH_MAX_SESSIONS)));
+
+	request = ((uint64) sessions << ASH_BENCH_SESSIONS_SHIFT) | (uint64) entries;
+	if (!pg_atomic_compare_exchange_u64(&IntEntryArray[0].bench_fill, &expected,
+										request))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_IN_USE),
+				 errmsg("another pgsentinel_bench_fill() is in progress")));
+
+	/* a request the worker has not taken yet goes away with the caller */
+	ash_bench_request = request;
+	PG_ENSURE_ERROR_CLEANUP(ash_bench_fill_cancel, (Datum) 0);
+	{
+		latch = IntEntryArray[0].worker_latch;
+		if (latch != NULL)
+			SetLatch(latch);
+
+		/* the worker clears the request once done */
+		deadline = GetCurrentTimestamp() + ASH_BENCH_TIMEOUT * USECS_PER_SEC;
+		while ((expected = pg_atomic_read_u64(&IntEntryArray[0].bench_fill)) != 0)
+		{
+			if (expected == request && GetCurrentTimestamp() > deadline)
+				ereport(ERROR,
+						(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						 errmsg("the pgsentinel worker did not take the request within %d seconds",
+								ASH_BENCH_TIMEOUT)));
+			CHECK_FOR_INTERRUPTS();
+			pg_usleep(10000L);
+		}
+	}
+	PG_END_ENSURE_ERROR_CLEANUP(ash_bench_fill_cancel, (Datum) 0);
+
+	PG_RETURN_VOID();
 }
 
 void
@@ -1990,17 +6861,19 @@ ash_shmem_request(void)
 		ash_prev_shmem_request_hook();
 #endif
 	RequestAddinShmemSpace(ash_entry_memsize());
-	RequestNamedLWLockTranche("Ash Entry Array", 1);
 
 	RequestAddinShmemSpace(proc_entry_memsize());
-	RequestNamedLWLockTranche("Get_parsedinfo Proc Entry Array", 1);
+
+	RequestAddinShmemSpace(ash_dict_memsize());
+
+	/* query text store */
+	RequestAddinShmemSpace(ash_qtext_memsize());
 
 	RequestAddinShmemSpace(int_entry_memsize());
-	RequestNamedLWLockTranche("Int Entry Array", 1);
+
+	if (ash_summary_max_entries > 0)
+		RequestAddinShmemSpace(ash_summary_memsize());
 
 	if (pgssh_enable)
-	{
 		RequestAddinShmemSpace(pgssh_entry_memsize());
-		RequestNamedLWLockTranche("Pgssh Entry Array", 1);
-	}
 }
@@ -2,7 +2,10 @@
 #define __PG_SENTINEL_H__
 
 #include <postgres.h>
+#include "datatype/timestamp.h"
+#include "miscadmin.h"
 #include "parser/analyze.h"
+#include "port/atomics.h"
 
 /* Check PostgreSQL version */
 #if PG_VERSION_NUM < 90600
@@ -20,15 +23,160 @@ extern void getparsedinfo_post_parse_analyze(ParseState *pstate, Query *query, J
 #endif
 /* Estimate amount of shared memory needed */
 extern Size proc_entry_memsize(void);
+extern Size proc_entry_query_size(void);
 extern int get_max_procs_count(void);
 
+/*
+ * Last statement parsed by a backend, written by the backend itself.  With
+ * pgsentinel_ash.lazy_capture, its text is not copied to query: location and
+ * length locate it in the top level query the backend reports in
+ * pg_stat_activity, and the sampler cuts it from there if that query still
+ * has the source_len, head and tail of its source text.
+ * changecount is odd while the backend rewrites the entry.
+ */
+#define PROC_ENTRY_FINGERPRINT 8
+
+/* statement types, stored in a byte as the cmdtype of a procEntry */
+typedef enum procCmdType
+{
+        PROC_CMD_NONE,          /* nothing parsed yet */
+        PROC_CMD_SELECT,
+        PROC_CMD_INSERT,
+        PROC_CMD_UPDATE,
+        PROC_CMD_DELETE,
+        PROC_CMD_MERGE,
+        PROC_CMD_UTILITY,
+        PROC_CMD_UNKNOWN,
+        PROC_CMD_NOTHING
+} procCmdType;
+
+#define PROC_CMD_NTYPES (PROC_CMD_NOTHING + 1)
+
 typedef struct procEntry
 {
+        uint32 changecount;
+        bool lazy;
+        uint8 cmdtype;          /* procCmdType */
+        int location;
+        int length;
+        int source_len;
+        char head[PROC_ENTRY_FINGERPRINT];
+        char tail[PROC_ENTRY_FINGERPRINT];
         uint64 queryid;
-        char *query;
-        char *cmdtype;
+        char *query;            /* proc_entry_query_size() bytes */
 } procEntry;
 
-extern procEntry *ProcEntryArray;
+/*
+ * The entries are padded to a cache line, so that the backends writing
+ * theirs at each statement do not fight over the cache lines of their
+ * neighbors.  Shared memory allocations start on a cache line.
+ */
+typedef union procEntryPadded
+{
+        procEntry entry;
+        char pad[PG_CACHE_LINE_SIZE];
+} procEntryPadded;
+
+extern procEntryPadded *ProcEntryArray;
+extern const char *const procCmdTypeNames[PROC_CMD_NTYPES];
+extern bool ash_lazy_capture;
+extern bool ash_native_sampler;
+
+extern void getparsedinfo_read_entry(int i, procEntry *copy, char *text);
+extern const char *getparsedinfo_lazy_query(const procEntry *entry,
+											const char *source, char *buf);
+
+/*
+ * Bracket the update of a shared slot read without lock: changecount is odd
+ * while it is written, like st_changecount in PgBackendStatus.
+ */
+#define ASH_BEGIN_WRITE(entry) \
+	do { \
+		(entry)->changecount++; \
+		pg_write_barrier(); \
+	} while (0)
+
+#define ASH_END_WRITE(entry) \
+	do { \
+		pg_write_barrier(); \
+		(entry)->changecount++; \
+	} while (0)
+
+/*
+ * Copy a slot, retrying until the copy is consistent.  Never waits for the
+ * writer, which only holds a slot for the time needed to fill it.
+ */
+#define ASH_READ_SLOT(slot, copy) \
+	do { \
+		for (;;) \
+		{ \
+			uint32 before_changecount = (slot)->changecount; \
+			uint32 after_changecount; \
+			pg_read_barrier(); \
+			memcpy((copy), (const void *) (slot), sizeof(*(copy))); \
+			pg_read_barrier(); \
+			after_changecount = (slot)->changecount; \
+			if (before_changecount == after_changecount && \
+				(before_changecount & 1) == 0) \
+				break; \
+			CHECK_FOR_INTERRUPTS(); \
+		} \
+	} while (0)
+
+/*
+ * Decoded ash entry, as read from the ring buffer or from the archive.
+ * Strings are NULL when unknown.
+ */
+typedef struct ashRow
+{
+	uint64 seq;					/* position in the history */
+	TimestampTz ash_time;
+	Oid datid;
+	const char *datname;
+	int pid;
+	int leader_pid;
+	Oid usesysid;
+	const char *usename;
+	const char *application_name;
+	const char *client_addr;
+	const char *client_hostname;
+	int client_port;
+	TimestampTz backend_start;
+	TimestampTz xact_start;
+	TimestampTz query_start;
+	TimestampTz state_change;
+	uint32 wait_event_info;
+	const char *state;
+	TransactionId backend_xid;
+	TransactionId backend_xmin;
+	const char *top_level_query;
+	const char *query;
+	const char *cmdtype;
+	uint64 queryid;
+	const char *backend_type;
+	int blockers;
+	int blockerpid;
+	const char *blocker_state;
+	int root_blockerpid;
+	int blocker_depth;
+	double sample_weight;
+} ashRow;
+
+/* Archive of the ash entries, see ash_archive.c */
+extern int ash_archive_flush_interval;
+extern int ash_archive_segment_size;
+extern int ash_archive_max_size;
+extern int ash_archive_max_age;
+
+typedef struct ashArchiveScan ashArchiveScan;
+
+extern bool ash_archive_write(const ashRow *rows, int nrows);
+extern void ash_archive_sync(void);
+extern void ash_archive_retention(void);
+extern uint64 ash_archive_last_seq(void);
+extern ashArchiveScan *ash_archive_begin_scan(TimestampTz from, TimestampTz to,
+											  uint64 seq_lo, uint64 seq_hi);
+extern bool ash_archive_scan_next(ashArchiveScan *scan, ashRow *row);
+extern void ash_archive_end_scan(ashArchiveScan *scan);
 
 #endif
@@ -0,0 +1,15 @@
+-- The archive, run by installcheck-archive: this session is sampled every
+-- millisecond into a ring of 2000 entries, archived every second
+CREATE EXTENSION pgsentinel;
+select pg_sleep(1);
+create table ash_before as select ash_time, pid, usename, datname, application_name, client_addr, wait_event_type, wait_event, state, top_level_query, query, cmdtype, backend_type from pg_active_session_history where pid = pg_backend_pid();
+-- push these entries out of the ring
+select pg_sleep(5);
+select ash_wraps > 0 AS ring_wrapped, archived_rows > 0 AS has_archived_rows, archive_lost = 0 AS nothing_lost from pgsentinel_stats;
+select count(*) > 0 AS has_rows_before from ash_before;
+select count(*) = 0 AS archived_rows_unchanged from (select * from ash_before except all select ash_time, pid, usename, datname, application_name, client_addr, wait_event_type, wait_event, state, top_level_query, query, cmdtype, backend_type from pg_active_session_history where pid = pg_backend_pid()) s;
+select count(*) = count(distinct (ash_time, pid)) AS no_duplicates, count(*) > (select setting::int from pg_settings where name = 'pgsentinel_ash.max_entries') AS spans_ring_and_archive from pg_active_session_history;
+select count(*) = count(distinct (ash_time, pid)) AS no_duplicates_in_range from pg_active_session_history((select min(ash_time) from ash_before), null);
+select (select min(ash_time) from pg_active_session_history(null, null, filter_pid => pg_backend_pid())) <= (select min(ash_time) from ash_before) AS oldest_archived;
+drop table ash_before;
+DROP EXTENSION pgsentinel;
@@ -2,6 +2,27 @@ CREATE EXTENSION pg_stat_statements;
 CREATE EXTENSION pgsentinel;
 select pg_sleep(3);
 select count(*) > 0 AS has_data from pg_active_session_history where queryid in (select queryid from pg_stat_statements);
+select count(*) > 0 AS has_recent_data from pg_active_session_history(now() - interval '1 hour', now());
+select count(*) = 0 AS no_future_data from pg_active_session_history(now() + interval '1 hour', null);
+select coalesce(bool_and(backend_type = 'client backend'), true) AS filtered_backend_type from pg_active_session_history(null, null, filter_backend_type => 'client backend');
+select count(*) = 0 AS no_pid_zero from pg_active_session_history(null, null, filter_pid => 0);
+select coalesce(sum(samples), 0) > 0 AS has_summary from pg_active_session_history_summary(now() - interval '1 hour', null);
+select samples > 0 AS has_samples, ash_rows > 0 AS has_rows, array_length(capture_time_histogram, 1) = 24 AS has_histogram, ash_used_bytes <= ash_bytes AS ash_bytes_used from pgsentinel_stats;
+select count(*) <= 3 AS top_waits_limited, coalesce(sum(pct), 100) <= 100.001 AS top_waits_pct from ash_top_waits(null, null, 3);
+select (select sum(samples) from ash_top_queries(null, now() - interval '1 second', null)) = (select count(*) from pg_active_session_history(null, now() - interval '1 second')) AS top_queries_complete;
+select coalesce(bool_and((blocker_depth = 0) = (blockerpid is null) and (blocker_depth = 0) = (root_blockerpid is null) and (blocker_depth <> 1 or root_blockerpid = blockerpid)), true) AS blocker_chain_consistent from pg_active_session_history;
+select (select count(*) from get_parsedinfo(pg_backend_pid())) = 1 AS parsedinfo_by_pid, (select count(*) from get_parsedinfo(-1) where pid = pg_backend_pid()) = 1 AS parsedinfo_all;
+select coalesce(bool_and(sample_weight > 0), true) AS positive_sample_weight from pg_active_session_history;
+
+-- pg_stat_statements_history, kept in compressed blocks when run by
+-- installcheck-compress: both formats must give the same results
+select pg_sleep(1);
+select pg_sleep(1);
+select pg_sleep(1);
+select count(*) > 0 AS has_pgssh_data, coalesce(bool_or(calls > 0), false) AS has_pgssh_calls from pg_stat_statements_history(null, null) where queryid in (select queryid from pg_stat_statements where query like 'select pg_sleep%');
+select (select count(*) from pg_stat_statements_history(null, now() - interval '1 second')) = (select count(*) from pg_stat_statements_history_deltas(null, now() - interval '1 second')) AS pgssh_same_rows;
+with h as (select * from pg_stat_statements_history(null, now() - interval '1 second')), d as (select * from pg_stat_statements_history_deltas(null, now() - interval '1 second')), r as (select h.calls, h.rows, h.total_exec_time, first_value(h.calls) over w + coalesce(sum(d.calls) over w, 0) AS sum_calls, first_value(h.rows) over w + coalesce(sum(d.rows) over w, 0) AS sum_rows, first_value(h.total_exec_time) over w + coalesce(sum(d.total_exec_time) over w, 0) AS sum_exec_time from h join d using (ash_time, userid, dbid, queryid) window w as (partition by userid, dbid, queryid order by ash_time))
+select count(*) > 0 AS has_pgssh_rows, coalesce(bool_and(calls = sum_calls and rows = sum_rows and abs(total_exec_time - sum_exec_time) < 0.001), false) AS pgssh_cumulative_is_sum from r;
 
 begin;
 \! sleep 3